@@ -0,0 +1,142 @@
+/*
+ * A minimal benchmark runner in the style of Google Benchmark:
+ *
+ *     BENCHMARK(parse_small) {
+ *         for (auto _ : state) { ... }
+ *         state.setBytesProcessed(state.iterations() * size);
+ *     }
+ *
+ * Every benchmark is run with a doubling number of iterations until a
+ * run takes long enough, and reported as time per iteration and
+ * throughput. --quick makes the runs short, to run them as a test, and
+ * --filter=text only runs the benchmarks with text in their name.
+ */
+
+#ifndef LIBTHINKPAD_BENCH_H
+#define LIBTHINKPAD_BENCH_H
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+class BenchState {
+
+    size_t count;
+    size_t bytes = 0;
+    const char *skipped = nullptr;
+
+public:
+
+    struct Iterator {
+        size_t remaining;
+        bool operator!=(const Iterator &other) const { return remaining != other.remaining; }
+        Iterator &operator++() { remaining--; return *this; }
+        int operator*() const { return 0; }
+    };
+
+    explicit BenchState(size_t count) : count(count) {}
+
+    Iterator begin() { return { count }; }
+    Iterator end() { return { 0 }; }
+
+    size_t iterations() const { return count; }
+    void setBytesProcessed(size_t processed) { bytes = processed; }
+    size_t getBytesProcessed() const { return bytes; }
+
+    /* the benchmark cannot run here, e.g. the CPU lacks an instruction set */
+    void skip(const char *reason) { skipped = reason; }
+    const char *getSkipped() const { return skipped; }
+};
+
+typedef void (*BenchFunction)(BenchState &state);
+
+struct BenchEntry {
+    const char *name;
+    BenchFunction function;
+};
+
+static inline std::vector<BenchEntry> &benchRegistry()
+{
+    static std::vector<BenchEntry> registry;
+    return registry;
+}
+
+struct BenchRegistrar {
+    BenchRegistrar(const char *name, BenchFunction function) {
+        benchRegistry().push_back({ name, function });
+    }
+};
+
+#define BENCHMARK(name) \
+    static void name(BenchState &state); \
+    static BenchRegistrar name##_registrar(#name, name); \
+    static void name(BenchState &state)
+
+/* keep the compiler from dropping a result */
+template<typename T>
+static inline void benchKeep(const T &value)
+{
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+static inline int benchMain(int argc, char **argv)
+{
+    double minSeconds = 0.5;
+    const char *filter = "";
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--quick") == 0) {
+            minSeconds = 0.01;
+        } else if (strncmp(argv[i], "--filter=", 9) == 0) {
+            filter = argv[i] + 9;
+        } else {
+            fprintf(stderr, "usage: %s [--quick] [--filter=text]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    printf("%-40s %12s %14s %12s\n", "benchmark", "iterations", "ns/iteration", "GB/s");
+
+    for (const BenchEntry &entry : benchRegistry()) {
+
+        if (strstr(entry.name, filter) == NULL) {
+            continue;
+        }
+
+        for (size_t count = 1; ; count *= 2) {
+
+            BenchState state(count);
+
+            const auto started = std::chrono::steady_clock::now();
+            entry.function(state);
+            const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+            if (state.getSkipped() != nullptr) {
+                printf("%-40s skipped: %s\n", entry.name, state.getSkipped());
+                break;
+            }
+
+            if (seconds < minSeconds && count < ((size_t) 1 << 30)) {
+                continue;
+            }
+
+            const double perIteration = seconds * 1e9 / (double) count;
+
+            if (state.getBytesProcessed() > 0) {
+                printf("%-40s %12zu %14.1f %12.3f\n", entry.name, count, perIteration,
+                       (double) state.getBytesProcessed() / seconds / 1e9);
+            } else {
+                printf("%-40s %12zu %14.1f %12s\n", entry.name, count, perIteration, "-");
+            }
+
+            break;
+        }
+
+    }
+
+    return 0;
+}
+
+#endif
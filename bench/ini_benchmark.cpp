@@ -0,0 +1,67 @@
+/*
+ * Config parser benchmarks on generated files: small (a single section),
+ * medium (a typical application config) and huge (a few megabytes).
+ * The old goto tokenizer runs on the same files for comparison.
+ */
+
+#include "libthinkpad.h"
+#include "ini_baseline.h"
+#include "ini_corpus.h"
+#include "bench.h"
+
+using ThinkPad::Utilities::Ini::Ini;
+using ThinkPad::Utilities::Ini::IniSection;
+
+static const string &smallFile()
+{
+    static const string file = generateIni(512, 1);
+    return file;
+}
+
+static const string &mediumFile()
+{
+    static const string file = generateIni(64 * 1024, 2);
+    return file;
+}
+
+static const string &hugeFile()
+{
+    static const string file = generateIni(8 * 1024 * 1024, 3);
+    return file;
+}
+
+static void parse(BenchState &state, const string &file)
+{
+    for (auto _ : state) {
+        (void) _;
+        Ini ini;
+        benchKeep(ini.readIniBuffer(file.data(), file.size())->size());
+    }
+
+    state.setBytesProcessed(state.iterations() * file.size());
+}
+
+static void parseBaseline(BenchState &state, const string &file)
+{
+    for (auto _ : state) {
+        (void) _;
+        vector<IniSection*> *sections = baselineParse(file.data(), file.size());
+        benchKeep(sections->size());
+        baselineFree(sections);
+    }
+
+    state.setBytesProcessed(state.iterations() * file.size());
+}
+
+BENCHMARK(ini_baseline_small) { parseBaseline(state, smallFile()); }
+BENCHMARK(ini_baseline_medium) { parseBaseline(state, mediumFile()); }
+BENCHMARK(ini_baseline_huge) { parseBaseline(state, hugeFile()); }
+
+BENCHMARK(ini_parse_small) { parse(state, smallFile()); }
+BENCHMARK(ini_parse_medium) { parse(state, mediumFile()); }
+BENCHMARK(ini_parse_huge) { parse(state, hugeFile()); }
+
+int main(int argc, char **argv)
+{
+    return benchMain(argc, argv);
+}
@@ -0,0 +1,112 @@
+/*
+ * Throughput of the delimiter scanning kernels. The kernels are static,
+ * so the library source is built into the benchmark.
+ *
+ * Every kernel scans a 1 MiB buffer without a match for one and for three
+ * delimiters, which is the raw throughput, and a buffer of 32 byte lines
+ * one line at a time, which is how the config parser calls it.
+ */
+
+#include "../src/libthinkpad.cpp"
+#include "bench.h"
+
+using namespace ThinkPad;
+
+static const string &longBuffer()
+{
+    static const string buffer(1 << 20, 'a');
+    return buffer;
+}
+
+static const string &lineBuffer()
+{
+    static string buffer;
+
+    if (buffer.empty()) {
+        while (buffer.size() < (1 << 20)) {
+            buffer.append("key_with_some_length=value012\n");
+        }
+    }
+
+    return buffer;
+}
+
+static bool supported(const char *name)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (strcmp(name, "avx2") == 0) return __builtin_cpu_supports("avx2");
+    if (strcmp(name, "sse2") == 0) return __builtin_cpu_supports("sse2");
+    return true;
+#else
+    return strcmp(name, "scalar") == 0;
+#endif
+}
+
+static ScanFunction kernel(const char *name)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (strcmp(name, "avx2") == 0) return scanAVX2;
+    if (strcmp(name, "sse2") == 0) return scanSSE2;
+#endif
+    return scanScalar;
+}
+
+static void scanLong(BenchState &state, const char *name, const char *set)
+{
+    if (!supported(name)) {
+        state.skip("not supported by the CPU");
+        return;
+    }
+
+    const ScanFunction scan = kernel(name);
+    const string &buffer = longBuffer();
+    const int count = (int) strlen(set);
+
+    for (auto _ : state) {
+        (void) _;
+        benchKeep(scan(buffer.data(), buffer.data() + buffer.size(), set, count));
+    }
+
+    state.setBytesProcessed(state.iterations() * buffer.size());
+}
+
+static void scanLines(BenchState &state, const char *name)
+{
+    if (!supported(name)) {
+        state.skip("not supported by the CPU");
+        return;
+    }
+
+    const ScanFunction scan = kernel(name);
+    const string &buffer = lineBuffer();
+    const char *end = buffer.data() + buffer.size();
+
+    for (auto _ : state) {
+        (void) _;
+        for (const char *line = buffer.data(); line < end; ) {
+            const char *newline = scan(line, end, "\n", 1);
+            benchKeep(scan(line, newline, "=", 1));
+            line = newline + 1;
+        }
+    }
+
+    state.setBytesProcessed(state.iterations() * buffer.size());
+}
+
+BENCHMARK(scan_scalar_1) { scanLong(state, "scalar", "\n"); }
+BENCHMARK(scan_sse2_1) { scanLong(state, "sse2", "\n"); }
+BENCHMARK(scan_avx2_1) { scanLong(state, "avx2", "\n"); }
+
+BENCHMARK(scan_scalar_3) { scanLong(state, "scalar", ";#\n"); }
+BENCHMARK(scan_sse2_3) { scanLong(state, "sse2", ";#\n"); }
+BENCHMARK(scan_avx2_3) { scanLong(state, "avx2", ";#\n"); }
+
+BENCHMARK(scan_scalar_lines) { scanLines(state, "scalar"); }
+BENCHMARK(scan_sse2_lines) { scanLines(state, "sse2"); }
+BENCHMARK(scan_avx2_lines) { scanLines(state, "avx2"); }
+
+int main(int argc, char **argv)
+{
+    return benchMain(argc, argv);
+}
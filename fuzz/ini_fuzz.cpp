@@ -0,0 +1,151 @@
+/*
+ * Fuzz target for the config parser.
+ *
+ * Built with -DLIBTHINKPAD_FUZZ=ON and clang, this is a libFuzzer target
+ * (and an AFL++ one through afl-clang-fast++ -fsanitize=fuzzer):
+ *
+ *     ./ini_fuzz fuzz/corpus
+ *
+ * Built with INI_FUZZ_MAIN, it runs the files and directories given on
+ * the command line once, or stdin if there are none, which is how the
+ * corpus is replayed as a test and how plain AFL runs it.
+ */
+
+#include "libthinkpad.h"
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+using ThinkPad::Utilities::Ini::Ini;
+using ThinkPad::Utilities::Ini::IniSection;
+using ThinkPad::Utilities::Ini::IniKeypair;
+using ThinkPad::Utilities::Ini::IniSnapshot;
+
+#define FUZZ_ASSERT(condition) if (!(condition)) { fprintf(stderr, "ini_fuzz: %s\n", #condition); __builtin_trap(); }
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    Ini ini;
+    vector<IniSection*> *sections = ini.readIniBuffer((const char*) data, size, "<fuzz>");
+
+    FUZZ_ASSERT(sections != nullptr);
+
+    for (IniSection *section : *sections) {
+
+        FUZZ_ASSERT(strnlen(section->name, sizeof(section->name)) < sizeof(section->name));
+
+        for (IniKeypair *keypair : *section->keypairs) {
+            FUZZ_ASSERT(strnlen(keypair->key, sizeof(keypair->key)) < sizeof(keypair->key));
+            FUZZ_ASSERT(strnlen(keypair->value, sizeof(keypair->value)) < sizeof(keypair->value));
+            FUZZ_ASSERT(keypair->key[0] != 0);
+            FUZZ_ASSERT(section->getString(keypair->key) != nullptr);
+        }
+
+    }
+
+    /* the snapshot has to hold the same document */
+    std::unique_ptr<IniSnapshot> snapshot(ini.freeze());
+
+    FUZZ_ASSERT(snapshot->getSectionCount() == sections->size());
+
+    for (size_t i = 0; i < sections->size(); i++) {
+
+        IniSection *section = (*sections)[i];
+
+        FUZZ_ASSERT(strcmp(snapshot->getSectionName(i), section->name) == 0);
+        FUZZ_ASSERT(snapshot->getKeypairCount(i) == section->keypairs->size());
+
+        for (size_t j = 0; j < section->keypairs->size(); j++) {
+            FUZZ_ASSERT(strcmp(snapshot->getKey(i, j), (*section->keypairs)[j]->key) == 0);
+            FUZZ_ASSERT(strcmp(snapshot->getValue(i, j), (*section->keypairs)[j]->value) == 0);
+        }
+
+    }
+
+    return 0;
+}
+
+#ifdef INI_FUZZ_MAIN
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static bool runFile(int fd)
+{
+    string input;
+    char buf[4096];
+    ssize_t len;
+
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+        input.append(buf, (size_t) len);
+    }
+
+    if (len < 0) {
+        return false;
+    }
+
+    LLVMFuzzerTestOneInput((const uint8_t*) input.data(), input.size());
+
+    return true;
+}
+
+static int runPath(const string &path)
+{
+    struct stat buf;
+
+    if (stat(path.c_str(), &buf) < 0) {
+        fprintf(stderr, "ini_fuzz: %s: %s\n", path.c_str(), strerror(errno));
+        return 1;
+    }
+
+    if (S_ISDIR(buf.st_mode)) {
+
+        DIR *dir = opendir(path.c_str());
+        struct dirent *entry;
+        int failures = 0;
+
+        while (dir != NULL && (entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] != '.') {
+                failures += runPath(path + "/" + entry->d_name);
+            }
+        }
+
+        if (dir != NULL) {
+            closedir(dir);
+        }
+
+        return failures;
+    }
+
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0 || !runFile(fd)) {
+        fprintf(stderr, "ini_fuzz: %s: %s\n", path.c_str(), strerror(errno));
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+
+    close(fd);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        return runFile(STDIN_FILENO) ? 0 : 1;
+    }
+
+    int failures = 0;
+
+    for (int i = 1; i < argc; i++) {
+        failures += runPath(argv[i]);
+    }
+
+    return failures == 0 ? 0 : 1;
+}
+
+#endif
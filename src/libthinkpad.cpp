@@ -36,10 +36,23 @@
 
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+#include <dirent.h>
+#include <glob.h>
+#include <time.h>
+#include <locale.h>
+#include <atomic>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 #include <sys/types.h>
 #include <unistd.h>
 #include <cstring>
-#include <sstream>
 #include <iostream>
 #include <pthread.h>
 #include <sys/socket.h>
@@ -47,1047 +60,6433 @@
 #include <libudev.h>
 #include <limits.h>
 #include <cstring>
+#include <strings.h>
 #include <math.h>
+#include <algorithm>
+#include <cstddef>
+#include <unordered_map>
+#include <unordered_set>
+#include <mutex>
+#include <cstdarg>
 
 using std::cout;
 using std::endl;
-using std::ostringstream;
 
 namespace ThinkPad {
 
-    /******************** Dock ********************/
+    /******************** Scanner ********************/
 
-    bool Hardware::Dock::isDocked() {
-        const int fd = open(IBM_DOCK_DOCKED, O_RDONLY);
-        if (fd == ERR_INVALID) {
-            close(fd);
-            return false;
-        }
-        char status[1];
-        ssize_t readBytes = read(fd, status, 1);
-        if (readBytes == ERR_INVALID) {
-            close(fd);
-            return false;
+    /*
+     * Finds the first occurrence of any of up to SCAN_MAX_SET characters
+     * in [begin, end), or returns nullptr. The acpid and the config parsers
+     * spend most of their time looking for newlines and delimiters, so the
+     * kernel is picked once at startup from the CPU features.
+     */
+#define SCAN_MAX_SET 4
+
+    typedef const char *(*ScanFunction)(const char *begin, const char *end, const char *set, int count);
+
+    static const char *scanScalar(const char *begin, const char *end, const char *set, int count)
+    {
+        for (const char *ptr = begin; ptr < end; ptr++) {
+            for (int i = 0; i < count; i++) {
+                if (*ptr == set[i]) return ptr;
+            }
         }
-        close(fd);
-        return status[0] == '1';
+
+        return nullptr;
     }
 
-    bool Hardware::Dock::probe() {
-        const int fd = open(IBM_DOCK_MODALIAS, O_RDONLY);
-        if (fd == ERR_INVALID) {
-            close(fd);
-            return false;
-        }
-        struct stat buf;
-        STATUS status = fstat(fd, &buf);
-        if (status == ERR_INVALID) {
-            close(fd);
-            return false;
-        }
-        // allocate +1 bytes for the null terminator
-        char readBuffer[buf.st_size + 1];
-        ssize_t bytesRead = read(fd, readBuffer, (size_t) buf.st_size);
-        readBuffer[buf.st_size] = 0;
-        if (bytesRead == ERR_INVALID) {
-            close(fd);
-            return false;
+#if defined(__x86_64__) || defined(__i386__)
+
+    __attribute__((target("sse2")))
+    static const char *scanSSE2(const char *begin, const char *end, const char *set, int count)
+    {
+        __m128i needles[SCAN_MAX_SET];
+
+        for (int i = 0; i < count; i++) {
+            needles[i] = _mm_set1_epi8(set[i]);
         }
-        return strcmp(readBuffer, IBM_DOCK_ID) == 0;
-    }
 
-    /******************** PowerManager ********************/
+        const char *ptr = begin;
 
-    bool PowerManagement::PowerStateManager::suspend() {
+        for (; end - ptr >= 16; ptr += 16) {
 
-#ifdef SYSTEMD
+            const __m128i block = _mm_loadu_si128((const __m128i *) ptr);
+            __m128i match = _mm_cmpeq_epi8(block, needles[0]);
 
-        sd_bus_error error = SD_BUS_ERROR_NULL;
-        sd_bus *bus = nullptr;
-        int status;
+            for (int i = 1; i < count; i++) {
+                match = _mm_or_si128(match, _mm_cmpeq_epi8(block, needles[i]));
+            }
 
-        status = sd_bus_open_system(&bus);
+            const int mask = _mm_movemask_epi8(match);
+
+            if (mask != 0) {
+                return ptr + __builtin_ctz((unsigned int) mask);
+            }
 
-        if (status < 0) {
-            fprintf(stderr, "Connecting to D-Bus failed");
-            return false;
         }
 
-        status = sd_bus_call_method(bus,
-                                    "org.freedesktop.login1",
-                                    "/org/freedesktop/login1",
-                                    "org.freedesktop.login1.Manager",
-                                    "Suspend",
-                                    &error,
-                                    NULL,
-                                    "b",
-                                    "1");
+        return scanScalar(ptr, end, set, count);
+    }
 
-        if (status < 0) {
-            fprintf(stderr, "Error calling suspend on logind: %s\n", error.message);
-            return false;
+    __attribute__((target("avx2")))
+    static const char *scanAVX2(const char *begin, const char *end, const char *set, int count)
+    {
+        __m256i needles[SCAN_MAX_SET];
+
+        for (int i = 0; i < count; i++) {
+            needles[i] = _mm256_set1_epi8(set[i]);
         }
 
-        sd_bus_error_free(&error);
-        sd_bus_unref(bus);
+        const char *ptr = begin;
 
-        return true;
+        for (; end - ptr >= 32; ptr += 32) {
 
-#endif
+            const __m256i block = _mm256_loadu_si256((const __m256i *) ptr);
+            __m256i match = _mm256_cmpeq_epi8(block, needles[0]);
 
-        fprintf(stderr, "no suspend mechanism available\n");
-        return false;
+            for (int i = 1; i < count; i++) {
+                match = _mm256_or_si256(match, _mm256_cmpeq_epi8(block, needles[i]));
+            }
 
-    }
+            const unsigned int mask = (unsigned int) _mm256_movemask_epi8(match);
 
-    bool PowerManagement::PowerStateManager::requestSuspend(SuspendReason reason) {
+            if (mask != 0) {
+                return ptr + __builtin_ctz(mask);
+            }
 
-        Hardware::Dock dock;
+        }
 
-        switch (reason) {
-            case SuspendReason::BUTTON:
-                return PowerManagement::PowerStateManager::suspend();
-            case SuspendReason::LID:
-                if (!dock.probe()) {
-                    fprintf(stderr, "dock is not sane/present");
-                    return false;
-                }
+        /*
+         * The tail stays in this function: calling the legacy encoded
+         * scanSSE2() with the upper halves of the registers dirty costs
+         * more than the short lines of the parsers take to scan
+         */
+        if (end - ptr >= 16) {
 
-                if(!dock.isDocked()) {
-                    PowerManagement::PowerStateManager::suspend();
-                    return true;
-                }
+            const __m128i block = _mm_loadu_si128((const __m128i *) ptr);
+            __m128i match = _mm_cmpeq_epi8(block, _mm256_castsi256_si128(needles[0]));
+
+            for (int i = 1; i < count; i++) {
+                match = _mm_or_si128(match, _mm_cmpeq_epi8(block, _mm256_castsi256_si128(needles[i])));
+            }
+
+            const int mask = _mm_movemask_epi8(match);
+
+            if (mask != 0) {
+                return ptr + __builtin_ctz((unsigned int) mask);
+            }
+
+            ptr += 16;
 
-                fprintf(stderr, "ignoring lid event when docked\n");
-                return false;
-            default:
-                fprintf(stderr, "invalid suspend reason \n");
-                return false;
         }
 
+        return scanScalar(ptr, end, set, count);
     }
 
-    /******************** ACPI ********************/
+#endif
 
-    pthread_t PowerManagement::ACPI::acpid_listener = -1;
-    pthread_t PowerManagement::ACPI::udev_listener = -1;
+    static ScanFunction resolveScan()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
 
-    void *PowerManagement::ACPI::handle_acpid(void *_this) {
+        if (__builtin_cpu_supports("avx2")) {
+            return scanAVX2;
+        }
 
-        ACPI *acpiClass = (ACPI*) _this;
+        if (__builtin_cpu_supports("sse2")) {
+            return scanSSE2;
+        }
+#endif
+        return scanScalar;
+    }
 
-        struct sockaddr_un addr;
+    static const ScanFunction scanKernel = resolveScan();
 
-        memset(&addr, 0, sizeof(struct sockaddr_un));
+    /**
+     * Find the first of the characters of set (at most SCAN_MAX_SET) in [begin, end)
+     * @return the position of the character or nullptr
+     */
+    static inline const char *scanAny(const char *begin, const char *end, const char *set)
+    {
+        return scanKernel(begin, end, set, (int) strlen(set));
+    }
 
-        addr.sun_family = AF_UNIX;
-        strncpy(addr.sun_path, ACPID_SOCK, strlen(ACPID_SOCK));
+    /*
+     * Finds the end of an unquoted config value in [begin, end): the first
+     * newline, or the first ';' or '#' right after a space or a tab. The
+     * character before begin counts as no space. One pass instead of a scan
+     * per comment character, values are full of them in some files.
+     */
+    typedef const char *(*ScanValueFunction)(const char *begin, const char *end);
+
+    static inline bool isValueSpace(char c)
+    {
+        return c == ' ' || c == '\t';
+    }
 
-        int sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    static const char *scanValueScalar(const char *begin, const char *end)
+    {
+        bool space = false;
 
-        if (connect(sfd, (struct sockaddr*) &addr, sizeof(struct sockaddr_un)) < 0) {
-            printf("Connect failed: %s\n", strerror(errno));
-            return NULL;
+        for (const char *ptr = begin; ptr < end; ptr++) {
+            if (*ptr == '\n' || (space && (*ptr == ';' || *ptr == '#'))) return ptr;
+            space = isValueSpace(*ptr);
         }
 
-#ifdef DEBUG
+        return nullptr;
+    }
 
-        printf("starting acpid listener...\n");
+#if defined(__x86_64__) || defined(__i386__)
 
-#endif
+    __attribute__((target("sse2")))
+    static const char *scanValueSSE2(const char *begin, const char *end)
+    {
+        const __m128i newline = _mm_set1_epi8('\n'), semicolon = _mm_set1_epi8(';'), hash = _mm_set1_epi8('#');
+        const __m128i blank = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t');
 
-        char buf[BUFSIZE];
-        char inbuf[INBUFSZ];
+        const char *ptr = begin;
+        unsigned int carry = 0;
 
-        memset(buf, 0, BUFSIZE);
-        memset(inbuf, 0, INBUFSZ);
+        for (; end - ptr >= 16; ptr += 16) {
 
-        int bufptr = 0;
+            const __m128i block = _mm_loadu_si128((const __m128i *) ptr);
 
-        while (read(sfd, inbuf, INBUFSZ) > 0) {
+            const unsigned int newlines = (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+            const unsigned int comments = (unsigned int) _mm_movemask_epi8(
+                    _mm_or_si128(_mm_cmpeq_epi8(block, semicolon), _mm_cmpeq_epi8(block, hash)));
+            const unsigned int spaces = (unsigned int) _mm_movemask_epi8(
+                    _mm_or_si128(_mm_cmpeq_epi8(block, blank), _mm_cmpeq_epi8(block, tab)));
 
-            buf[bufptr] = inbuf[0];
-            bufptr++;
+            const unsigned int hits = newlines | (comments & ((spaces << 1) | carry));
 
-            if (bufptr > BUFSIZE) {
-                printf("Buffer full, purging event...\n");
-                bufptr = 0;
-                memset(buf, 0, BUFSIZE);
+            if (hits != 0) {
+                return ptr + __builtin_ctz(hits);
             }
 
-            if (inbuf[0] == 0x0A) {
-
-                ACPIEvent event = ACPIEvent::UNKNOWN;
+            carry = (spaces >> 15) & 1;
 
-                if (strstr(buf, ACPI_POWERBUTTON) != NULL) {
-                    event = ACPIEvent::BUTTON_POWER;
-                }
+        }
 
-                if (strstr(buf, ACPI_LID_OPEN) != NULL) {
-                    event = ACPIEvent::LID_OPENED;
-                }
+        if (ptr < end && carry != 0 && (*ptr == ';' || *ptr == '#')) {
+            return ptr;
+        }
 
-                if (strstr(buf, ACPI_LID_CLOSE) != NULL) {
-                    event = ACPIEvent::LID_CLOSED;
-                }
+        return scanValueScalar(ptr, end);
+    }
 
-                if (strstr(buf, ACPI_BUTTON_VOLUME_UP) != NULL) {
-                    event = ACPIEvent::BUTTON_VOLUME_UP;
-                }
+    __attribute__((target("avx2")))
+    static const char *scanValueAVX2(const char *begin, const char *end)
+    {
+        const __m256i newline = _mm256_set1_epi8('\n'), semicolon = _mm256_set1_epi8(';'), hash = _mm256_set1_epi8('#');
+        const __m256i blank = _mm256_set1_epi8(' '), tab = _mm256_set1_epi8('\t');
 
-                if (strstr(buf, ACPI_BUTTON_VOLUME_DOWN) != NULL) {
-                    event = ACPIEvent::BUTTON_VOLUME_DOWN;
-                }
+        const char *ptr = begin;
+        unsigned int carry = 0;
 
-                if (strstr(buf, ACPI_BUTTON_BRIGHTNESS_DOWN) != NULL) {
-                    event = ACPIEvent::BUTTON_BRIGHTNESS_DOWN;
-                }
+        for (; end - ptr >= 32; ptr += 32) {
 
-                if (strstr(buf, ACPI_BUTTON_BRIGHTNESS_UP) != NULL) {
-                    event = ACPIEvent::BUTTON_BRIGHTNESS_UP;
-                }
+            const __m256i block = _mm256_loadu_si256((const __m256i *) ptr);
 
-                if (strstr(buf, ACPI_BUTTON_MICMUTE) != NULL) {
-                    event = ACPIEvent::BUTTON_MICMUTE;
-                }
+            const unsigned int newlines = (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline));
+            const unsigned int comments = (unsigned int) _mm256_movemask_epi8(
+                    _mm256_or_si256(_mm256_cmpeq_epi8(block, semicolon), _mm256_cmpeq_epi8(block, hash)));
+            const unsigned int spaces = (unsigned int) _mm256_movemask_epi8(
+                    _mm256_or_si256(_mm256_cmpeq_epi8(block, blank), _mm256_cmpeq_epi8(block, tab)));
 
-                if (strstr(buf, ACPI_BUTTON_MUTE) != NULL) {
-                    event = ACPIEvent::BUTTON_MUTE;
-                }
+            const unsigned int hits = newlines | (comments & ((spaces << 1) | carry));
 
-                if (strstr(buf, ACPI_BUTTON_THINKVANTAGE) != NULL) {
-                    event = ACPIEvent::BUTTON_THINKVANTAGE;
-                }
+            if (hits != 0) {
+                return ptr + __builtin_ctz(hits);
+            }
 
-                if (strstr(buf, ACPI_BUTTON_FNF2_LOCK) != NULL) {
-                    event = ACPIEvent::BUTTON_FNF2_LOCK;
-                }
+            carry = spaces >> 31;
 
-                if (strstr(buf, ACPI_BUTTON_FNF3_BATTERY) != NULL) {
-                    event = ACPIEvent::BUTTON_FNF3_BATTERY;
-                }
+        }
 
-                if (strstr(buf, ACPI_BUTTON_FNF5_WLAN) != NULL) {
-                    event = ACPIEvent::BUTTON_FNF5_WLAN;
-                }
+        /* the tail stays in VEX code too, see scanAVX2() */
+        if (end - ptr >= 16) {
 
-                if (strstr(buf, ACPI_BUTTON_FNF4_SLEEP) != NULL) {
-                    event = ACPIEvent::BUTTON_FNF4_SLEEP;
-                }
+            const __m128i block = _mm_loadu_si128((const __m128i *) ptr);
 
-                if (strstr(buf, ACPI_BUTTON_FNF7_PROJECTOR) != NULL) {
-                    event = ACPIEvent::BUTTON_FNF7_PROJECTOR;
-                }
+            const unsigned int newlines = (unsigned int) _mm_movemask_epi8(
+                    _mm_cmpeq_epi8(block, _mm256_castsi256_si128(newline)));
+            const unsigned int comments = (unsigned int) _mm_movemask_epi8(
+                    _mm_or_si128(_mm_cmpeq_epi8(block, _mm256_castsi256_si128(semicolon)),
+                                 _mm_cmpeq_epi8(block, _mm256_castsi256_si128(hash))));
+            const unsigned int spaces = (unsigned int) _mm_movemask_epi8(
+                    _mm_or_si128(_mm_cmpeq_epi8(block, _mm256_castsi256_si128(blank)),
+                                 _mm_cmpeq_epi8(block, _mm256_castsi256_si128(tab))));
 
-                if (strstr(buf, ACPI_BUTTON_FNF12_HIBERNATE) != NULL) {
-                    event = ACPIEvent::BUTTON_FNF12_SUSPEND;
-                }
+            const unsigned int hits = newlines | (comments & ((spaces << 1) | carry));
 
-                if (strstr(buf, ACPI_DOCK_EVENT) != NULL) {
-                    event = ACPIEvent::DOCKED;
-                }
+            if (hits != 0) {
+                return ptr + __builtin_ctz(hits);
+            }
 
-                if (strstr(buf, ACPI_UNDOCK_EVENT) != NULL) {
-                    event = ACPIEvent::UNDOCKED;
-                }
+            carry = (spaces >> 15) & 1;
+            ptr += 16;
 
-                for (ACPIEventHandler* Acpihandler : *acpiClass->ACPIhandlers) {
+        }
 
-                    pthread_t handler;
-                    ACPIEventMetadata *metadata = (ACPIEventMetadata*) malloc(sizeof(ACPIEventMetadata));
+        if (ptr < end && carry != 0 && (*ptr == ';' || *ptr == '#')) {
+            return ptr;
+        }
 
-                    metadata->event = event;
-                    metadata->handler = Acpihandler;
+        return scanValueScalar(ptr, end);
+    }
 
-                    pthread_create(&handler, NULL, ACPIEventHandler::_handleEvent, metadata);
-                    pthread_detach(handler);
+#endif
 
-                }
+    static ScanValueFunction resolveScanValue()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_cpu_init();
 
-                bufptr = 0;
-                memset(buf, 0, BUFSIZE);
-            }
+        if (__builtin_cpu_supports("avx2")) {
+            return scanValueAVX2;
+        }
 
+        if (__builtin_cpu_supports("sse2")) {
+            return scanValueSSE2;
         }
+#endif
+        return scanValueScalar;
+    }
 
-        close(sfd);
+    static const ScanValueFunction scanValueKernel = resolveScanValue();
 
+    /**
+     * Find the end of an unquoted config value, see scanValueScalar()
+     * @return the newline, the comment character or nullptr
+     */
+    static inline const char *scanValueEnd(const char *begin, const char *end)
+    {
+        return scanValueKernel(begin, end);
     }
 
-    void* PowerManagement::ACPI::handle_udev(void* _this){
+    /*
+     * FNV-1a, used to index the keypairs by key without
+     * copying the key into a std::string, and to match device paths
+     */
+    static const uint64_t FNV_OFFSET = 14695981039346656037ULL;
+    static const uint64_t FNV_PRIME = 1099511628211ULL;
 
-#ifdef DEBUG
+    static uint64_t fnv1a(const char *string, uint64_t hash = FNV_OFFSET)
+    {
+        for (; *string; string++) {
+            hash ^= (unsigned char) *string;
+            hash *= FNV_PRIME;
+        }
+        return hash;
+    }
 
-        printf("starting udev listener...\n");
+    static uint64_t fnv1aBytes(const char *data, size_t length, uint64_t hash = FNV_OFFSET)
+    {
+        for (size_t i = 0; i < length; i++) {
+            hash ^= (unsigned char) data[i];
+            hash *= FNV_PRIME;
+        }
+        return hash;
+    }
 
-#endif
+    /******************** Metrics ********************/
+
+    #define METRICS_EVENTS (PowerManagement::ACPIEvent::THERMAL_NORMAL + 1)
+    #define METRICS_LATENCY_BUCKETS 8
+
+    /* the upper bounds of the dispatch latency buckets, in nanoseconds */
+    static const uint64_t LATENCY_BOUNDS[METRICS_LATENCY_BUCKETS] = {
+            10000, 50000, 100000, 500000, 1000000, 5000000, 10000000, 50000000
+    };
+
+    enum MetricsSlot {
+        M_EVENTS = 0,
+        M_DROPPED_UNKNOWN = M_EVENTS + METRICS_EVENTS,
+        M_DROPPED_OVERLONG,
+        M_ACPID_RECONNECTS,
+        M_SYSFS_READS,
+        M_SYSFS_READ_ERRORS,
+        M_SYSFS_READ_NS,
+        M_LATENCY_BUCKETS,
+        M_LATENCY_INF = M_LATENCY_BUCKETS + METRICS_LATENCY_BUCKETS,
+        M_LATENCY_NS,
+        M_SLOTS
+    };
+
+    /*
+     * One block per thread, only that thread writes to it, so an
+     * increment is a plain load and store. The blocks of exited threads
+     * keep their counts and are handed to the next new thread.
+     */
+    struct MetricsBlock {
+        std::atomic<uint64_t> slots[M_SLOTS];
+    };
+
+    static pthread_mutex_t metricsLock = PTHREAD_MUTEX_INITIALIZER;
+
+    /* never destroyed, threads may still give their blocks back during exit() */
+    static vector<MetricsBlock*> &metricsBlocks = *new vector<MetricsBlock*>;
+    static vector<MetricsBlock*> &metricsFree = *new vector<MetricsBlock*>;
+
+    static thread_local MetricsBlock *metricsBlock = nullptr;
+
+    struct MetricsRelease {
+        ~MetricsRelease()
+        {
+            if (metricsBlock != nullptr) {
+                pthread_mutex_lock(&metricsLock);
+                metricsFree.push_back(metricsBlock);
+                pthread_mutex_unlock(&metricsLock);
+                metricsBlock = nullptr;
+            }
+        }
+    };
 
-        ACPI *acpiClass = (ACPI*) _this;
+    static thread_local MetricsRelease metricsRelease;
 
-        struct udev* udev = udev_new();
-        struct udev_monitor *monitor = udev_monitor_new_from_netlink(udev, "udev");
+    static MetricsBlock *acquireMetricsBlock()
+    {
+        MetricsBlock *block;
 
-        udev_monitor_filter_add_match_subsystem_devtype(monitor, "platform", NULL);
-        udev_monitor_filter_add_match_subsystem_devtype(monitor, "machinecheck", NULL);
-        udev_monitor_enable_receiving(monitor);
+        pthread_mutex_lock(&metricsLock);
 
-        int fd = udev_monitor_get_fd(monitor);
+        if (!metricsFree.empty()) {
+            block = metricsFree.back();
+            metricsFree.pop_back();
+        } else {
+            block = new MetricsBlock;
+            for (std::atomic<uint64_t> &slot : block->slots) {
+                slot.store(0, std::memory_order_relaxed);
+            }
+            metricsBlocks.push_back(block);
+        }
 
-        fd_set set;
-        struct timeval tv;
+        pthread_mutex_unlock(&metricsLock);
 
-        tv.tv_sec = INT_MAX;
-        tv.tv_usec = 0;
+        /* touching it registers the destructor that gives the block back */
+        (void) &metricsRelease;
+        metricsBlock = block;
 
-        struct udev_device *device;
+        return block;
+    }
 
-        int ret;
+    static inline void metricsAdd(int slot, uint64_t value = 1)
+    {
+        MetricsBlock *block = metricsBlock;
 
-        ACPIEvent event = ACPIEvent::UNKNOWN;
-        bool enteringS3S4 = false;
+        if (block == nullptr) {
+            block = acquireMetricsBlock();
+        }
 
-        while (acpiClass->udev_running) {
+        std::atomic<uint64_t> &counter = block->slots[slot];
+        counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
 
-            FD_ZERO(&set);
-            FD_SET(fd, &set);
+    static inline uint64_t nanosecondsSince(const struct timespec &started)
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
 
-            ret = select(fd + 1, &set, NULL, NULL, &tv);
+        return (uint64_t) ((now.tv_sec - started.tv_sec) * 1000000000LL + (now.tv_nsec - started.tv_nsec));
+    }
 
-            if (ret > 0 && FD_ISSET(fd, &set)) {
+    static void countSysfsRead(const struct timespec &started, bool success)
+    {
+        metricsAdd(M_SYSFS_READ_NS, nanosecondsSince(started));
+        metricsAdd(M_SYSFS_READS);
 
-                device = udev_monitor_receive_device(monitor);
+        if (!success) {
+            metricsAdd(M_SYSFS_READ_ERRORS);
+        }
+    }
 
-                if (device == NULL) {
-#ifdef DEBUG
-                    printf("udev: the device is null\n");
-#endif
-                    continue;
-                }
+    static void countDispatchLatency(const struct timespec &dispatched)
+    {
+        const uint64_t latency = nanosecondsSince(dispatched);
+        int bucket = 0;
 
-                /*
-                 * The /sys/devices/platform/dock.2 path is the main ThinkPad
-                 * dock device file on XX20 series ThinkPads, other ThinkPads
-                 * have not been tested as I don't have the hardware to test.
-                 */
-                if (strstr(udev_device_get_syspath(device), IBM_DOCK) != NULL) {
+        while (bucket < METRICS_LATENCY_BUCKETS && latency > LATENCY_BOUNDS[bucket]) {
+            bucket++;
+        }
 
-                    /*
-                     * One could argue that I can use this instead of reading the
-                     * file manually but this just plainly does not work, it returns
-                     * what it feels like of returning
-                     */
-                    // const char *docked = udev_device_get_sysattr_value(device, "docked");
+        metricsAdd(M_LATENCY_BUCKETS + bucket);
+        metricsAdd(M_LATENCY_NS, latency);
+    }
 
-                    Hardware::Dock dock;
+    static const struct {
+        PowerManagement::ACPIEvent event;
+        const char *name;
+    } METRICS_EVENT_NAMES[] = {
+            {PowerManagement::ACPIEvent::POWER_S3S4_ENTER, "POWER_S3S4_ENTER"},
+            {PowerManagement::ACPIEvent::POWER_S3S4_EXIT, "POWER_S3S4_EXIT"},
+            {PowerManagement::ACPIEvent::LID_CLOSED, "LID_CLOSED"},
+            {PowerManagement::ACPIEvent::LID_OPENED, "LID_OPENED"},
+            {PowerManagement::ACPIEvent::DOCKED, "DOCKED"},
+            {PowerManagement::ACPIEvent::UNDOCKED, "UNDOCKED"},
+            {PowerManagement::ACPIEvent::BUTTON_POWER, "BUTTON_POWER"},
+            {PowerManagement::ACPIEvent::BUTTON_VOLUME_UP, "BUTTON_VOLUME_UP"},
+            {PowerManagement::ACPIEvent::BUTTON_VOLUME_DOWN, "BUTTON_VOLUME_DOWN"},
+            {PowerManagement::ACPIEvent::BUTTON_MICMUTE, "BUTTON_MICMUTE"},
+            {PowerManagement::ACPIEvent::BUTTON_MUTE, "BUTTON_MUTE"},
+            {PowerManagement::ACPIEvent::BUTTON_THINKVANTAGE, "BUTTON_THINKVANTAGE"},
+            {PowerManagement::ACPIEvent::BUTTON_FNF2_LOCK, "BUTTON_FNF2_LOCK"},
+            {PowerManagement::ACPIEvent::BUTTON_FNF3_BATTERY, "BUTTON_FNF3_BATTERY"},
+            {PowerManagement::ACPIEvent::BUTTON_FNF4_SLEEP, "BUTTON_FNF4_SLEEP"},
+            {PowerManagement::ACPIEvent::BUTTON_FNF5_WLAN, "BUTTON_FNF5_WLAN"},
+            {PowerManagement::ACPIEvent::BUTTON_FNF7_PROJECTOR, "BUTTON_FNF7_PROJECTOR"},
+            {PowerManagement::ACPIEvent::BUTTON_FNF12_SUSPEND, "BUTTON_FNF12_SUSPEND"},
+            {PowerManagement::ACPIEvent::UNKNOWN, "UNKNOWN"},
+            {PowerManagement::ACPIEvent::BUTTON_BRIGHTNESS_DOWN, "BUTTON_BRIGHTNESS_DOWN"},
+            {PowerManagement::ACPIEvent::BUTTON_BRIGHTNESS_UP, "BUTTON_BRIGHTNESS_UP"},
+            {PowerManagement::ACPIEvent::THINKLIGHT_ON, "THINKLIGHT_ON"},
+            {PowerManagement::ACPIEvent::THINKLIGHT_OFF, "THINKLIGHT_OFF"},
+            {PowerManagement::ACPIEvent::BATTERY_CHANGED, "BATTERY_CHANGED"},
+            {PowerManagement::ACPIEvent::AC_CONNECTED, "AC_CONNECTED"},
+            {PowerManagement::ACPIEvent::AC_DISCONNECTED, "AC_DISCONNECTED"},
+            {PowerManagement::ACPIEvent::THERMAL_HIGH, "THERMAL_HIGH"},
+            {PowerManagement::ACPIEvent::THERMAL_NORMAL, "THERMAL_NORMAL"},
+    };
+
+    /* snprintf that keeps counting once the buffer is full */
+    struct MetricsWriter {
+        char *buf;
+        size_t size;
+        size_t length;
+
+        void append(const char *format, ...) __attribute__((format(printf, 2, 3)))
+        {
+            va_list args;
+            va_start(args, format);
+
+            const size_t available = length < size ? size - length : 0;
+            const int written = vsnprintf(available > 0 ? buf + length : NULL, available, format, args);
+
+            va_end(args);
+
+            if (written > 0) {
+                length += (size_t) written;
+            }
+        }
+    };
 
-                    if (!dock.probe()) {
-                        fprintf(stderr, "fixme: udev event fired on non-sane dock\n");
-                        udev_device_unref(device);
-                        continue;
-                    }
+    size_t Utilities::Metrics::render(char *buf, size_t size)
+    {
+        uint64_t totals[M_SLOTS];
+        memset(totals, 0, sizeof(totals));
 
-                    /* Wait for the dock to appear */
-                    sleep(1);
+        pthread_mutex_lock(&metricsLock);
 
-                    event = dock.isDocked() ? ACPIEvent::DOCKED : ACPIEvent::UNDOCKED;
+        for (MetricsBlock *block : metricsBlocks) {
+            for (int i = 0; i < M_SLOTS; i++) {
+                totals[i] += block->slots[i].load(std::memory_order_relaxed);
+            }
+        }
 
-                }
+        pthread_mutex_unlock(&metricsLock);
 
-                /*
-                 * When the system is suspending, Linux switches off all CPU cores
-                 * but one, and this change is reflected in the sysfs with the
-                 * removal/addition of the machinecheck files. We intercept these
-                 * changes and act upon them
-                 */
-                if (strstr(udev_device_get_syspath(device), SYSFS_MACHINECHECK) != NULL) {
+        MetricsWriter out = { buf, size, 0 };
 
-                    const char *action = udev_device_get_action(device);
+        if (size > 0) {
+            buf[0] = 0;
+        }
 
-                    if (strcmp(action, "remove") == 0) {
+        out.append("# TYPE thinkpad_events counter\n");
+        out.append("# HELP thinkpad_events Events dispatched to the handlers.\n");
 
-                        /**
-                         * Each core except for CPU0 is brought down
-                         * and then up again, we debounce this with
-                         * only one event.
-                         */
-                        if (enteringS3S4) continue;
+        for (const auto &entry : METRICS_EVENT_NAMES) {
+            out.append("thinkpad_events_total{event=\"%s\"} %llu\n", entry.name,
+                       (unsigned long long) totals[M_EVENTS + entry.event]);
+        }
 
-                        event = ACPIEvent::POWER_S3S4_ENTER;
-                        enteringS3S4 = true;
-                    }
+        out.append("# TYPE thinkpad_events_dropped counter\n");
+        out.append("# HELP thinkpad_events_dropped Events that were not dispatched.\n");
+        out.append("thinkpad_events_dropped_total{reason=\"unknown\"} %llu\n", (unsigned long long) totals[M_DROPPED_UNKNOWN]);
+        out.append("thinkpad_events_dropped_total{reason=\"overlong\"} %llu\n", (unsigned long long) totals[M_DROPPED_OVERLONG]);
 
-                    if (strcmp(action, "add") == 0) {
+        out.append("# TYPE thinkpad_dispatch_latency_seconds histogram\n");
+        out.append("# HELP thinkpad_dispatch_latency_seconds Time to hand an event to the threads of its handlers.\n");
 
-                        if (!enteringS3S4) continue;
+        uint64_t cumulative = 0;
 
-                        event = ACPIEvent::POWER_S3S4_EXIT;
-                        enteringS3S4 = false;
-                    }
+        for (int i = 0; i < METRICS_LATENCY_BUCKETS; i++) {
+            cumulative += totals[M_LATENCY_BUCKETS + i];
+            out.append("thinkpad_dispatch_latency_seconds_bucket{le=\"%g\"} %llu\n", LATENCY_BOUNDS[i] / 1e9,
+                       (unsigned long long) cumulative);
+        }
 
-                }
+        cumulative += totals[M_LATENCY_INF];
 
-                for (ACPIEventHandler* acpihandler : *acpiClass->ACPIhandlers) {
+        /* the count is the +Inf bucket, a separate counter could be read apart from the buckets */
+        out.append("thinkpad_dispatch_latency_seconds_bucket{le=\"+Inf\"} %llu\n", (unsigned long long) cumulative);
+        out.append("thinkpad_dispatch_latency_seconds_count %llu\n", (unsigned long long) cumulative);
+        out.append("thinkpad_dispatch_latency_seconds_sum %.9f\n", totals[M_LATENCY_NS] / 1e9);
 
-                    pthread_t handler;
+        out.append("# TYPE thinkpad_acpid_reconnects counter\n");
+        out.append("# HELP thinkpad_acpid_reconnects Connections to acpid made again after it went away.\n");
+        out.append("thinkpad_acpid_reconnects_total %llu\n", (unsigned long long) totals[M_ACPID_RECONNECTS]);
 
-                    ACPIEventMetadata *metadata = (ACPIEventMetadata*) malloc(sizeof(ACPIEventMetadata));
+        out.append("# TYPE thinkpad_sysfs_read_seconds summary\n");
+        out.append("# HELP thinkpad_sysfs_read_seconds Reads of sysfs attributes.\n");
+        out.append("thinkpad_sysfs_read_seconds_count %llu\n", (unsigned long long) totals[M_SYSFS_READS]);
+        out.append("thinkpad_sysfs_read_seconds_sum %.9f\n", totals[M_SYSFS_READ_NS] / 1e9);
 
-                    metadata->handler = acpihandler;
-                    metadata->event = event;
+        out.append("# TYPE thinkpad_sysfs_read_errors counter\n");
+        out.append("# HELP thinkpad_sysfs_read_errors Reads of sysfs attributes that failed.\n");
+        out.append("thinkpad_sysfs_read_errors_total %llu\n", (unsigned long long) totals[M_SYSFS_READ_ERRORS]);
 
+        out.append("# EOF\n");
+
+        return out.length;
+    }
 
-                    pthread_create(&handler, NULL, ACPIEventHandler::_handleEvent, metadata);
-                    pthread_detach(handler);
+    string Utilities::Metrics::render()
+    {
+        vector<char> buf(4096);
 
+        for (;;) {
 
-                }
+            size_t length = render(buf.data(), buf.size());
 
-                event = ACPIEvent::UNKNOWN;
-                udev_device_unref(device);
+            if (length < buf.size()) {
+                return string(buf.data(), length);
             }
 
-        }
+            buf.resize(length + 256);
 
+        }
     }
 
-    PowerManagement::ACPI::ACPI() : ACPIhandlers(new vector<ACPIEventHandler*>)
+    Utilities::MetricsExporter::MetricsExporter(const string &path) : path(path)
     {
 
     }
 
-    PowerManagement::ACPI::~ACPI()
+    Utilities::MetricsExporter::~MetricsExporter()
+    {
+        close();
+    }
+
+    bool Utilities::MetricsExporter::open(PowerManagement::ACPI*)
     {
+        struct sockaddr_un addr;
 
-        this->udev_running = false;
+        memset(&addr, 0, sizeof(struct sockaddr_un));
+        addr.sun_family = AF_UNIX;
 
-        if (acpid_listener > 0) {
-            pthread_cancel(acpid_listener);
-            pthread_join(acpid_listener, NULL);
+        if (path.size() >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "metrics: socket path too long: %s\n", path.c_str());
+            return false;
         }
 
-        if (udev_listener > 0) {
-            pthread_cancel(udev_listener);
-            pthread_join(udev_listener, NULL);
+        strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+        listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+        if (listenFd < 0) {
+            fprintf(stderr, "metrics: failed to create the socket: %s\n", strerror(errno));
+            return false;
         }
 
-        delete this->ACPIhandlers;
+        /* replace a socket left behind by an earlier run, but never any other file */
+        struct stat existing;
 
-    }
+        if (lstat(path.c_str(), &existing) == 0) {
 
-    void PowerManagement::ACPI::addEventHandler(PowerManagement::ACPIEventHandler *handler) {
-        this->ACPIhandlers->push_back(handler);
-    }
+            if (!S_ISSOCK(existing.st_mode)) {
+                fprintf(stderr, "metrics: %s exists and is not a socket\n", path.c_str());
+                ::close(listenFd);
+                listenFd = -1;
+                return false;
+            }
 
-    void PowerManagement::ACPI::wait() {
-        pthread_join(acpid_listener, NULL);
-        pthread_join(udev_listener, NULL);
-    }
+            unlink(path.c_str());
 
-    void PowerManagement::ACPI::start()
-    {
-        /* start the acpid event listener */
-        pthread_create(&acpid_listener, NULL, handle_acpid, this);
+        }
 
-        /* start the udev event listener */
-        pthread_create(&udev_listener, NULL, handle_udev, this);
+        if (bind(listenFd, (struct sockaddr*) &addr, sizeof(struct sockaddr_un)) < 0 || listen(listenFd, 8) < 0) {
+            fprintf(stderr, "metrics: failed to listen on %s: %s\n", path.c_str(), strerror(errno));
+            ::close(listenFd);
+            listenFd = -1;
+            return false;
+        }
+
+        return true;
     }
 
-    void *PowerManagement::ACPIEventHandler::_handleEvent(void* _this) {
-        ACPIEventMetadata *metadata = (ACPIEventMetadata*) _this;
-        metadata->handler->handleEvent(metadata->event);
-        free(metadata);
+    void Utilities::MetricsExporter::getFds(vector<PowerManagement::EventSourceFd> *fds)
+    {
+        fds->push_back({listenFd, false, false});
     }
 
+    bool Utilities::MetricsExporter::drain(PowerManagement::ACPI*, const vector<PowerManagement::EventSourceFd>&)
+    {
+        int client;
 
-    /********************** Utilities::Ini *******************/
+        while ((client = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC)) >= 0) {
 
-    Utilities::Ini::Ini::~Ini()
+            const string text = Metrics::render();
+
+            /* the text fits in the socket buffer, a client that does not read gets it cut */
+            if (send(client, text.data(), text.size(), MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t) text.size()) {
+                fprintf(stderr, "metrics: short write to a client\n");
+            }
+
+            ::close(client);
+
+        }
+
+        return true;
+    }
+
+    void Utilities::MetricsExporter::close()
+    {
+        if (listenFd >= 0) {
+            ::close(listenFd);
+            unlink(path.c_str());
+            listenFd = -1;
+        }
+    }
+
+    /******************** Dock ********************/
+
+    struct DockEntry {
+        string syspath;
+        string devpath;
+        uint64_t hash;
+        bool ibm;
+    };
+
+    static std::once_flag docksEnumerated;
+    static vector<DockEntry> docks;
+
+    static void enumerateDocks()
+    {
+        struct udev *udev = udev_new();
+        struct udev_enumerate *enumerate = udev != NULL ? udev_enumerate_new(udev) : NULL;
+
+        if (enumerate == NULL) {
+            fprintf(stderr, "dock: udev enumeration failed\n");
+            if (udev != NULL) udev_unref(udev);
+            return;
+        }
+
+        udev_enumerate_add_match_subsystem(enumerate, "platform");
+        udev_enumerate_add_match_sysname(enumerate, "dock.*");
+        udev_enumerate_scan_devices(enumerate);
+
+        struct udev_list_entry *entry;
+
+        udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(enumerate)) {
+
+            struct udev_device *device = udev_device_new_from_syspath(udev, udev_list_entry_get_name(entry));
+
+            if (device == NULL) {
+                continue;
+            }
+
+            /* the bays (ata_bay, battery_bay) are dock.N devices too */
+            const char *type = udev_device_get_sysattr_value(device, "type");
+            const char *modalias = udev_device_get_sysattr_value(device, "modalias");
+            const char *devpath = udev_device_get_devpath(device);
+
+            if (type != NULL && strcmp(type, "dock_station") == 0 && devpath != NULL) {
+
+                DockEntry dock;
+
+                dock.syspath = udev_device_get_syspath(device);
+                dock.devpath = devpath;
+                dock.hash = fnv1a(devpath);
+
+                /* IBM_DOCK_ID carries the newline of the sysfs file */
+                dock.ibm = modalias != NULL && strncmp(modalias, IBM_DOCK_ID, strlen(IBM_DOCK_ID) - 1) == 0;
+
+                docks.push_back(dock);
+
+            }
+
+            udev_device_unref(device);
+
+        }
+
+        udev_enumerate_unref(enumerate);
+        udev_unref(udev);
+
+        std::stable_sort(docks.begin(), docks.end(), [](const DockEntry &a, const DockEntry &b) {
+            return a.ibm && !b.ibm;
+        });
+    }
+
+    /**
+     * Find the dock stations once, the docks are ACPI devices and
+     * do not come and go after the boot. The list never changes after
+     * that, so matching the udev events against it takes no lock.
+     */
+    static const vector<DockEntry> &getDockEntries()
+    {
+        std::call_once(docksEnumerated, enumerateDocks);
+        return docks;
+    }
+
+    /**
+     * Match the devpath of an udev event against the dock stations
+     * @return the dock or nullptr if the event is not for a dock
+     */
+    static const DockEntry *findDock(const char *devpath)
+    {
+        const uint64_t hash = fnv1a(devpath);
+
+        for (const DockEntry &dock : getDockEntries()) {
+            if (dock.hash == hash && dock.devpath == devpath) {
+                return &dock;
+            }
+        }
+
+        return nullptr;
+    }
+
+    Hardware::Dock::Dock()
+    {
+        const vector<DockEntry> &entries = getDockEntries();
+
+        if (!entries.empty()) {
+            syspath = entries[0].syspath;
+        }
+    }
+
+    Hardware::Dock::Dock(const string &syspath) : syspath(syspath)
+    {
+
+    }
+
+    const string &Hardware::Dock::getSyspath() const
+    {
+        return syspath;
+    }
+
+    vector<string> Hardware::Dock::getDocks()
+    {
+        vector<string> paths;
+
+        for (const DockEntry &dock : getDockEntries()) {
+            paths.push_back(dock.syspath);
+        }
+
+        return paths;
+    }
+
+    bool Hardware::Dock::isDocked() {
+        if (syspath.empty()) {
+            return false;
+        }
+        const string path = syspath + "/docked";
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd == ERR_INVALID) {
+            return false;
+        }
+        char status[1];
+        ssize_t readBytes = read(fd, status, 1);
+        close(fd);
+        if (readBytes != 1) {
+            return false;
+        }
+        return status[0] == '1';
+    }
+
+    bool Hardware::Dock::probe() {
+        if (syspath.empty()) {
+            return false;
+        }
+        for (const DockEntry &dock : getDockEntries()) {
+            if (dock.syspath == syspath) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /******************** PowerManager ********************/
+
+    bool PowerManagement::PowerStateManager::suspend() {
+
+#ifdef SYSTEMD
+
+        sd_bus_error error = SD_BUS_ERROR_NULL;
+        sd_bus *bus = nullptr;
+        int status;
+
+        status = sd_bus_open_system(&bus);
+
+        if (status < 0) {
+            fprintf(stderr, "Connecting to D-Bus failed");
+            return false;
+        }
+
+        status = sd_bus_call_method(bus,
+                                    "org.freedesktop.login1",
+                                    "/org/freedesktop/login1",
+                                    "org.freedesktop.login1.Manager",
+                                    "Suspend",
+                                    &error,
+                                    NULL,
+                                    "b",
+                                    "1");
+
+        if (status < 0) {
+            fprintf(stderr, "Error calling suspend on logind: %s\n", error.message);
+            return false;
+        }
+
+        sd_bus_error_free(&error);
+        sd_bus_unref(bus);
+
+        return true;
+
+#endif
+
+        fprintf(stderr, "no suspend mechanism available\n");
+        return false;
+
+    }
+
+    bool PowerManagement::PowerStateManager::requestSuspend(SuspendReason reason) {
+
+        Hardware::Dock dock;
+
+        switch (reason) {
+            case SuspendReason::BUTTON:
+                return PowerManagement::PowerStateManager::suspend();
+            case SuspendReason::LID:
+                if (!dock.probe()) {
+                    fprintf(stderr, "dock is not sane/present");
+                    return false;
+                }
+
+                if(!dock.isDocked()) {
+                    PowerManagement::PowerStateManager::suspend();
+                    return true;
+                }
+
+                fprintf(stderr, "ignoring lid event when docked\n");
+                return false;
+            default:
+                fprintf(stderr, "invalid suspend reason \n");
+                return false;
+        }
+
+    }
+
+    static pthread_mutex_t sleepInhibitorLock = PTHREAD_MUTEX_INITIALIZER;
+    static int sleepInhibitor = -1;
+    static std::atomic<long> sleepDelay(4000);
+
+    bool PowerManagement::PowerStateManager::takeSleepInhibitor() {
+
+#ifdef SYSTEMD
+
+        pthread_mutex_lock(&sleepInhibitorLock);
+
+        if (sleepInhibitor >= 0) {
+            pthread_mutex_unlock(&sleepInhibitorLock);
+            return true;
+        }
+
+        sd_bus_error error = SD_BUS_ERROR_NULL;
+        sd_bus_message *reply = nullptr;
+        sd_bus *bus = nullptr;
+        int fd = -1;
+
+        int status = sd_bus_open_system(&bus);
+
+        if (status < 0) {
+            fprintf(stderr, "Connecting to D-Bus failed\n");
+            pthread_mutex_unlock(&sleepInhibitorLock);
+            return false;
+        }
+
+        status = sd_bus_call_method(bus,
+                                    "org.freedesktop.login1",
+                                    "/org/freedesktop/login1",
+                                    "org.freedesktop.login1.Manager",
+                                    "Inhibit",
+                                    &error,
+                                    &reply,
+                                    "ssss",
+                                    "sleep",
+                                    "libthinkpad",
+                                    "Running the suspend handlers",
+                                    "delay");
+
+        if (status < 0) {
+            fprintf(stderr, "Error taking the sleep inhibitor from logind: %s\n", error.message);
+        } else if (sd_bus_message_read(reply, "h", &fd) >= 0) {
+            /* the descriptor belongs to the message, the lock lives as long as our copy */
+            sleepInhibitor = fcntl(fd, F_DUPFD_CLOEXEC, 3);
+        }
+
+        sd_bus_error_free(&error);
+        sd_bus_message_unref(reply);
+        sd_bus_flush_close_unref(bus);
+
+        const bool held = sleepInhibitor >= 0;
+
+        pthread_mutex_unlock(&sleepInhibitorLock);
+
+        return held;
+
+#endif
+
+        return false;
+
+    }
+
+    void PowerManagement::PowerStateManager::releaseSleepInhibitor() {
+
+        pthread_mutex_lock(&sleepInhibitorLock);
+
+        if (sleepInhibitor >= 0) {
+            close(sleepInhibitor);
+            sleepInhibitor = -1;
+        }
+
+        pthread_mutex_unlock(&sleepInhibitorLock);
+
+    }
+
+    void PowerManagement::PowerStateManager::setSleepDelay(std::chrono::milliseconds delay) {
+        sleepDelay.store((long) delay.count());
+    }
+
+    std::chrono::milliseconds PowerManagement::PowerStateManager::getSleepDelay() {
+        return std::chrono::milliseconds(sleepDelay.load());
+    }
+
+    /******************** ACPI ********************/
+
+    /*
+     * The state of the ThinkLight as last seen by the udev listener,
+     * -1 if the listener is not running and the state is not tracked
+     */
+    static std::atomic<int> thinkLightState(-1);
+
+    static bool readThinkLight(bool *on)
+    {
+        std::shared_ptr<Hardware::SysfsDevice> light = Hardware::DeviceRegistry::getDevice("leds", THINKLIGHT_LED);
+
+        if (light == nullptr) {
+            printf("thinklight: no such device: %s\n", THINKLIGHT_LED);
+            return false;
+        }
+
+        const int brightness = light->getBrightness();
+
+        if (brightness < 0) {
+            printf("thinklight: failed read: %s\n", strerror(errno));
+            return false;
+        }
+
+        *on = brightness != 0;
+        return true;
+    }
+
+    /**
+     * Re-read the ThinkLight after a notification, and tell
+     * which event to fire if the light changed since the last time
+     * @return true if the state changed
+     */
+    static bool updateThinkLight(PowerManagement::ACPIEvent *event)
+    {
+        bool on;
+
+        if (!readThinkLight(&on)) {
+            return false;
+        }
+
+        if (thinkLightState.exchange(on ? 1 : 0) == (on ? 1 : 0)) {
+            return false;
+        }
+
+        *event = on ? PowerManagement::ACPIEvent::THINKLIGHT_ON : PowerManagement::ACPIEvent::THINKLIGHT_OFF;
+        return true;
+    }
+
+    /**
+     * Map an acpid event line to the ACPIEvent it describes
+     */
+    static PowerManagement::ACPIEvent classifyAcpidEvent(const char *line)
+    {
+        using PowerManagement::ACPIEvent;
+
+        static const struct {
+            const char *pattern;
+            ACPIEvent event;
+        } events[] = {
+                {ACPI_UNDOCK_EVENT, ACPIEvent::UNDOCKED},
+                {ACPI_DOCK_EVENT, ACPIEvent::DOCKED},
+                {ACPI_BUTTON_FNF12_HIBERNATE, ACPIEvent::BUTTON_FNF12_SUSPEND},
+                {ACPI_BUTTON_FNF7_PROJECTOR, ACPIEvent::BUTTON_FNF7_PROJECTOR},
+                {ACPI_BUTTON_FNF4_SLEEP, ACPIEvent::BUTTON_FNF4_SLEEP},
+                {ACPI_BUTTON_FNF5_WLAN, ACPIEvent::BUTTON_FNF5_WLAN},
+                {ACPI_BUTTON_FNF3_BATTERY, ACPIEvent::BUTTON_FNF3_BATTERY},
+                {ACPI_BUTTON_FNF2_LOCK, ACPIEvent::BUTTON_FNF2_LOCK},
+                {ACPI_BUTTON_THINKVANTAGE, ACPIEvent::BUTTON_THINKVANTAGE},
+                {ACPI_BUTTON_MUTE, ACPIEvent::BUTTON_MUTE},
+                {ACPI_BUTTON_MICMUTE, ACPIEvent::BUTTON_MICMUTE},
+                {ACPI_BUTTON_BRIGHTNESS_UP, ACPIEvent::BUTTON_BRIGHTNESS_UP},
+                {ACPI_BUTTON_BRIGHTNESS_DOWN, ACPIEvent::BUTTON_BRIGHTNESS_DOWN},
+                {ACPI_BUTTON_VOLUME_DOWN, ACPIEvent::BUTTON_VOLUME_DOWN},
+                {ACPI_BUTTON_VOLUME_UP, ACPIEvent::BUTTON_VOLUME_UP},
+                {ACPI_LID_CLOSE, ACPIEvent::LID_CLOSED},
+                {ACPI_LID_OPEN, ACPIEvent::LID_OPENED},
+                {ACPI_POWERBUTTON, ACPIEvent::BUTTON_POWER},
+        };
+
+        /* the table is in reverse precedence order: the last match used to win */
+        for (size_t i = 0; i < sizeof(events) / sizeof(events[0]); i++) {
+            if (strstr(line, events[i].pattern) != NULL) {
+                return events[i].event;
+            }
+        }
+
+        return ACPIEvent::UNKNOWN;
+    }
+
+    /**
+     * Hand an event to every handler, each on its own thread
+     */
+    static void dispatchEvent(const vector<PowerManagement::ACPIEventHandler*> &handlers, PowerManagement::ACPIEvent event)
+    {
+        using PowerManagement::ACPIEventHandler;
+        using PowerManagement::ACPIEventMetadata;
+
+        metricsAdd(M_EVENTS + event);
+
+        if (handlers.empty()) {
+            return;
+        }
+
+        /* timed here, on the dispatching thread, the handler threads stay out of the metrics */
+        struct timespec dispatched;
+        clock_gettime(CLOCK_MONOTONIC, &dispatched);
+
+        for (ACPIEventHandler* acpihandler : handlers) {
+
+            pthread_t handler;
+            ACPIEventMetadata *metadata = (ACPIEventMetadata*) malloc(sizeof(ACPIEventMetadata));
+
+            metadata->handler = acpihandler;
+            metadata->event = event;
+            metadata->completion = nullptr;
+
+            pthread_create(&handler, NULL, ACPIEventHandler::_handleEvent, metadata);
+            pthread_detach(handler);
+
+        }
+
+        countDispatchLatency(dispatched);
+    }
+
+    void PowerManagement::ACPI::dispatch(ACPIEvent event)
+    {
+        if (event == ACPIEvent::UNKNOWN && this->suppressUnknown) {
+            metricsAdd(M_DROPPED_UNKNOWN);
+            return;
+        }
+
+        dispatchEvent(*this->ACPIhandlers, event);
+    }
+
+    /**
+     * Shared by dispatchTracked() and the handler threads. Late handlers
+     * may outlive the dispatch, the last one to let go frees it.
+     */
+    struct PowerManagement::ACPIEventCompletion {
+        pthread_mutex_t lock;
+        size_t pending;
+        size_t references;
+        int notifyFd;
+        long delay;
+        struct timespec started;
+        vector<HandlerTiming> timings;
+    };
+
+    static long microsecondsSince(const struct timespec &started)
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        return (long) (now.tv_sec - started.tv_sec) * 1000000L + (now.tv_nsec - started.tv_nsec) / 1000;
+    }
+
+    static void releaseCompletion(PowerManagement::ACPIEventCompletion *completion)
+    {
+        const bool last = --completion->references == 0;
+
+        pthread_mutex_unlock(&completion->lock);
+
+        if (last) {
+            pthread_mutex_destroy(&completion->lock);
+            delete completion;
+        }
+    }
+
+    PowerManagement::ACPIEventCompletion *PowerManagement::ACPI::dispatchTracked(ACPIEvent event, int notifyFd)
+    {
+        metricsAdd(M_EVENTS + event);
+
+        if (this->ACPIhandlers->empty()) {
+            return nullptr;
+        }
+
+        ACPIEventCompletion *completion = new ACPIEventCompletion;
+
+        pthread_mutex_init(&completion->lock, NULL);
+
+        completion->pending = this->ACPIhandlers->size();
+        completion->references = completion->pending + 1;
+        completion->notifyFd = notifyFd;
+        completion->delay = PowerStateManager::getSleepDelay().count();
+        clock_gettime(CLOCK_MONOTONIC, &completion->started);
+
+        for (ACPIEventHandler* acpihandler : *this->ACPIhandlers) {
+            completion->timings.push_back({ acpihandler, -1, false });
+        }
+
+        pthread_mutex_lock(&completion->lock);
+
+        struct timespec dispatched;
+        clock_gettime(CLOCK_MONOTONIC, &dispatched);
+
+        for (ACPIEventHandler* acpihandler : *this->ACPIhandlers) {
+
+            pthread_t handler;
+            ACPIEventMetadata *metadata = (ACPIEventMetadata*) malloc(sizeof(ACPIEventMetadata));
+
+            metadata->handler = acpihandler;
+            metadata->event = event;
+            metadata->completion = completion;
+
+            if (pthread_create(&handler, NULL, ACPIEventHandler::_handleEvent, metadata) != 0) {
+                free(metadata);
+                completion->pending--;
+                completion->references--;
+                continue;
+            }
+
+            pthread_detach(handler);
+
+        }
+
+        countDispatchLatency(dispatched);
+
+        pthread_mutex_unlock(&completion->lock);
+
+        return completion;
+    }
+
+    bool PowerManagement::ACPI::finishTracked(ACPIEventCompletion *completion, bool force)
+    {
+        pthread_mutex_lock(&completion->lock);
+
+        if (!force && completion->pending > 0 && microsecondsSince(completion->started) < completion->delay * 1000L) {
+            pthread_mutex_unlock(&completion->lock);
+            return false;
+        }
+
+        for (HandlerTiming &timing : completion->timings) {
+            if (!timing.finished) {
+                timing.microseconds = microsecondsSince(completion->started);
+                fprintf(stderr, "suspend: handler %p did not finish within %ld ms\n", (void*) timing.handler, completion->delay);
+            }
+        }
+
+        /* the descriptor belongs to the caller, late handlers must not write to it */
+        completion->notifyFd = -1;
+
+        pthread_mutex_lock(&this->timingsLock);
+        this->suspendTimings = completion->timings;
+        pthread_mutex_unlock(&this->timingsLock);
+
+        releaseCompletion(completion);
+
+        return true;
+    }
+
+    vector<PowerManagement::HandlerTiming> PowerManagement::ACPI::getSuspendTimings()
+    {
+        pthread_mutex_lock(&this->timingsLock);
+        vector<HandlerTiming> timings = this->suspendTimings;
+        pthread_mutex_unlock(&this->timingsLock);
+
+        return timings;
+    }
+
+    /**
+     * Reads the events acpid writes to its socket, one per line
+     */
+    class AcpidSource : public PowerManagement::EventSource {
+    private:
+
+        int sfd = -1;
+
+        char buf[BUFSIZE];
+        int bufptr = 0;
+        bool purging = false;
+
+        /* once connected, a restarted acpid is connected to again */
+        static const long RECONNECT_US = 1000000L;
+        struct timespec lost;
+
+        bool connectSocket()
+        {
+            struct sockaddr_un addr;
+
+            memset(&addr, 0, sizeof(struct sockaddr_un));
+
+            addr.sun_family = AF_UNIX;
+            strncpy(addr.sun_path, ACPID_SOCK, strlen(ACPID_SOCK));
+
+            sfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+            if (connect(sfd, (struct sockaddr*) &addr, sizeof(struct sockaddr_un)) < 0) {
+                ::close(sfd);
+                sfd = -1;
+                return false;
+            }
+
+            bufptr = 0;
+            purging = false;
+
+            return true;
+        }
+
+    public:
+
+        bool open(PowerManagement::ACPI*) override
+        {
+            if (!connectSocket()) {
+                printf("Connect failed: %s\n", strerror(errno));
+                return false;
+            }
+
+#ifdef DEBUG
+
+            printf("starting acpid listener...\n");
+
+#endif
+
+            memset(buf, 0, BUFSIZE);
+
+            return true;
+        }
+
+        void getFds(vector<PowerManagement::EventSourceFd> *fds) override
+        {
+            if (sfd >= 0) {
+                fds->push_back({sfd, false, false});
+            }
+        }
+
+        int getTimeout() override
+        {
+            if (sfd >= 0) {
+                return -1;
+            }
+
+            const long remaining = RECONNECT_US - microsecondsSince(lost);
+
+            return remaining > 0 ? (int) ((remaining + 999) / 1000) : 0;
+        }
+
+        bool drain(PowerManagement::ACPI *acpi, const vector<PowerManagement::EventSourceFd>&) override
+        {
+            if (sfd < 0) {
+
+                if (microsecondsSince(lost) < RECONNECT_US) {
+                    return true;
+                }
+
+                if (connectSocket()) {
+                    metricsAdd(M_ACPID_RECONNECTS);
+                } else {
+                    clock_gettime(CLOCK_MONOTONIC, &lost);
+                }
+
+                return true;
+            }
+
+            char inbuf[INBUFSZ];
+
+            ssize_t len = read(sfd, inbuf, INBUFSZ);
+
+            if (len < 0 && (errno == EINTR || errno == EAGAIN)) {
+                return true;
+            }
+
+            if (len <= 0) {
+                printf("acpid: connection lost, reconnecting...\n");
+                ::close(sfd);
+                sfd = -1;
+                clock_gettime(CLOCK_MONOTONIC, &lost);
+                return true;
+            }
+
+            /*
+             * acpid writes one event per line; read whatever is available and
+             * split it with the scanner instead of going through read() per byte
+             */
+            const char *ptr = inbuf;
+            const char *end = inbuf + len;
+
+            while (ptr < end) {
+
+                const char *newline = scanAny(ptr, end, "\n");
+                const char *chunkEnd = newline != nullptr ? newline : end;
+                size_t chunkLen = (size_t) (chunkEnd - ptr);
+
+                if (!purging && bufptr + chunkLen >= BUFSIZE) {
+                    printf("Buffer full, purging event...\n");
+                    metricsAdd(M_DROPPED_OVERLONG);
+                    purging = true;
+                }
+
+                if (!purging) {
+                    memcpy(buf + bufptr, ptr, chunkLen);
+                    bufptr += chunkLen;
+                }
+
+                if (newline == nullptr) break;
+
+                if (!purging) {
+                    buf[bufptr] = 0;
+                    emit(acpi, classifyAcpidEvent(buf));
+                }
+
+                bufptr = 0;
+                purging = false;
+                ptr = newline + 1;
+            }
+
+            return true;
+        }
+
+        void close() override
+        {
+            if (sfd >= 0) {
+                ::close(sfd);
+                sfd = -1;
+            }
+        }
+    };
+
+    /*
+     * The evdev keys and switches that map to an ACPIEvent, the value is
+     * 1 for a press and the new state for a switch
+     */
+    static const struct {
+        uint16_t type;
+        uint16_t code;
+        int32_t value;
+        PowerManagement::ACPIEvent event;
+    } inputMappings[] = {
+            {EV_KEY, KEY_MUTE, 1, PowerManagement::ACPIEvent::BUTTON_MUTE},
+            {EV_KEY, KEY_VOLUMEDOWN, 1, PowerManagement::ACPIEvent::BUTTON_VOLUME_DOWN},
+            {EV_KEY, KEY_VOLUMEUP, 1, PowerManagement::ACPIEvent::BUTTON_VOLUME_UP},
+            {EV_KEY, KEY_MICMUTE, 1, PowerManagement::ACPIEvent::BUTTON_MICMUTE},
+            {EV_KEY, KEY_BRIGHTNESSDOWN, 1, PowerManagement::ACPIEvent::BUTTON_BRIGHTNESS_DOWN},
+            {EV_KEY, KEY_BRIGHTNESSUP, 1, PowerManagement::ACPIEvent::BUTTON_BRIGHTNESS_UP},
+            {EV_KEY, KEY_VENDOR, 1, PowerManagement::ACPIEvent::BUTTON_THINKVANTAGE},
+            {EV_KEY, KEY_PROG1, 1, PowerManagement::ACPIEvent::BUTTON_THINKVANTAGE},
+            {EV_KEY, KEY_SCREENLOCK, 1, PowerManagement::ACPIEvent::BUTTON_FNF2_LOCK},
+            {EV_KEY, KEY_BATTERY, 1, PowerManagement::ACPIEvent::BUTTON_FNF3_BATTERY},
+            {EV_KEY, KEY_SLEEP, 1, PowerManagement::ACPIEvent::BUTTON_FNF4_SLEEP},
+            {EV_KEY, KEY_WLAN, 1, PowerManagement::ACPIEvent::BUTTON_FNF5_WLAN},
+            {EV_KEY, KEY_SWITCHVIDEOMODE, 1, PowerManagement::ACPIEvent::BUTTON_FNF7_PROJECTOR},
+            {EV_KEY, KEY_SUSPEND, 1, PowerManagement::ACPIEvent::BUTTON_FNF12_SUSPEND},
+            {EV_KEY, KEY_POWER, 1, PowerManagement::ACPIEvent::BUTTON_POWER},
+            {EV_SW, SW_LID, 1, PowerManagement::ACPIEvent::LID_CLOSED},
+            {EV_SW, SW_LID, 0, PowerManagement::ACPIEvent::LID_OPENED},
+    };
+
+    #define INPUT_LONG_BITS (8 * sizeof(unsigned long))
+    #define INPUT_BITMAP_LONGS(max) ((max) / INPUT_LONG_BITS + 1)
+
+    /**
+     * Map an evdev key or switch event to the ACPIEvent it describes,
+     * UNKNOWN for everything that is not a press or a switch change
+     */
+    static PowerManagement::ACPIEvent classifyInputEvent(const struct input_event &input)
+    {
+        for (size_t i = 0; i < sizeof(inputMappings) / sizeof(inputMappings[0]); i++) {
+            if (inputMappings[i].type == input.type && inputMappings[i].code == input.code && inputMappings[i].value == input.value) {
+                return inputMappings[i].event;
+            }
+        }
+
+        return PowerManagement::ACPIEvent::UNKNOWN;
+    }
+
+    /**
+     * Build the bitmaps of the mapped keys and switches, in the layout of
+     * EVIOCGBIT and EVIOCSMASK
+     */
+    static void mappedInputBits(unsigned long *keys, unsigned long *switches)
+    {
+        memset(keys, 0, INPUT_BITMAP_LONGS(KEY_MAX) * sizeof(unsigned long));
+        memset(switches, 0, INPUT_BITMAP_LONGS(SW_MAX) * sizeof(unsigned long));
+
+        for (size_t i = 0; i < sizeof(inputMappings) / sizeof(inputMappings[0]); i++) {
+            unsigned long *bits = inputMappings[i].type == EV_KEY ? keys : switches;
+            bits[inputMappings[i].code / INPUT_LONG_BITS] |= 1UL << (inputMappings[i].code % INPUT_LONG_BITS);
+        }
+    }
+
+    /**
+     * Check that the device has at least one of the mapped keys or switches
+     */
+    static bool hasMappedInput(int fd)
+    {
+        unsigned long keys[INPUT_BITMAP_LONGS(KEY_MAX)], switches[INPUT_BITMAP_LONGS(SW_MAX)];
+        unsigned long deviceKeys[INPUT_BITMAP_LONGS(KEY_MAX)], deviceSwitches[INPUT_BITMAP_LONGS(SW_MAX)];
+
+        mappedInputBits(keys, switches);
+
+        memset(deviceKeys, 0, sizeof(deviceKeys));
+        memset(deviceSwitches, 0, sizeof(deviceSwitches));
+
+        /* a device without the type fails the ioctl or leaves the bitmap empty */
+        (void) ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(deviceKeys)), deviceKeys);
+        (void) ioctl(fd, EVIOCGBIT(EV_SW, sizeof(deviceSwitches)), deviceSwitches);
+
+        for (size_t i = 0; i < INPUT_BITMAP_LONGS(KEY_MAX); i++) {
+            if ((keys[i] & deviceKeys[i]) != 0) return true;
+        }
+
+        for (size_t i = 0; i < INPUT_BITMAP_LONGS(SW_MAX); i++) {
+            if ((switches[i] & deviceSwitches[i]) != 0) return true;
+        }
+
+        return false;
+    }
+
+    /**
+     * Ask the kernel to queue only the mapped keys and switches, so typing
+     * on the keyboard does not wake the listener up. The mask is per open
+     * file and needs Linux 4.4, older kernels keep delivering everything.
+     */
+    static void maskInputEvents(int fd)
+    {
+#ifdef EVIOCSMASK
+        unsigned long keys[INPUT_BITMAP_LONGS(KEY_MAX)], switches[INPUT_BITMAP_LONGS(SW_MAX)];
+        unsigned long none[INPUT_BITMAP_LONGS(MSC_MAX)];
+
+        mappedInputBits(keys, switches);
+        memset(none, 0, sizeof(none));
+
+        struct input_mask masks[] = {
+                {EV_KEY, (uint32_t) sizeof(keys), (uint64_t) (uintptr_t) keys},
+                {EV_SW, (uint32_t) sizeof(switches), (uint64_t) (uintptr_t) switches},
+                {EV_MSC, (uint32_t) sizeof(none), (uint64_t) (uintptr_t) none},
+        };
+
+        for (struct input_mask &mask : masks) {
+            (void) ioctl(fd, EVIOCSMASK, &mask);
+        }
+#else
+        (void) fd;
+#endif
+    }
+
+    /**
+     * Open the evdev devices that carry the hotkeys, the lid switch and
+     * the power button. Only the first device of every name is opened,
+     * the ACPI power button shows up twice (LNXPWRBN and PNP0C0C) on most
+     * machines and would report every press twice.
+     */
+    static void openInputDevices(vector<std::pair<int, string>> *devices)
+    {
+        static const char *names[] = {
+                EVDEV_THINKPAD_BUTTONS,
+                EVDEV_AT_KEYBOARD,
+                EVDEV_LID_SWITCH,
+                EVDEV_POWER_BUTTON,
+        };
+
+        DIR *dir = opendir(DEV_INPUT);
+
+        if (dir == NULL) {
+            fprintf(stderr, "evdev: failed to list %s: %s\n", DEV_INPUT, strerror(errno));
+            return;
+        }
+
+        vector<int> events;
+        struct dirent *entry;
+
+        while ((entry = readdir(dir)) != NULL) {
+            if (strncmp(entry->d_name, "event", 5) == 0) {
+                events.push_back(atoi(entry->d_name + 5));
+            }
+        }
+
+        closedir(dir);
+
+        /* the first match is the one the kernel registered first */
+        std::sort(events.begin(), events.end());
+
+        bool opened[sizeof(names) / sizeof(names[0])] = {false};
+
+        for (int device : events) {
+
+            string path = DEV_INPUT "event" + std::to_string(device);
+            int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+            if (fd < 0) {
+                continue;
+            }
+
+            char name[256];
+            memset(name, 0, sizeof(name));
+
+            int wanted = -1;
+
+            if (ioctl(fd, EVIOCGNAME(sizeof(name) - 1), name) >= 0) {
+                for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+                    if (!opened[i] && strcmp(name, names[i]) == 0) {
+                        wanted = (int) i;
+                        break;
+                    }
+                }
+            }
+
+            if (wanted < 0 || !hasMappedInput(fd)) {
+                close(fd);
+                continue;
+            }
+
+            maskInputEvents(fd);
+
+            opened[wanted] = true;
+            devices->push_back(std::make_pair(fd, path));
+
+        }
+    }
+
+    /**
+     * Reads struct input_event records from an evdev device, or from
+     * anything else that yields them
+     */
+    class InputSource : public PowerManagement::EventSource {
+    private:
+
+        int fd;
+        string path;
+        size_t pending = 0;
+        struct input_event events[EVDEV_BATCH];
+
+    public:
+
+        /* a device opened by path is opened again on a restart, a bare descriptor is not */
+        InputSource(int fd, const string &path = string()) : fd(fd), path(path) {}
+
+        ~InputSource()
+        {
+            close();
+        }
+
+        bool open(PowerManagement::ACPI*) override
+        {
+            if (fd < 0 && !path.empty()) {
+
+                fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+                if (fd >= 0) {
+                    maskInputEvents(fd);
+                }
+
+            }
+
+            pending = 0;
+
+            return fd >= 0;
+        }
+
+        void getFds(vector<PowerManagement::EventSourceFd> *fds) override
+        {
+            fds->push_back({fd, false, false});
+        }
+
+        bool drain(PowerManagement::ACPI *acpi, const vector<PowerManagement::EventSourceFd>&) override
+        {
+            using PowerManagement::ACPIEvent;
+
+            /* read a whole batch at once, a pipe may hand over partial records */
+            char *buf = (char*) events;
+            ssize_t len = read(fd, buf + pending, sizeof(events) - pending);
+
+            if (len < 0 && (errno == EINTR || errno == EAGAIN)) {
+                return true;
+            }
+
+            if (len <= 0) {
+                /* the device went away */
+                return false;
+            }
+
+            size_t total = pending + (size_t) len;
+            size_t count = total / sizeof(struct input_event);
+
+            for (size_t i = 0; i < count; i++) {
+
+                const struct input_event &input = events[i];
+
+                if (input.type != EV_KEY && input.type != EV_SW) {
+                    continue;
+                }
+
+                ACPIEvent event = classifyInputEvent(input);
+
+                /* releases and autorepeat are not events of their own */
+                if (event != ACPIEvent::UNKNOWN) {
+                    emit(acpi, event);
+                }
+
+            }
+
+            pending = total - count * sizeof(struct input_event);
+            memmove(buf, buf + count * sizeof(struct input_event), pending);
+
+            return true;
+        }
+
+        void close() override
+        {
+            if (fd >= 0) {
+                ::close(fd);
+                fd = -1;
+            }
+        }
+    };
+
+    /*
+     * Whether any mains supply is online as last seen by the udev
+     * listener, -1 if the state is not tracked
+     */
+    static std::atomic<int> acState(-1);
+
+    /* the power_supply class directory, can be moved for testing */
+    static string powerSupplyRoot = SYSFS_POWER_SUPPLY;
+
+    /**
+     * Read a small sysfs attribute of a power supply
+     * @return the length of the value without the newline, or -1
+     */
+    static ssize_t readSupplyAttribute(const char *supply, const char *attribute, char *buf, size_t size)
+    {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s/%s", powerSupplyRoot.c_str(), supply, attribute);
+
+        struct timespec started;
+        clock_gettime(CLOCK_MONOTONIC, &started);
+
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+        if (fd < 0) {
+            countSysfsRead(started, false);
+            return -1;
+        }
+
+        ssize_t len = read(fd, buf, size - 1);
+        close(fd);
+
+        countSysfsRead(started, len >= 0);
+
+        if (len < 0) {
+            return -1;
+        }
+
+        while (len > 0 && buf[len - 1] == '\n') len--;
+        buf[len] = 0;
+
+        return len;
+    }
+
+    static bool readACOnline()
+    {
+        DIR *dir = opendir(powerSupplyRoot.c_str());
+
+        if (dir == NULL) {
+            return false;
+        }
+
+        bool online = false;
+        struct dirent *entry;
+        char buf[16];
+
+        while (!online && (entry = readdir(dir)) != NULL) {
+
+            if (entry->d_name[0] == '.') continue;
+
+            if (readSupplyAttribute(entry->d_name, "type", buf, sizeof(buf)) < 0 || strcmp(buf, "Mains") != 0) {
+                continue;
+            }
+
+            online = readSupplyAttribute(entry->d_name, "online", buf, sizeof(buf)) > 0 && buf[0] == '1';
+
+        }
+
+        closedir(dir);
+
+        return online;
+    }
+
+#ifdef SYSTEMD
+
+#define LOGIND_PREPARE_FOR_SLEEP "type='signal',sender='org.freedesktop.login1'," \
+    "path='/org/freedesktop/login1',interface='org.freedesktop.login1.Manager',member='PrepareForSleep'"
+
+    struct SleepSignal {
+        bool received;
+        bool start;
+    };
+
+    /**
+     * PrepareForSleep(true) is sent right before the system suspends
+     * and PrepareForSleep(false) right after it resumed
+     */
+    static int handle_prepare_for_sleep(sd_bus_message *message, void *userdata, sd_bus_error*)
+    {
+        SleepSignal *signal = (SleepSignal*) userdata;
+        int start;
+
+        if (sd_bus_message_read(message, "b", &start) < 0) {
+            fprintf(stderr, "udev: malformed PrepareForSleep signal\n");
+            return 0;
+        }
+
+        signal->received = true;
+        signal->start = start != 0;
+
+        return 0;
+    }
+
+#endif
+
+    /**
+     * Watches the udev events of the docks, the ThinkLight, the backlights,
+     * the power supplies and, without logind, the machinecheck devices. With
+     * logind, suspend and resume come from its PrepareForSleep signal.
+     */
+    class UdevSource : public PowerManagement::EventSource {
+    private:
+
+        string udevTag;
+
+        struct udev *udev = nullptr;
+        struct udev_monitor *monitor = nullptr;
+        int fd = -1;
+
+        int lightFd = -1;
+
+        bool opened = false;
+
+        /* with logind, suspend and resume come from PrepareForSleep, not from machinecheck */
+        bool logindSleep = false;
+        bool enteringS3S4 = false;
+
+#ifdef SYSTEMD
+
+        sd_bus *bus = nullptr;
+        sd_bus_slot *sleepSlot = nullptr;
+        SleepSignal sleepSignal = { false, false };
+
+        /* the handlers of POWER_S3S4_ENTER run while the loop goes on, the pipe says when they are done */
+        PowerManagement::ACPI *owner = nullptr;
+        PowerManagement::ACPIEventCompletion *sleepCompletion = nullptr;
+        int sleepFds[2] = {-1, -1};
+
+        void finishSleep(bool force);
+
+#endif
+
+        /* the dock state settles a while after its event, it is read once this passed */
+        static const long DOCK_SETTLE_US = 1000000L;
+
+        string dockSyspath;
+        struct timespec dockEvent;
+
+        void receive(PowerManagement::ACPI *acpi, struct udev_device *device);
+
+    public:
+
+        UdevSource(const string &udevTag) : udevTag(udevTag) {}
+
+        ~UdevSource()
+        {
+            close();
+        }
+
+        bool open(PowerManagement::ACPI *acpi) override;
+        void getFds(vector<PowerManagement::EventSourceFd> *fds) override;
+        int getTimeout() override;
+        bool drain(PowerManagement::ACPI *acpi, const vector<PowerManagement::EventSourceFd> &fds) override;
+        void close() override;
+    };
+
+    bool UdevSource::open(PowerManagement::ACPI *acpi)
+    {
+        using PowerManagement::PowerStateManager;
+
+#ifdef DEBUG
+
+        printf("starting udev listener...\n");
+
+#endif
+
+#ifdef SYSTEMD
+
+        if (sd_bus_open_system(&bus) >= 0 &&
+            sd_bus_add_match(bus, &sleepSlot, LOGIND_PREPARE_FOR_SLEEP, handle_prepare_for_sleep, &sleepSignal) >= 0) {
+            logindSleep = true;
+        } else {
+            fprintf(stderr, "udev: logind is not available, using machinecheck for suspend events\n");
+            sd_bus_unref(bus);
+            bus = nullptr;
+        }
+
+        if (logindSleep && pipe2(sleepFds, O_CLOEXEC | O_NONBLOCK) < 0) {
+            fprintf(stderr, "udev: failed to create the sleep pipe: %s\n", strerror(errno));
+            sleepFds[0] = sleepFds[1] = -1;
+        }
+
+        if (logindSleep) {
+            PowerStateManager::takeSleepInhibitor();
+        }
+
+        owner = acpi;
+
+#else
+
+        (void) acpi;
+
+#endif
+
+        udev = udev_new();
+        monitor = udev_monitor_new_from_netlink(udev, "udev");
+
+        /* the tag filter is ANDed with the subsystem filters, in the kernel */
+        if (!udevTag.empty()) {
+            udev_monitor_filter_add_match_tag(monitor, udevTag.c_str());
+        }
+
+        udev_monitor_filter_add_match_subsystem_devtype(monitor, "platform", NULL);
+        if (!logindSleep) {
+            udev_monitor_filter_add_match_subsystem_devtype(monitor, "machinecheck", NULL);
+        }
+
+        udev_monitor_filter_add_match_subsystem_devtype(monitor, "leds", NULL);
+        udev_monitor_filter_add_match_subsystem_devtype(monitor, "backlight", NULL);
+        udev_monitor_filter_add_match_subsystem_devtype(monitor, "power_supply", NULL);
+        udev_monitor_enable_receiving(monitor);
+
+        fd = udev_monitor_get_fd(monitor);
+
+        /*
+         * Changes made by the hardware (Fn+PgUp) do not always come as an uevent,
+         * newer kernels notify them on brightness_hw_changed instead. The
+         * attribute has to be read once before the notifications are armed.
+         */
+        lightFd = ::open(SYSFS_THINKLIGHT_HW_CHANGED, O_RDONLY | O_CLOEXEC);
+        char lightBuf[8];
+
+        if (lightFd >= 0) {
+            (void) read(lightFd, lightBuf, sizeof(lightBuf));
+        }
+
+        bool lightOn;
+
+        if (readThinkLight(&lightOn)) {
+            thinkLightState.store(lightOn ? 1 : 0);
+        }
+
+        acState.store(readACOnline() ? 1 : 0);
+
+        /* enumerate the docks now instead of on the first udev event */
+        getDockEntries();
+
+        opened = true;
+
+        return true;
+    }
+
+    void UdevSource::getFds(vector<PowerManagement::EventSourceFd> *fds)
+    {
+        fds->push_back({fd, false, false});
+
+        if (lightFd >= 0) {
+            fds->push_back({lightFd, true, false});
+        }
+
+#ifdef SYSTEMD
+
+        if (logindSleep) {
+            fds->push_back({sd_bus_get_fd(bus), false, false});
+        }
+
+        if (sleepFds[0] >= 0) {
+            fds->push_back({sleepFds[0], false, false});
+        }
+
+#endif
+    }
+
+    int UdevSource::getTimeout()
+    {
+        int timeout = -1;
+
+        if (!dockSyspath.empty()) {
+            const long remaining = DOCK_SETTLE_US - microsecondsSince(dockEvent);
+            timeout = remaining > 0 ? (int) ((remaining + 999) / 1000) : 0;
+        }
+
+#ifdef SYSTEMD
+
+        if (sleepCompletion != nullptr) {
+            const int sleep = getTrackedTimeout(sleepCompletion);
+            timeout = timeout < 0 ? sleep : std::min(timeout, sleep);
+        }
+
+#endif
+
+        return timeout;
+    }
+
+#ifdef SYSTEMD
+
+    /**
+     * Let the system suspend once the handlers of POWER_S3S4_ENTER are done
+     * or the sleep delay passed
+     */
+    void UdevSource::finishSleep(bool force)
+    {
+        if (sleepCompletion == nullptr || !finishTracked(owner, sleepCompletion, force)) {
+            return;
+        }
+
+        sleepCompletion = nullptr;
+        PowerManagement::PowerStateManager::releaseSleepInhibitor();
+    }
+
+#endif
+
+    bool UdevSource::drain(PowerManagement::ACPI *acpi, const vector<PowerManagement::EventSourceFd> &fds)
+    {
+        using PowerManagement::ACPIEvent;
+        using PowerManagement::PowerStateManager;
+
+#ifdef SYSTEMD
+
+        /* sd-bus handles one message per call, drain it all */
+        while (logindSleep && sd_bus_process(bus, NULL) > 0) {
+
+            if (sleepSignal.received && sleepSignal.start) {
+
+                sleepSignal.received = false;
+
+                /* logind waits for the lock, it is released once the handlers are done */
+                if (sleepCompletion == nullptr) {
+
+                    sleepCompletion = emitTracked(acpi, ACPIEvent::POWER_S3S4_ENTER, sleepFds[1]);
+
+                    if (sleepCompletion == nullptr) {
+                        PowerStateManager::releaseSleepInhibitor();
+                    }
+
+                }
+
+            }
+
+            if (sleepSignal.received && !sleepSignal.start) {
+                sleepSignal.received = false;
+                finishSleep(true);
+                PowerStateManager::takeSleepInhibitor();
+                emit(acpi, ACPIEvent::POWER_S3S4_EXIT);
+            }
+
+        }
+
+        if (sleepFds[0] >= 0) {
+            char done[16];
+            while (read(sleepFds[0], done, sizeof(done)) > 0);
+        }
+
+        finishSleep(false);
+
+#endif
+
+        for (const PowerManagement::EventSourceFd &ready : fds) {
+
+            if (!ready.ready) {
+                continue;
+            }
+
+            if (ready.fd == lightFd) {
+
+                char lightBuf[8];
+                ACPIEvent event;
+
+                lseek(lightFd, 0, SEEK_SET);
+                (void) read(lightFd, lightBuf, sizeof(lightBuf));
+
+                if (updateThinkLight(&event)) {
+                    emit(acpi, event);
+                }
+
+            }
+
+            if (ready.fd == fd) {
+
+                /* the monitor socket does not block, take every queued device */
+                struct udev_device *device;
+
+                while ((device = udev_monitor_receive_device(monitor)) != NULL) {
+                    receive(acpi, device);
+                    udev_device_unref(device);
+                }
+
+            }
+
+        }
+
+        if (!dockSyspath.empty() && microsecondsSince(dockEvent) >= DOCK_SETTLE_US) {
+
+            Hardware::Dock dock(dockSyspath);
+            dockSyspath.clear();
+
+            if (!dock.probe()) {
+                fprintf(stderr, "fixme: udev event fired on non-sane dock\n");
+            } else {
+                emit(acpi, dock.isDocked() ? ACPIEvent::DOCKED : ACPIEvent::UNDOCKED);
+            }
+
+        }
+
+        return true;
+    }
+
+    void UdevSource::receive(PowerManagement::ACPI *acpi, struct udev_device *device)
+    {
+        using PowerManagement::ACPIEvent;
+
+        ACPIEvent event = ACPIEvent::UNKNOWN;
+
+        Hardware::DeviceRegistry::update(device);
+
+        const char *subsystem = udev_device_get_subsystem(device);
+
+        if (subsystem != NULL && strcmp(subsystem, "backlight") == 0) {
+            return;
+        }
+
+        /* the uevent carries the properties of the supply, no need to read sysfs */
+        if (subsystem != NULL && strcmp(subsystem, "power_supply") == 0) {
+
+            const char *type = udev_device_get_property_value(device, "POWER_SUPPLY_TYPE");
+            const char *online = udev_device_get_property_value(device, "POWER_SUPPLY_ONLINE");
+
+            if (type != NULL && strcmp(type, "Mains") == 0 && online != NULL) {
+
+                const int state = online[0] == '1' ? 1 : 0;
+
+                if (acState.exchange(state) == state) {
+                    return;
+                }
+
+                event = state ? ACPIEvent::AC_CONNECTED : ACPIEvent::AC_DISCONNECTED;
+
+            } else if (type != NULL && strcmp(type, "Battery") == 0) {
+
+                event = ACPIEvent::BATTERY_CHANGED;
+
+            }
+
+        }
+
+        if (subsystem != NULL && strcmp(subsystem, "leds") == 0) {
+
+            const char *sysname = udev_device_get_sysname(device);
+
+            if (sysname == NULL || strcmp(sysname, THINKLIGHT_LED) != 0 || !updateThinkLight(&event)) {
+                return;
+            }
+
+        }
+
+        /*
+         * The dock stations are the /sys/devices/platform/dock.N devices,
+         * dock.2 on the XX20 series ThinkPads. The devpath of the event is
+         * matched against the ones enumerated when the source was opened.
+         */
+        const char *devpath = udev_device_get_devpath(device);
+        const DockEntry *dockEntry = devpath != NULL ? findDock(devpath) : nullptr;
+
+        if (dockEntry != nullptr) {
+
+            /*
+             * One could argue that I can use this instead of reading the
+             * file manually but this just plainly does not work, it returns
+             * what it feels like of returning
+             */
+            // const char *docked = udev_device_get_sysattr_value(device, "docked");
+
+            /* Wait for the dock to appear, without holding up the other sources */
+            dockSyspath = dockEntry->syspath;
+            clock_gettime(CLOCK_MONOTONIC, &dockEvent);
+
+            return;
+
+        }
+
+        /*
+         * Without logind we fall back to a heuristic:
+         * When the system is suspending, Linux switches off all CPU cores
+         * but one, and this change is reflected in the sysfs with the
+         * removal/addition of the machinecheck files. We intercept these
+         * changes and act upon them
+         */
+        if (strstr(udev_device_get_syspath(device), SYSFS_MACHINECHECK) != NULL) {
+
+            const char *action = udev_device_get_action(device);
+
+            if (strcmp(action, "remove") == 0) {
+
+                /**
+                 * Each core except for CPU0 is brought down
+                 * and then up again, we debounce this with
+                 * only one event.
+                 */
+                if (enteringS3S4) {
+                    return;
+                }
+
+                event = ACPIEvent::POWER_S3S4_ENTER;
+                enteringS3S4 = true;
+            }
+
+            if (strcmp(action, "add") == 0) {
+
+                if (!enteringS3S4) {
+                    return;
+                }
+
+                event = ACPIEvent::POWER_S3S4_EXIT;
+                enteringS3S4 = false;
+            }
+
+        }
+
+        emit(acpi, event);
+    }
+
+    void UdevSource::close()
+    {
+        if (!opened) {
+            return;
+        }
+
+        if (lightFd >= 0) {
+            ::close(lightFd);
+            lightFd = -1;
+        }
+
+        udev_monitor_unref(monitor);
+        udev_unref(udev);
+
+        monitor = nullptr;
+        udev = nullptr;
+        fd = -1;
+
+#ifdef SYSTEMD
+
+        finishSleep(true);
+
+        if (sleepFds[0] >= 0) {
+            ::close(sleepFds[0]);
+            ::close(sleepFds[1]);
+            sleepFds[0] = sleepFds[1] = -1;
+        }
+
+        sd_bus_slot_unref(sleepSlot);
+        sd_bus_flush_close_unref(bus);
+
+        sleepSlot = nullptr;
+        bus = nullptr;
+        owner = nullptr;
+
+        if (logindSleep) {
+            PowerManagement::PowerStateManager::releaseSleepInhibitor();
+        }
+
+#endif
+
+        logindSleep = false;
+        opened = false;
+
+        thinkLightState.store(-1);
+        acState.store(-1);
+    }
+
+    void PowerManagement::EventSource::emit(ACPI *acpi, ACPIEvent event)
+    {
+        acpi->dispatch(event);
+    }
+
+    PowerManagement::ACPIEventCompletion *PowerManagement::EventSource::emitTracked(ACPI *acpi, ACPIEvent event, int notifyFd)
+    {
+        return acpi->dispatchTracked(event, notifyFd);
+    }
+
+    bool PowerManagement::EventSource::finishTracked(ACPI *acpi, ACPIEventCompletion *completion, bool force)
+    {
+        return acpi->finishTracked(completion, force);
+    }
+
+    int PowerManagement::EventSource::getTrackedTimeout(ACPIEventCompletion *completion)
+    {
+        const long remaining = completion->delay * 1000L - microsecondsSince(completion->started);
+
+        return remaining > 0 ? (int) ((remaining + 999) / 1000) : 0;
+    }
+
+    /**
+     * The event loop: wait on the descriptors of all the sources at once
+     * and let the ready ones drain, until the sources are finished or the
+     * ACPI object is destroyed
+     */
+    void *PowerManagement::ACPI::handle_events(void *_this) {
+
+        ACPI *acpiClass = (ACPI*) _this;
+
+        vector<EventSource*> active;
+
+        for (EventSource *source : acpiClass->sources) {
+            if (source->open(acpiClass)) {
+                active.push_back(source);
+            }
+        }
+
+        vector<vector<EventSourceFd>> fds(active.size());
+        vector<int> timeouts(active.size());
+        vector<struct pollfd> pollfds;
+
+        while (!active.empty()) {
+
+            pollfds.clear();
+            pollfds.push_back({acpiClass->wakeFds[0], POLLIN, 0});
+
+            int timeout = -1;
+
+            for (size_t i = 0; i < active.size(); i++) {
+
+                fds[i].clear();
+                active[i]->getFds(&fds[i]);
+
+                for (const EventSourceFd &fd : fds[i]) {
+                    pollfds.push_back({fd.fd, (short) (fd.priority ? POLLPRI : POLLIN), 0});
+                }
+
+                timeouts[i] = active[i]->getTimeout();
+
+                if (timeouts[i] >= 0 && (timeout < 0 || timeouts[i] < timeout)) {
+                    timeout = timeouts[i];
+                }
+
+            }
+
+            struct timespec polled;
+            clock_gettime(CLOCK_MONOTONIC, &polled);
+
+            if (poll(pollfds.data(), pollfds.size(), timeout) < 0) {
+                if (errno == EINTR) continue;
+                fprintf(stderr, "acpi: poll failed: %s\n", strerror(errno));
+                break;
+            }
+
+            if (pollfds[0].revents != 0) {
+                break;
+            }
+
+            const long waited = microsecondsSince(polled) / 1000;
+            size_t next = 1;
+
+            for (size_t i = 0; i < active.size(); i++) {
+
+                bool ready = false;
+
+                for (EventSourceFd &fd : fds[i]) {
+                    fd.ready = pollfds[next++].revents != 0;
+                    ready = ready || fd.ready;
+                }
+
+                if (!ready && (timeouts[i] < 0 || waited < timeouts[i])) {
+                    continue;
+                }
+
+                if (!active[i]->drain(acpiClass, fds[i])) {
+
+                    active[i]->close();
+
+                    active.erase(active.begin() + i);
+                    fds.erase(fds.begin() + i);
+                    timeouts.erase(timeouts.begin() + i);
+
+                    /* the remaining pollfds of this round are skipped, poll again */
+                    break;
+                }
+
+            }
+
+        }
+
+        for (EventSource *source : active) {
+            source->close();
+        }
+
+        return NULL;
+
+    }
+
+    PowerManagement::ACPI::ACPI() : ACPIhandlers(new vector<ACPIEventHandler*>)
+    {
+
+    }
+
+    PowerManagement::ACPI::~ACPI()
+    {
+
+        if (this->started) {
+
+            /* wake the loop up, it closes the sources on its way out */
+            const char stop = 1;
+            (void) write(this->wakeFds[1], &stop, 1);
+
+            pthread_join(this->listener, NULL);
+
+        }
+
+        if (this->wakeFds[0] >= 0) {
+            close(this->wakeFds[0]);
+            close(this->wakeFds[1]);
+        }
+
+        for (EventSource *source : this->sources) {
+            delete source;
+        }
+
+        delete this->ACPIhandlers;
+
+    }
+
+    void PowerManagement::ACPI::addEventHandler(PowerManagement::ACPIEventHandler *handler) {
+        this->ACPIhandlers->push_back(handler);
+    }
+
+    void PowerManagement::ACPI::setUdevTag(const char *tag) {
+        this->udevTag = tag != NULL ? tag : "";
+    }
+
+    void PowerManagement::ACPI::setSuppressUnknown(bool suppress) {
+        this->suppressUnknown = suppress;
+    }
+
+    void PowerManagement::ACPI::setUseEvdev(bool enable) {
+        this->useEvdev = enable;
+    }
+
+    void PowerManagement::ACPI::addInputDevice(int fd) {
+        this->sources.push_back(new InputSource(fd));
+    }
+
+    void PowerManagement::ACPI::addEventSource(EventSource *source) {
+        this->sources.push_back(source);
+    }
+
+    void PowerManagement::ACPI::wait() {
+        if (this->started) {
+            pthread_join(this->listener, NULL);
+            this->started = false;
+
+            /* a later start() makes a new one */
+            close(this->wakeFds[0]);
+            close(this->wakeFds[1]);
+            this->wakeFds[0] = this->wakeFds[1] = -1;
+        }
+    }
+
+    void PowerManagement::ACPI::start()
+    {
+        if (this->started) {
+            return;
+        }
+
+        /* a restart after wait() opens the same sources again */
+        if (!this->builtinSources) {
+
+            bool acpid = true;
+
+            if (this->useEvdev) {
+
+                vector<std::pair<int, string>> devices;
+
+                openInputDevices(&devices);
+
+                for (const std::pair<int, string> &device : devices) {
+                    this->sources.push_back(new InputSource(device.first, device.second));
+                }
+
+                if (!devices.empty()) {
+                    acpid = false;
+                } else {
+                    fprintf(stderr, "evdev: no input devices found, using acpid\n");
+                }
+
+            }
+
+            /* the acpid and the udev events */
+            if (acpid) {
+                this->sources.push_back(new AcpidSource);
+            }
+
+            this->sources.push_back(new UdevSource(this->udevTag));
+
+            this->builtinSources = true;
+
+        }
+
+        if (pipe2(this->wakeFds, O_CLOEXEC) < 0) {
+            fprintf(stderr, "acpi: failed to create the wake pipe: %s\n", strerror(errno));
+            return;
+        }
+
+        const int error = pthread_create(&this->listener, NULL, handle_events, this);
+
+        this->started = error == 0;
+
+        if (!this->started) {
+            fprintf(stderr, "acpi: failed to start the listener: %s\n", strerror(error));
+            close(this->wakeFds[0]);
+            close(this->wakeFds[1]);
+            this->wakeFds[0] = this->wakeFds[1] = -1;
+        }
+    }
+
+    void *PowerManagement::ACPIEventHandler::_handleEvent(void* _this) {
+        ACPIEventMetadata *metadata = (ACPIEventMetadata*) _this;
+
+        metadata->handler->handleEvent(metadata->event);
+
+        ACPIEventCompletion *completion = metadata->completion;
+
+        if (completion != nullptr) {
+
+            pthread_mutex_lock(&completion->lock);
+
+            for (HandlerTiming &timing : completion->timings) {
+                if (timing.handler == metadata->handler && !timing.finished && timing.microseconds < 0) {
+                    timing.microseconds = microsecondsSince(completion->started);
+                    timing.finished = true;
+                    break;
+                }
+            }
+
+            /* wake the event loop up, it finishes the dispatch */
+            if (--completion->pending == 0 && completion->notifyFd >= 0) {
+                const char done = 1;
+                (void) write(completion->notifyFd, &done, 1);
+            }
+
+            releaseCompletion(completion);
+
+        }
+
+        free(metadata);
+        return NULL;
+    }
+
+
+    /********************** Utilities::Ini *******************/
+
+    Utilities::Ini::Ini::Ini()
+    {
+
+    }
+
+    Utilities::Ini::Ini::Ini(const IniSnapshot &snapshot)
+    {
+        thaw(snapshot);
+    }
+
+    Utilities::Ini::Ini::~Ini()
+    {
+        if (sections == nullptr) return;
+
+        for (IniSection* section : *sections) {
+            delete section;
+        }
+
+        delete sections;
+    }
+
+    /*
+     * Character classes for the config tokenizer, looked up
+     * through a table instead of a chain of comparisons
+     */
+    enum IniCharClass {
+        INI_SPACE = 1,
+        INI_COMMENT = 2,
+        INI_QUOTE = 4,
+        INI_SPECIAL = 8
+    };
+
+    struct IniCharClasses {
+
+        unsigned char table[256];
+
+        IniCharClasses() {
+            memset(table, 0, sizeof(table));
+            table[(unsigned char) ' '] = INI_SPACE;
+            table[(unsigned char) '\t'] = INI_SPACE;
+            table[(unsigned char) ';'] = INI_COMMENT | INI_SPECIAL;
+            table[(unsigned char) '#'] = INI_COMMENT | INI_SPECIAL;
+            table[(unsigned char) '"'] = INI_QUOTE | INI_SPECIAL;
+            table[(unsigned char) '\\'] = INI_SPECIAL;
+        }
+
+        inline bool is(char c, IniCharClass type) const {
+            return (table[(unsigned char) c] & type) != 0;
+        }
+
+    };
+
+    static const IniCharClasses INI_CLASSES;
+
+    static const char *skipSpaces(const char *ptr, const char *end)
+    {
+        while (ptr < end && INI_CLASSES.is(*ptr, INI_SPACE)) ptr++;
+        return ptr;
+    }
+
+    static const char *trimSpaces(const char *start, const char *end)
+    {
+        while (end > start && INI_CLASSES.is(end[-1], INI_SPACE)) end--;
+        return end;
+    }
+
+    /**
+     * Quote a value if reading it back unquoted would change it:
+     * leading or trailing whitespace, comment characters or a leading quote
+     */
+    static string formatValue(const char *value)
+    {
+        const size_t length = strlen(value);
+        bool quote = length > 0 && (INI_CLASSES.is(value[0], INI_SPACE) || INI_CLASSES.is(value[length - 1], INI_SPACE)
+                                    || value[0] == '"');
+
+        for (size_t i = 0; i < length && !quote; i++) {
+            quote = INI_CLASSES.is(value[i], INI_COMMENT);
+        }
+
+        if (!quote) {
+            return string(value, length);
+        }
+
+        string quoted("\"");
+
+        for (size_t i = 0; i < length; i++) {
+            if (value[i] == '"' || value[i] == '\\') quoted.push_back('\\');
+            quoted.push_back(value[i]);
+        }
+
+        quoted.push_back('"');
+
+        return quoted;
+    }
+
+    vector<Utilities::Ini::IniSection*>* Utilities::Ini::Ini::readIni(std::string path)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+
+        if (fd < 0) {
+            fprintf(stderr, "config: error opening: %s: %s\n", path.c_str(), strerror(errno));
+            return nullptr;
+        }
+
+        if (!statSource(fd)) {
+            fprintf(stderr, "config: fstat failed: %s\n", strerror(errno));
+            close(fd);
+            return nullptr;
+        }
+
+        /* keep the file contents around so saveChanges() can patch it later */
+        this->source.resize((size_t) this->sourceSize);
+        this->sourcePath = path;
+
+        if (read(fd, &this->source[0], (size_t) this->sourceSize) != this->sourceSize) {
+            fprintf(stderr, "config: read failed: %s\n", strerror(errno));
+            close(fd);
+            this->sourcePath.clear();
+            return nullptr;
+        }
+
+        close(fd);
+
+        parseIni(this->source.data(), this->source.size(), path.c_str());
+
+        return this->sections;
+    }
+
+    vector<Utilities::Ini::IniSection*>* Utilities::Ini::Ini::readIniBuffer(const char *data, size_t size, string name)
+    {
+        /* the buffer is not a file, saveChanges() has nothing to patch */
+        this->source.assign(data, size);
+        this->sourcePath.clear();
+        this->sourceSize = -1;
+
+        parseIni(this->source.data(), this->source.size(), name.c_str());
+
+        return this->sections;
+    }
+
+    /**
+     * The newline at or after from, or end if the last line has none
+     */
+    static inline const char *findNewline(const char *from, const char *end)
+    {
+        const char *newline = scanAny(from, end, "\n");
+        return newline == nullptr ? end : newline;
+    }
+
+    bool Utilities::Ini::Ini::parseIni(const char *data, size_t size, const char *name)
+    {
+        /*
+         * A keypair line, the bulk of a file, takes one vector scan up to
+         * the '=' and one over the value, the spaces are trimmed through
+         * the character classes
+         */
+        const char *end = data + size;
+        const char *line = data;
+
+        IniSection *section = nullptr;
+        int lineNumber = 0;
+        bool valid = true;
+
+        auto error = [&](const char *at, const char *message) {
+            fprintf(stderr, "config: %s:%d:%d: %s\n", name, lineNumber, (int) (at - line) + 1, message);
+            valid = false;
+        };
+
+        /* the line end without a CR before the newline, and the start of the next line */
+        const char *lineEnd;
+        const char *next;
+
+        auto endLine = [&](const char *newline) {
+            next = newline == end ? end : newline + 1;
+            lineEnd = newline > line && newline[-1] == '\r' ? newline - 1 : newline;
+        };
+
+        for (; line < end; line = next) {
+
+            lineNumber++;
+
+            const char *ptr = skipSpaces(line, end);
+
+            /* blank lines and comments */
+            if (ptr == end || *ptr == '\n' || (*ptr == '\r' && (ptr + 1 == end || ptr[1] == '\n'))
+                || INI_CLASSES.is(*ptr, INI_COMMENT)) {
+                endLine(findNewline(ptr, end));
+                continue;
+            }
+
+            if (*ptr == '[') {
+
+                endLine(findNewline(ptr, end));
+
+                const char *close = scanAny(ptr, lineEnd, "]");
+
+                if (close == nullptr) {
+                    error(lineEnd, "expected ']'");
+                    section = nullptr;
+                    continue;
+                }
+
+                const char *rest = skipSpaces(close + 1, lineEnd);
+
+                if (rest != lineEnd && !INI_CLASSES.is(*rest, INI_COMMENT)) {
+                    error(rest, "unexpected token after section name");
+                }
+
+                const char *nameStart = skipSpaces(ptr + 1, close);
+                const char *nameEnd = trimSpaces(nameStart, close);
+
+                if ((size_t) (nameEnd - nameStart) >= sizeof(IniSection::name)) {
+                    error(nameStart, "section name too long");
+                    section = nullptr;
+                    continue;
+                }
+
+                section = new IniSection;
+                section->keypairs = new vector<IniKeypair*>;
+                section->offset = ptr - data;
+                section->end = next - data;
+                memcpy(section->name, nameStart, (size_t) (nameEnd - nameStart));
+
+                this->sections->push_back(section);
+
+                continue;
+
+            }
+
+            if (section == nullptr) {
+                endLine(findNewline(ptr, end));
+                error(ptr, "keypair outside of a section");
+                continue;
+            }
+
+            const char *equals = scanAny(ptr, end, "=\n");
+
+            if (equals == nullptr || *equals != '=') {
+                endLine(equals == nullptr ? end : equals);
+                error(lineEnd, "expected '='");
+                continue;
+            }
+
+            const char *keyEnd = trimSpaces(ptr, equals);
+
+            if (keyEnd == ptr) {
+                endLine(findNewline(equals, end));
+                error(ptr, "empty key");
+                continue;
+            }
+
+            if ((size_t) (keyEnd - ptr) >= sizeof(IniKeypair::key)) {
+                endLine(findNewline(equals, end));
+                error(ptr, "key too long");
+                continue;
+            }
+
+            const char *token = skipSpaces(equals + 1, end);
+
+            const char *tokenEnd;
+
+            char value[sizeof(IniKeypair::value)];
+            const char *copy = token;
+            size_t length = 0;
+            bool overflow = false;
+
+            if (token < end && *token == '"') {
+
+                endLine(findNewline(token, end));
+
+                /* quoted value, only \" and \\ are escapes */
+                const char *quote = token + 1;
+
+                for (; quote < lineEnd && *quote != '"'; quote++) {
+                    if (*quote == '\\' && quote + 1 < lineEnd && (quote[1] == '"' || quote[1] == '\\')) {
+                        quote++;
+                    }
+                    if (length + 1 >= sizeof(value)) {
+                        overflow = true;
+                        break;
+                    }
+                    value[length++] = *quote;
+                }
+
+                if (!overflow && quote == lineEnd) {
+                    error(lineEnd, "expected '\"'");
+                    continue;
+                }
+
+                tokenEnd = overflow ? lineEnd : quote + 1;
+                copy = value;
+
+                const char *rest = skipSpaces(tokenEnd, lineEnd);
+
+                if (!overflow && rest != lineEnd && !INI_CLASSES.is(*rest, INI_COMMENT)) {
+                    error(rest, "unexpected token after quoted value");
+                }
+
+            } else {
+
+                /* an unquoted value ends at a comment preceded by whitespace, found on the same pass */
+                const char *scan = scanValueEnd(token, end);
+                const char *comment = scan != nullptr && *scan != '\n' ? scan : nullptr;
+
+                if (scan == nullptr) scan = end;
+
+                endLine(comment == nullptr ? scan : findNewline(comment, end));
+
+                tokenEnd = trimSpaces(token, comment == nullptr ? lineEnd : comment);
+                length = (size_t) (tokenEnd - token);
+                overflow = length >= sizeof(value);
+
+            }
+
+            if (overflow) {
+                error(token, "value too long");
+                continue;
+            }
+
+            IniKeypair *keypair = new IniKeypair(ptr, (size_t) (keyEnd - ptr), copy, length);
+
+            keypair->lineOffset = line - data;
+            keypair->lineLength = next - line;
+            keypair->valueOffset = token - data;
+            keypair->valueLength = tokenEnd - token;
+
+            section->keypairs->push_back(keypair);
+            section->end = next - data;
+
+        }
+
+        return valid;
+    }
+
+    bool Utilities::Ini::Ini::statSource(int fd)
+    {
+        struct stat buf;
+
+        if (fstat(fd, &buf) < 0) {
+            return false;
+        }
+
+        this->sourceSize = buf.st_size;
+        this->sourceMtimeSec = buf.st_mtim.tv_sec;
+        this->sourceMtimeNsec = buf.st_mtim.tv_nsec;
+
+        return true;
+    }
+
+    void Utilities::Ini::Ini::serializeSection(string &out, IniSection *section)
+    {
+        section->offset = out.size();
+
+        out.append("[");
+        out.append(section->name);
+        out.append("]\n");
+
+        for (IniKeypair* keypair : *section->keypairs) {
+
+            keypair->lineOffset = out.size();
+
+            out.append(keypair->key);
+            out.append("=");
+
+            const string value = formatValue(keypair->value);
+
+            keypair->valueOffset = out.size();
+            keypair->valueLength = value.size();
+            keypair->dirty = false;
+
+            out.append(value);
+            out.append("\n");
+
+            keypair->lineLength = out.size() - keypair->lineOffset;
+
+        }
+
+        section->end = out.size();
+        section->dirty = false;
+        section->removed.clear();
+
+        out.append("\n");
+    }
+
+    bool Utilities::Ini::Ini::writeIni(std::string path)
+    {
+
+        int fd = open(path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+
+        if (fd < 0) {
+            printf("config: error writing config file: %s\n", strerror(errno));
+            return false;
+        }
+
+        string out;
+
+        for (IniSection *section : *sections) {
+            serializeSection(out, section);
+        }
+
+        if (write(fd, out.data(), out.size()) != (ssize_t) out.size()) {
+            printf("config: write failed: %s\n", strerror(errno));
+            close(fd);
+            this->sourcePath.clear();
+            return false;
+        }
+
+        /* the written file is the new base for saveChanges() */
+        this->source.swap(out);
+        this->sourcePath = statSource(fd) ? path : string();
+
+        close(fd);
+
+        return true;
+
+    }
+
+    /**
+     * A single change to the file on the disk, replacing length bytes
+     * at offset with text
+     */
+    struct IniEdit {
+        long offset;
+        long length;
+        string text;
+
+        IniEdit(long offset, long length, string text = string())
+            : offset(offset), length(length), text(text) {}
+
+        /* new keypairs and sections laid out in text, with their offsets inside it */
+        vector<std::pair<Utilities::Ini::IniKeypair*, long>> keypairs;
+        vector<std::pair<Utilities::Ini::IniSection*, long>> sections;
+        vector<std::pair<Utilities::Ini::IniSection*, long>> ends;
+    };
+
+    bool Utilities::Ini::Ini::saveChanges(std::string path)
+    {
+
+        if (path != this->sourcePath) {
+            return writeIni(path);
+        }
+
+        int fd = open(path.c_str(), O_RDWR);
+
+        if (fd < 0) {
+            return writeIni(path);
+        }
+
+        struct stat buf;
+
+        if (fstat(fd, &buf) < 0
+            || buf.st_size != this->sourceSize
+            || buf.st_mtim.tv_sec != this->sourceMtimeSec
+            || buf.st_mtim.tv_nsec != this->sourceMtimeNsec) {
+            fprintf(stderr, "config: %s changed on the disk, rewriting\n", path.c_str());
+            close(fd);
+            return writeIni(path);
+        }
+
+        /*
+         * Collect the edits, in file order. Changed values replace their
+         * old bytes, new keypairs are inserted at the end of their section
+         * and new sections are appended at the end of the file.
+         */
+        vector<IniEdit> edits;
+        vector<IniSection*> appended;
+
+        for (IniSection *section : *sections) {
+
+            if (!section->dirty) continue;
+
+            if (section->offset < 0) {
+                appended.push_back(section);
+                continue;
+            }
+
+            for (const std::pair<long, long> &line : section->removed) {
+                edits.push_back(IniEdit(line.first, line.second));
+            }
+
+            IniEdit insert(section->end, 0);
+
+            if (insert.offset == (long) source.size() && !source.empty() && source.back() != '\n') {
+                insert.text.append("\n");
+            }
+
+            for (IniKeypair *keypair : *section->keypairs) {
+
+                if (keypair->valueOffset >= 0) {
+                    if (keypair->dirty) {
+                        edits.push_back(IniEdit(keypair->valueOffset, keypair->valueLength, formatValue(keypair->value)));
+                    }
+                    continue;
+                }
+
+                insert.keypairs.push_back(std::make_pair(keypair, (long) insert.text.size()));
+                insert.text.append(keypair->key);
+                insert.text.append("=");
+                insert.text.append(formatValue(keypair->value));
+                insert.text.append("\n");
+            }
+
+            if (!insert.keypairs.empty()) {
+                insert.ends.push_back(std::make_pair(section, (long) insert.text.size()));
+                edits.push_back(insert);
+            }
+
+        }
+
+        if (!appended.empty()) {
+
+            IniEdit append((long) source.size(), 0);
+
+            /* keep a blank line between the sections, like writeIni() does */
+            if (!source.empty() && source.back() != '\n') {
+                append.text.append("\n\n");
+            } else if (source.size() > 1 && source[source.size() - 2] != '\n') {
+                append.text.append("\n");
+            }
+
+            for (IniSection *section : appended) {
+
+                append.sections.push_back(std::make_pair(section, (long) append.text.size()));
+                append.text.append("[");
+                append.text.append(section->name);
+                append.text.append("]\n");
+
+                for (IniKeypair *keypair : *section->keypairs) {
+                    append.keypairs.push_back(std::make_pair(keypair, (long) append.text.size()));
+                    append.text.append(keypair->key);
+                    append.text.append("=");
+                    append.text.append(formatValue(keypair->value));
+                    append.text.append("\n");
+                }
+
+                append.ends.push_back(std::make_pair(section, (long) append.text.size()));
+                append.text.append("\n");
+
+            }
+
+            edits.push_back(append);
+
+        }
+
+        if (edits.empty()) {
+            close(fd);
+            return true;
+        }
+
+        std::stable_sort(edits.begin(), edits.end(), [](const IniEdit &a, const IniEdit &b) {
+            return a.offset < b.offset;
+        });
+
+        /*
+         * Edits that keep their size are patched in place, everything
+         * from the first size change onwards is rewritten as one block.
+         */
+        string updated;
+        updated.reserve(source.size());
+
+        long copied = 0;
+        long rewriteFrom = -1;
+
+        for (const IniEdit &edit : edits) {
+
+            updated.append(source, (size_t) copied, (size_t) (edit.offset - copied));
+
+            if (rewriteFrom < 0 && (long) edit.text.size() != edit.length) {
+                rewriteFrom = edit.offset;
+            }
+
+            if (rewriteFrom < 0 && pwrite(fd, edit.text.data(), edit.text.size(), edit.offset) < 0) {
+                printf("config: write failed: %s\n", strerror(errno));
+                close(fd);
+                this->sourcePath.clear();
+                return false;
+            }
+
+            updated.append(edit.text);
+            copied = edit.offset + edit.length;
+
+        }
+
+        updated.append(source, (size_t) copied, string::npos);
+
+        if (rewriteFrom >= 0) {
+            const size_t tail = updated.size() - (size_t) rewriteFrom;
+            if (pwrite(fd, updated.data() + rewriteFrom, tail, rewriteFrom) != (ssize_t) tail
+                || ftruncate(fd, (off_t) updated.size()) < 0) {
+                printf("config: write failed: %s\n", strerror(errno));
+                close(fd);
+                this->sourcePath.clear();
+                return false;
+            }
+        }
+
+        /*
+         * Everything after an edit moves by the size difference of all
+         * the edits before it. Text inserted right at the end of a section
+         * goes in front of the section that starts there, but the end itself
+         * stays, unless the section inserted the text itself. Keypairs only
+         * move by the edits that start before them: an empty value is replaced
+         * by an edit at its own offset, which must not move it.
+         */
+        vector<long> offsets;
+        vector<long> ends;
+        vector<long> deltas;
+        long delta = 0;
+
+        for (const IniEdit &edit : edits) {
+            delta += (long) edit.text.size() - edit.length;
+            offsets.push_back(edit.offset);
+            ends.push_back(edit.offset + edit.length);
+            deltas.push_back(delta);
+        }
+
+        auto relocate = [&](long offset) -> long {
+            auto it = std::upper_bound(ends.begin(), ends.end(), offset);
+            return it == ends.begin() ? offset : offset + deltas[it - ends.begin() - 1];
+        };
+
+        auto relocateAfter = [&](long offset) -> long {
+            auto it = std::lower_bound(offsets.begin(), offsets.end(), offset);
+            return it == offsets.begin() ? offset : offset + deltas[it - offsets.begin() - 1];
+        };
+
+        for (IniSection *section : *sections) {
+
+            if (section->offset >= 0) {
+                section->offset = relocate(section->offset);
+                section->end = relocateAfter(section->end);
+            }
+
+            for (IniKeypair *keypair : *section->keypairs) {
+
+                if (keypair->valueOffset >= 0) {
+                    keypair->lineOffset = relocateAfter(keypair->lineOffset);
+                    keypair->valueOffset = relocateAfter(keypair->valueOffset);
+                }
+
+                if (keypair->dirty) {
+                    const long length = formatValue(keypair->value).size();
+                    keypair->lineLength += length - keypair->valueLength;
+                    keypair->valueLength = length;
+                    keypair->dirty = false;
+                }
+
+            }
+
+            section->dirty = false;
+            section->removed.clear();
+
+        }
+
+        /* the new keypairs and sections are placed relative to their edit */
+        for (size_t i = 0; i < edits.size(); i++) {
+
+            const long position = edits[i].offset + (i == 0 ? 0 : deltas[i - 1]);
+
+            for (const std::pair<IniKeypair*, long> &placed : edits[i].keypairs) {
+                IniKeypair *keypair = placed.first;
+                keypair->lineOffset = position + placed.second;
+                keypair->valueOffset = keypair->lineOffset + strlen(keypair->key) + 1;
+                keypair->valueLength = formatValue(keypair->value).size();
+                keypair->lineLength = keypair->valueLength + strlen(keypair->key) + 2;
+            }
+
+            for (const std::pair<IniSection*, long> &placed : edits[i].sections) {
+                placed.first->offset = position + placed.second;
+            }
+
+            for (const std::pair<IniSection*, long> &placed : edits[i].ends) {
+                placed.first->end = position + placed.second;
+            }
+
+        }
+
+        this->source.swap(updated);
+        const bool stat = statSource(fd);
+        close(fd);
+
+        if (!stat) {
+            this->sourcePath.clear();
+        }
+
+        return true;
+
+    }
+
+    vector<Utilities::Ini::IniSection *> Utilities::Ini::Ini::getSections(const char *sectionName)
+    {
+
+        vector<IniSection*> ret;
+
+        if (sections == nullptr)
+            return ret;
+
+
+        for (IniSection *section : *this->sections) {
+            if (strcmp(section->name, sectionName) == 0) {
+                ret.push_back(section);
+            }
+        }
+
+        return ret;
+
+    }
+
+    Utilities::Ini::IniSection *Utilities::Ini::Ini::getSection(const char *section)
+    {
+        for (IniSection* local : *sections) {
+            if (strcmp(local->name, section) == 0) {
+                return local;
+            }
+        }
+
+        return nullptr;
+    }
+
+    void Utilities::Ini::Ini::addSection(IniSection *section)
+    {
+        section->offset = -1;
+        section->dirty = true;
+        this->sections->push_back(section);
+    }
+
+    Utilities::Ini::IniKeypair::IniKeypair(const char *key, const char *value)
+    {
+        memset(this->key, 0, sizeof(this->key));
+        memset(this->value, 0, sizeof(this->value));
+
+        strncpy(this->key, key, sizeof(this->key) - 1);
+        strncpy(this->value, value, sizeof(this->value) - 1);
+    }
+
+    Utilities::Ini::IniKeypair::IniKeypair()
+    {
+        memset(this->key, 0, sizeof(this->key));
+        memset(this->value, 0, sizeof(this->value));
+    }
+
+    Utilities::Ini::IniKeypair::IniKeypair(const char *key, size_t keyLength, const char *value, size_t valueLength)
+    {
+        /* every byte written once, the parser creates one of these per line */
+        memcpy(this->key, key, keyLength);
+        memset(this->key + keyLength, 0, sizeof(this->key) - keyLength);
+        memcpy(this->value, value, valueLength);
+        memset(this->value + valueLength, 0, sizeof(this->value) - valueLength);
+    }
+
+    struct IniKeyHash {
+        size_t operator()(const char *key) const {
+            return (size_t) fnv1a(key);
+        }
+    };
+
+    struct IniKeyEqual {
+        bool operator()(const char *a, const char *b) const {
+            return strcmp(a, b) == 0;
+        }
+    };
+
+    /*
+     * A decoded packed string array and the value it was decoded from,
+     * so a value changed behind the cache is decoded again
+     */
+    struct IniStringArray {
+        string packed;
+        vector<string> strings;
+    };
+
+    struct Utilities::Ini::IniIndex {
+        std::unordered_map<const char*, IniKeypair*, IniKeyHash, IniKeyEqual> keys;
+
+        /* decoded packed string arrays, handed out by getStringArray() */
+        std::unordered_map<string, IniStringArray> arrays;
+    };
+
+    Utilities::Ini::IniSection::~IniSection()
+    {
+        for (IniKeypair *keypair : *keypairs) {
+            delete keypair;
+        }
+
+        delete keypairs;
+        delete index;
+    }
+
+    Utilities::Ini::IniSection::IniSection()
+    {
+        memset(this->name, 0, sizeof(this->name));
+    }
+
+    Utilities::Ini::IniSection::IniSection(const char *name)
+    {
+        memset(this->name, 0, sizeof(this->name));
+        strncpy(this->name, name, sizeof(this->name) - 1);
+        this->keypairs = new vector<IniKeypair*>;
+    }
+
+    Utilities::Ini::IniIndex *Utilities::Ini::IniSection::getIndex() const
+    {
+        if (index == nullptr) {
+            index = new IniIndex;
+            indexed = SIZE_MAX;
+        }
+
+        /* keypairs were added or removed directly through the vector */
+        if (indexed != keypairs->size()) {
+
+            index->keys.clear();
+            index->keys.reserve(keypairs->size());
+
+            for (IniKeypair *keypair : *keypairs) {
+                /* the first keypair with the key wins */
+                index->keys.insert(std::make_pair(keypair->key, keypair));
+            }
+
+            indexed = keypairs->size();
+            generation++;
+
+        }
+
+        return index;
+    }
+
+    const char *Utilities::Ini::IniSection::getString(const char *key) const
+    {
+        IniIndex *index = getIndex();
+
+        auto it = index->keys.find(key);
+
+        if (it == index->keys.end()) {
+            return nullptr;
+        }
+
+        return it->second->value;
+    }
+
+    const void Utilities::Ini::IniSection::setString(const char *key, const char *value)
+    {
+        IniIndex *index = getIndex();
+
+        auto it = index->keys.find(key);
+
+        if (it == index->keys.end()) {
+            append(key, value);
+            return;
+        }
+
+        IniKeypair *keypair = it->second;
+
+        if (strcmp(keypair->value, value) == 0) {
+            return;
+        }
+
+        memset(keypair->value, 0, sizeof(keypair->value));
+        strncpy(keypair->value, value, sizeof(keypair->value) - 1);
+
+        if (!index->arrays.empty()) {
+            index->arrays.erase(key);
+        }
+
+        keypair->dirty = true;
+        this->dirty = true;
+    }
+
+    const void Utilities::Ini::IniSection::append(const char *key, const char *value)
+    {
+        IniIndex *index = getIndex();
+
+        IniKeypair *keypair = new IniKeypair(key, value);
+        keypair->dirty = true;
+        this->keypairs->push_back(keypair);
+        this->dirty = true;
+
+        index->keys.insert(std::make_pair(keypair->key, keypair));
+        indexed = keypairs->size();
+        generation++;
+    }
+
+    bool Utilities::Ini::IniSection::remove(const char *key)
+    {
+        IniIndex *index = getIndex();
+
+        if (index->keys.erase(key) == 0) {
+            return false;
+        }
+
+        if (!index->arrays.empty()) {
+            index->arrays.erase(key);
+        }
+
+        /* the key may point into one of the keypairs deleted below */
+        char name[sizeof(IniKeypair::key)];
+        strncpy(name, key, sizeof(name) - 1);
+        name[sizeof(name) - 1] = 0;
+        key = name;
+
+        auto last = std::remove_if(keypairs->begin(), keypairs->end(), [&](IniKeypair *keypair) {
+
+            if (strcmp(keypair->key, key) != 0) {
+                return false;
+            }
+
+            if (keypair->lineOffset >= 0) {
+                this->removed.push_back(std::make_pair(keypair->lineOffset, keypair->lineLength));
+            }
+
+            delete keypair;
+            return true;
+
+        });
+
+        keypairs->erase(last, keypairs->end());
+        indexed = keypairs->size();
+        generation++;
+        this->dirty = true;
+
+        return true;
+    }
+
+    Utilities::Ini::IniKey Utilities::Ini::Ini::compileKey(const char *section, const char *key)
+    {
+        IniKey handle(section, key);
+
+        handle.document = this;
+        handle.resolve();
+
+        return handle;
+    }
+
+    Utilities::Ini::IniKey::IniKey()
+    {
+        memset(this->section, 0, sizeof(this->section));
+        memset(this->key, 0, sizeof(this->key));
+    }
+
+    Utilities::Ini::IniKey::IniKey(const char *section, const char *key) : IniKey()
+    {
+        strncpy(this->section, section, sizeof(this->section) - 1);
+        strncpy(this->key, key, sizeof(this->key) - 1);
+
+        this->sectionHash = fnv1a(this->section);
+        this->keyHash = fnv1a(this->key);
+    }
+
+    void Utilities::Ini::IniKey::resolve() const
+    {
+        /*
+         * Sections are never removed from a document, so a section that was
+         * found stays valid and a missing one can only appear with a new section
+         */
+        if (resolved == nullptr) {
+            resolved = document->getSection(section);
+            sectionCount = document->sections->size();
+        }
+
+        keypair = nullptr;
+
+        if (resolved == nullptr) {
+            return;
+        }
+
+        IniIndex *index = resolved->getIndex();
+        auto it = index->keys.find(key);
+
+        if (it != index->keys.end()) {
+            keypair = it->second;
+        }
+
+        generation = resolved->generation;
+    }
+
+    const char *Utilities::Ini::IniKey::getString() const
+    {
+        if (document == nullptr) {
+            return nullptr;
+        }
+
+        if (resolved == nullptr) {
+
+            if (sectionCount == document->sections->size()) {
+                return nullptr;
+            }
+
+            resolve();
+
+        } else if (generation != resolved->generation || resolved->indexed != resolved->keypairs->size()) {
+
+            resolve();
+
+        }
+
+        return keypair != nullptr ? keypair->value : nullptr;
+    }
+
+    const char *Utilities::Ini::IniKey::getString(const IniSnapshot *snapshot) const
+    {
+        if (snapshot == nullptr || snapshot->serial == 0) {
+            return nullptr;
+        }
+
+        if (snapshot->serial != snapshotSerial) {
+            snapshotValue = snapshot->lookup(sectionHash, section, keyHash, key);
+            snapshotSerial = snapshot->serial;
+        }
+
+        return snapshotValue;
+    }
+
+    Utilities::Ini::IniSection *Utilities::Ini::IniKey::getSection() const
+    {
+        if (document != nullptr && resolved == nullptr && sectionCount != document->sections->size()) {
+            resolve();
+        }
+
+        return resolved;
+    }
+
+    const int Utilities::Ini::IniSection::getInt(const char *key) const
+    {
+        const char *string = getString(key);
+
+        if (string == nullptr) {
+            return INT32_MIN;
+        }
+
+        return atoi(string);
+    }
+
+    const void Utilities::Ini::IniSection::setInt(const char *key, const int value)
+    {
+        set<int>(key, value);
+    }
+
+    /**
+     * Parse a whole value as a signed 64-bit integer,
+     * only trailing whitespace is allowed after the number
+     */
+    static bool parseInt64(const char *string, int64_t *value, const char **end = nullptr)
+    {
+        if (string == nullptr || *string == 0) {
+            return false;
+        }
+
+        char *ptr;
+        errno = 0;
+        long long parsed = strtoll(string, &ptr, 10);
+
+        if (errno == ERANGE || ptr == string) {
+            return false;
+        }
+
+        if (end != nullptr) {
+            *end = ptr;
+        } else {
+            while (*ptr == ' ' || *ptr == '\t') ptr++;
+            if (*ptr != 0) return false;
+        }
+
+        *value = parsed;
+        return true;
+    }
+
+    /**
+     * Parse a duration with an optional unit suffix into a count of the given
+     * resolution in milliseconds, a plain number is already in that resolution.
+     * A value that is not a whole count of the resolution ("1500ms" as seconds)
+     * or does not fit into 64 bits is rejected.
+     */
+    static bool parseDuration(const char *string, int64_t resolution, int64_t *value)
+    {
+        int64_t parsed;
+        const char *unit;
+
+        if (!parseInt64(string, &parsed, &unit)) {
+            return false;
+        }
+
+        int64_t milliseconds;
+
+        if (*unit == 0) {
+            milliseconds = resolution;
+        } else if (strcmp(unit, "ms") == 0) {
+            milliseconds = 1;
+        } else if (strcmp(unit, "s") == 0) {
+            milliseconds = 1000;
+        } else if (strcmp(unit, "m") == 0 || strcmp(unit, "min") == 0) {
+            milliseconds = 60 * 1000;
+        } else if (strcmp(unit, "h") == 0) {
+            milliseconds = 60 * 60 * 1000;
+        } else {
+            return false;
+        }
+
+        if (milliseconds < resolution) {
+
+            if (parsed % (resolution / milliseconds) != 0) {
+                return false;
+            }
+
+            *value = parsed / (resolution / milliseconds);
+            return true;
+
+        }
+
+        const int64_t scale = milliseconds / resolution;
+
+        if (parsed > INT64_MAX / scale || parsed < INT64_MIN / scale) {
+            return false;
+        }
+
+        *value = parsed * scale;
+        return true;
+    }
+
+    template<>
+    bool Utilities::Ini::IniSection::get<int64_t>(const char *key, int64_t *value) const
+    {
+        return parseInt64(getString(key), value);
+    }
+
+    template<>
+    bool Utilities::Ini::IniSection::get<int>(const char *key, int *value) const
+    {
+        int64_t parsed;
+
+        if (!parseInt64(getString(key), &parsed) || parsed < INT32_MIN || parsed > INT32_MAX) {
+            return false;
+        }
+
+        *value = (int) parsed;
+        return true;
+    }
+
+    /**
+     * The C locale for the numbers in the files, the decimal separator
+     * of the process locale must not leak into them
+     */
+    static locale_t numericLocale()
+    {
+        static const locale_t locale = newlocale(LC_NUMERIC_MASK, "C", (locale_t) 0);
+        return locale;
+    }
+
+    template<>
+    bool Utilities::Ini::IniSection::get<double>(const char *key, double *value) const
+    {
+        const char *string = getString(key);
+
+        if (string == nullptr || *string == 0) {
+            return false;
+        }
+
+        char *end;
+        errno = 0;
+        double parsed = strtod_l(string, &end, numericLocale());
+
+        while (*end == ' ' || *end == '\t') end++;
+
+        if (errno == ERANGE || end == string || *end != 0) {
+            return false;
+        }
+
+        *value = parsed;
+        return true;
+    }
+
+    template<>
+    bool Utilities::Ini::IniSection::get<bool>(const char *key, bool *value) const
+    {
+        const char *string = getString(key);
+
+        if (string == nullptr) {
+            return false;
+        }
+
+        if (strcasecmp(string, "true") == 0 || strcasecmp(string, "yes") == 0
+            || strcasecmp(string, "on") == 0 || strcmp(string, "1") == 0) {
+            *value = true;
+            return true;
+        }
+
+        if (strcasecmp(string, "false") == 0 || strcasecmp(string, "no") == 0
+            || strcasecmp(string, "off") == 0 || strcmp(string, "0") == 0) {
+            *value = false;
+            return true;
+        }
+
+        return false;
+    }
+
+    template<>
+    bool Utilities::Ini::IniSection::get<std::chrono::milliseconds>(const char *key, std::chrono::milliseconds *value) const
+    {
+        int64_t parsed;
+
+        if (!parseDuration(getString(key), 1, &parsed)) {
+            return false;
+        }
+
+        *value = std::chrono::milliseconds(parsed);
+        return true;
+    }
+
+    template<>
+    bool Utilities::Ini::IniSection::get<std::chrono::seconds>(const char *key, std::chrono::seconds *value) const
+    {
+        int64_t parsed;
+
+        if (!parseDuration(getString(key), 1000, &parsed)) {
+            return false;
+        }
+
+        *value = std::chrono::seconds(parsed);
+        return true;
+    }
+
+    template<>
+    void Utilities::Ini::IniSection::set<int64_t>(const char *key, int64_t value)
+    {
+        char buf[24];
+        snprintf(buf, sizeof(buf), "%lld", (long long) value);
+        setString(key, buf);
+    }
+
+    template<>
+    void Utilities::Ini::IniSection::set<int>(const char *key, int value)
+    {
+        set<int64_t>(key, value);
+    }
+
+    template<>
+    void Utilities::Ini::IniSection::set<double>(const char *key, double value)
+    {
+        char buf[32];
+
+        /* only this thread switches, and only for the formatting */
+        locale_t previous = uselocale(numericLocale());
+        snprintf(buf, sizeof(buf), "%.17g", value);
+        uselocale(previous);
+
+        setString(key, buf);
+    }
+
+    template<>
+    void Utilities::Ini::IniSection::set<bool>(const char *key, bool value)
+    {
+        setString(key, value ? "true" : "false");
+    }
+
+    template<>
+    void Utilities::Ini::IniSection::set<std::chrono::milliseconds>(const char *key, std::chrono::milliseconds value)
+    {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%lldms", (long long) value.count());
+        setString(key, buf);
+    }
+
+    template<>
+    void Utilities::Ini::IniSection::set<std::chrono::seconds>(const char *key, std::chrono::seconds value)
+    {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%llds", (long long) value.count());
+        setString(key, buf);
+    }
+
+    const vector<int> Utilities::Ini::IniSection::getIntArray(const char *key) const
+    {
+        vector<int> ints;
+
+        const char *packed = getString(key);
+
+        if (packed != nullptr) {
+
+            if (*packed == 0) {
+                return ints;
+            }
+
+            /* single pass over the value, atoi() semantics for every element */
+            const char *ptr = packed;
+
+            while (true) {
+
+                while (*ptr == ' ') ptr++;
+
+                const bool negative = *ptr == '-';
+                if (*ptr == '-' || *ptr == '+') ptr++;
+
+                unsigned int value = 0;
+                while ((unsigned char) (*ptr - '0') < 10) {
+                    value = value * 10 + (unsigned int) (*ptr - '0');
+                    ptr++;
+                }
+
+                ints.push_back(negative ? (int) (0u - value) : (int) value);
+
+                while (*ptr != ',' && *ptr != 0) ptr++;
+                if (*ptr == 0) break;
+                ptr++;
+
+            }
+
+            return ints;
+
+        }
+
+        char name[sizeof(IniKeypair::key)];
+
+        snprintf(name, sizeof(name), "%s_len", key);
+        const int len = getInt(name);
+
+        for (int i = 0; i < len; i++) {
+            snprintf(name, sizeof(name), "%s_%d", key, i);
+            ints.push_back(getInt(name));
+        }
+
+        return ints;
+
+    }
+
+    void Utilities::Ini::IniSection::removeLegacyArray(const char *key)
+    {
+        char name[sizeof(IniKeypair::key)];
+
+        snprintf(name, sizeof(name), "%s_len", key);
+        const int len = getInt(name);
+
+        if (len == INT32_MIN) return;
+
+        remove(name);
+
+        for (int i = 0; i < len; i++) {
+            snprintf(name, sizeof(name), "%s_%d", key, i);
+            remove(name);
+        }
+    }
+
+    const void Utilities::Ini::IniSection::setIntArray(const char *key, vector<int> *values)
+    {
+
+        char packed[sizeof(IniKeypair::value)];
+        size_t length = 0;
+
+        for (size_t i = 0; i < values->size() && length < sizeof(packed); i++) {
+            length += snprintf(packed + length, sizeof(packed) - length, i == 0 ? "%d" : ",%d", values->at(i));
+        }
+
+        if (values->empty()) {
+            packed[0] = 0;
+        }
+
+        if (length < sizeof(packed)) {
+            removeLegacyArray(key);
+            setString(key, packed);
+            return;
+        }
+
+        /* does not fit into a single value, use the legacy layout */
+        remove(key);
+
+        char name[sizeof(IniKeypair::key)];
+
+        snprintf(name, sizeof(name), "%s_len", key);
+        setInt(name, (int) values->size());
+
+        for (size_t i = 0; i < values->size(); i++) {
+            snprintf(name, sizeof(name), "%s_%zu", key, i);
+            setInt(name, values->at(i));
+        }
+
+    }
+
+    const void Utilities::Ini::IniSection::setStringArray(const char *key, const vector<const char *> *strings)
+    {
+
+        char packed[sizeof(IniKeypair::value)];
+        size_t length = 0;
+
+        for (size_t i = 0; i < strings->size() && length < sizeof(packed); i++) {
+
+            if (i > 0) packed[length++] = ',';
+
+            for (const char *ptr = strings->at(i); *ptr != 0 && length < sizeof(packed); ptr++) {
+                if (*ptr == ',' || *ptr == '\\') {
+                    packed[length++] = '\\';
+                    if (length == sizeof(packed)) break;
+                }
+                packed[length++] = *ptr;
+            }
+
+        }
+
+        /*
+         * An empty value is an empty array, so an array holding a single
+         * empty string is stored in the legacy layout instead
+         */
+        const bool ambiguous = strings->size() == 1 && *strings->at(0) == 0;
+
+        if (length < sizeof(packed) && !ambiguous) {
+            packed[length] = 0;
+            removeLegacyArray(key);
+            setString(key, packed);
+            return;
+        }
+
+        /* does not fit into a single value, use the legacy layout */
+        remove(key);
+        removeLegacyArray(key);
+
+        char name[sizeof(IniKeypair::key)];
+
+        snprintf(name, sizeof(name), "%s_len", key);
+        setInt(name, (int) strings->size());
+
+        for (size_t i = 0; i < strings->size(); i++) {
+            snprintf(name, sizeof(name), "%s_%zu", key, i);
+            setString(name, strings->at(i));
+        }
+
+    }
+
+    const vector<const char *> Utilities::Ini::IniSection::getStringArray(const char *key)
+    {
+
+        vector<const char*> strings;
+
+        const char *packed = getString(key);
+
+        if (packed != nullptr) {
+
+            if (*packed == 0) {
+                return strings;
+            }
+
+            IniStringArray &cached = getIndex()->arrays[key];
+            vector<string> &decoded = cached.strings;
+
+            if (cached.packed != packed) {
+
+                cached.packed = packed;
+                decoded.clear();
+                decoded.push_back(string());
+
+                for (const char *ptr = packed; *ptr != 0; ptr++) {
+
+                    if (*ptr == ',') {
+                        decoded.push_back(string());
+                        continue;
+                    }
+
+                    if (*ptr == '\\' && ptr[1] != 0) {
+                        ptr++;
+                    }
+
+                    decoded.back().push_back(*ptr);
+
+                }
+
+            }
+
+            for (const string &string : decoded) {
+                strings.push_back(string.c_str());
+            }
+
+            return strings;
+
+        }
+
+        char name[sizeof(IniKeypair::key)];
+
+        snprintf(name, sizeof(name), "%s_len", key);
+        const int len = getInt(name);
+
+        for (int i = 0; i < len; i++) {
+            snprintf(name, sizeof(name), "%s_%d", key, i);
+            strings.push_back(getString(name));
+        }
+
+        return strings;
+
+    }
+
+
+    /********************** Utilities::IniSnapshot *******************/
+
+#define INI_SNAPSHOT_MAGIC "TPINISNP"
+#define INI_SNAPSHOT_VERSION 2
+#define INI_SNAPSHOT_BYTE_ORDER 0x01020304
+
+    /*
+     * The snapshot layout, all offsets are from the start of the image:
+     *
+     * header | sections | keypairs | section buckets | keypair buckets | strings
+     *
+     * The buckets are open addressing hash tables holding index + 1
+     * of a section/keypair, 0 marks an empty bucket. Strings are
+     * null terminated and referenced by their offset in the string table.
+     */
+    struct IniSnapshotHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t byteOrder;
+        uint32_t sectionCount;
+        uint32_t keypairCount;
+        uint32_t sectionBuckets;
+        uint32_t keypairBuckets;
+        int64_t sourceSize;
+        int64_t sourceMtimeSec;
+        int64_t sourceMtimeNsec;
+        uint64_t sourceHash;
+        uint64_t stringsOffset;
+        uint64_t stringsSize;
+        uint64_t totalSize;
+    };
+
+    struct IniSnapshotSection {
+        uint32_t name;
+        uint32_t firstKeypair;
+        uint32_t keypairCount;
+        uint32_t padding;
+    };
+
+    struct IniSnapshotKeypair {
+        uint32_t key;
+        uint32_t value;
+        uint32_t section;
+        uint32_t padding;
+    };
+
+    static uint32_t snapshotBuckets(size_t count)
+    {
+        /* power of two, at most half full */
+        uint32_t buckets = 4;
+        while (buckets < count * 2) buckets <<= 1;
+        return buckets;
+    }
+
+    /*
+     * The keypair buckets are hashed by the key and the index of its section,
+     * mixed so the hash of the key alone can be computed once up front
+     */
+    static uint64_t snapshotKeyHash(uint32_t section, uint64_t keyHash)
+    {
+        return keyHash ^ ((uint64_t) (section + 1) * 0x9e3779b97f4a7c15ULL);
+    }
+
+    /* identifies the images of the snapshots for IniKey */
+    static std::atomic<uint64_t> snapshotSerials(0);
+
+    void Utilities::Ini::Ini::buildSnapshot(string &image)
+    {
+
+        IniSnapshotHeader header;
+        memset(&header, 0, sizeof(header));
+
+        memcpy(header.magic, INI_SNAPSHOT_MAGIC, sizeof(header.magic));
+        header.version = INI_SNAPSHOT_VERSION;
+        header.byteOrder = INI_SNAPSHOT_BYTE_ORDER;
+        header.sourceSize = this->sourcePath.empty() ? -1 : this->sourceSize;
+        header.sourceMtimeSec = this->sourceMtimeSec;
+        header.sourceMtimeNsec = this->sourceMtimeNsec;
+        header.sourceHash = fnv1aBytes(this->source.data(), this->source.size());
+
+        vector<IniSnapshotSection> sectionTable;
+        vector<IniSnapshotKeypair> keypairTable;
+        string strings(1, '\0');
+
+        auto intern = [&](const char *string) -> uint32_t {
+            uint32_t offset = (uint32_t) strings.size();
+            strings.append(string, strlen(string) + 1);
+            return offset;
+        };
+
+        for (IniSection *section : *sections) {
+
+            IniSnapshotSection entry = { intern(section->name), (uint32_t) keypairTable.size(),
+                                         (uint32_t) section->keypairs->size(), 0 };
+
+            for (IniKeypair *keypair : *section->keypairs) {
+                IniSnapshotKeypair pair = { intern(keypair->key), intern(keypair->value),
+                                            (uint32_t) sectionTable.size(), 0 };
+                keypairTable.push_back(pair);
+            }
+
+            sectionTable.push_back(entry);
+
+        }
+
+        header.sectionCount = (uint32_t) sectionTable.size();
+        header.keypairCount = (uint32_t) keypairTable.size();
+        header.sectionBuckets = snapshotBuckets(sectionTable.size());
+        header.keypairBuckets = snapshotBuckets(keypairTable.size());
+
+        vector<uint32_t> sectionBuckets(header.sectionBuckets, 0);
+        vector<uint32_t> keypairBuckets(header.keypairBuckets, 0);
+
+        for (uint32_t i = 0; i < header.sectionCount; i++) {
+
+            const char *name = strings.data() + sectionTable[i].name;
+            uint32_t bucket = (uint32_t) fnv1a(name) & (header.sectionBuckets - 1);
+
+            /* the first section with the name wins, like getSection() */
+            while (sectionBuckets[bucket] != 0) {
+                if (strcmp(strings.data() + sectionTable[sectionBuckets[bucket] - 1].name, name) == 0) break;
+                bucket = (bucket + 1) & (header.sectionBuckets - 1);
+            }
+
+            if (sectionBuckets[bucket] == 0) {
+                sectionBuckets[bucket] = i + 1;
+            }
+
+        }
+
+        for (uint32_t i = 0; i < header.keypairCount; i++) {
+
+            const IniSnapshotKeypair &pair = keypairTable[i];
+            const char *key = strings.data() + pair.key;
+            uint32_t bucket = (uint32_t) snapshotKeyHash(pair.section, fnv1a(key)) & (header.keypairBuckets - 1);
+
+            /* the first keypair with the key in a section wins, like getString() */
+            while (keypairBuckets[bucket] != 0) {
+                const IniSnapshotKeypair &other = keypairTable[keypairBuckets[bucket] - 1];
+                if (other.section == pair.section && strcmp(strings.data() + other.key, key) == 0) break;
+                bucket = (bucket + 1) & (header.keypairBuckets - 1);
+            }
+
+            if (keypairBuckets[bucket] == 0) {
+                keypairBuckets[bucket] = i + 1;
+            }
+
+        }
+
+        header.stringsOffset = sizeof(header)
+                               + sectionTable.size() * sizeof(IniSnapshotSection)
+                               + keypairTable.size() * sizeof(IniSnapshotKeypair)
+                               + (sectionBuckets.size() + keypairBuckets.size()) * sizeof(uint32_t);
+        header.stringsSize = strings.size();
+        header.totalSize = header.stringsOffset + header.stringsSize;
+
+        image.clear();
+        image.reserve(header.totalSize);
+        image.append((const char *) &header, sizeof(header));
+        image.append((const char *) sectionTable.data(), sectionTable.size() * sizeof(IniSnapshotSection));
+        image.append((const char *) keypairTable.data(), keypairTable.size() * sizeof(IniSnapshotKeypair));
+        image.append((const char *) sectionBuckets.data(), sectionBuckets.size() * sizeof(uint32_t));
+        image.append((const char *) keypairBuckets.data(), keypairBuckets.size() * sizeof(uint32_t));
+        image.append(strings);
+
+    }
+
+    bool Utilities::Ini::Ini::writeSnapshot(std::string path)
+    {
+
+        string image;
+        buildSnapshot(image);
+
+        /* write a temporary file and rename it, readers never see a partial snapshot */
+        string temporary = path + ".tmp";
+
+        int fd = open(temporary.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+
+        if (fd < 0) {
+            fprintf(stderr, "config: error writing snapshot: %s\n", strerror(errno));
+            return false;
+        }
+
+        if (write(fd, image.data(), image.size()) != (ssize_t) image.size()) {
+            fprintf(stderr, "config: error writing snapshot: %s\n", strerror(errno));
+            close(fd);
+            unlink(temporary.c_str());
+            return false;
+        }
+
+        close(fd);
+
+        if (rename(temporary.c_str(), path.c_str()) < 0) {
+            fprintf(stderr, "config: error renaming snapshot: %s\n", strerror(errno));
+            unlink(temporary.c_str());
+            return false;
+        }
+
+        return true;
+
+    }
+
+    vector<Utilities::Ini::IniSection*>* Utilities::Ini::Ini::readIniCached(std::string path, std::string snapshotPath)
+    {
+
+        IniSnapshot snapshot;
+
+        if (!snapshot.open(snapshotPath, path)) {
+
+            if (readIni(path) == nullptr) {
+                return nullptr;
+            }
+
+            writeSnapshot(snapshotPath);
+            return this->sections;
+
+        }
+
+        thaw(snapshot);
+
+        return this->sections;
+
+    }
+
+    void Utilities::Ini::Ini::thaw(const IniSnapshot &snapshot)
+    {
+        for (size_t i = 0; i < snapshot.getSectionCount(); i++) {
+
+            IniSection *section = new IniSection(snapshot.getSectionName(i));
+
+            const size_t count = snapshot.getKeypairCount(i);
+            section->keypairs->reserve(count);
+
+            for (size_t j = 0; j < count; j++) {
+                section->keypairs->push_back(new IniKeypair(snapshot.getKey(i, j), snapshot.getValue(i, j)));
+            }
+
+            /* not backed by a file, the first saveChanges() writes it whole */
+            section->dirty = true;
+            this->sections->push_back(section);
+
+        }
+    }
+
+    /**
+     * The shared state of the threads parsing a config directory,
+     * every thread takes the next file until there are none left
+     */
+    struct IniDirectoryLoad {
+        vector<string> paths;
+        vector<Utilities::Ini::Ini*> files;
+        vector<Utilities::Ini::IniLoadTiming> timings;
+        std::atomic<size_t> next;
+    };
+
+    static void *loadIniFiles(void *_load)
+    {
+        IniDirectoryLoad *load = (IniDirectoryLoad*) _load;
+
+        for (size_t i = load->next++; i < load->paths.size(); i = load->next++) {
+
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+
+            load->files[i] = new Utilities::Ini::Ini;
+            const bool loaded = load->files[i]->readIni(load->paths[i]) != nullptr;
+
+            clock_gettime(CLOCK_MONOTONIC, &end);
+
+            load->timings[i].path = load->paths[i];
+            load->timings[i].microseconds = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+            load->timings[i].loaded = loaded;
+
+        }
+
+        return NULL;
+    }
+
+    vector<Utilities::Ini::IniSection*>* Utilities::Ini::Ini::readIniDirectory(std::string pattern,
+                                                                             vector<IniLoadTiming> *timings,
+                                                                             int threads)
+    {
+
+        IniDirectoryLoad load;
+        load.next = 0;
+
+        struct stat buf;
+
+        if (stat(pattern.c_str(), &buf) == 0 && S_ISDIR(buf.st_mode)) {
+
+            DIR *dir = opendir(pattern.c_str());
+
+            if (dir == nullptr) {
+                fprintf(stderr, "config: error opening %s: %s\n", pattern.c_str(), strerror(errno));
+                return nullptr;
+            }
+
+            struct dirent *entry;
+
+            while ((entry = readdir(dir)) != nullptr) {
+
+                const size_t length = strlen(entry->d_name);
+
+                if ((length > 4 && strcmp(entry->d_name + length - 4, ".ini") == 0)
+                    || (length > 5 && strcmp(entry->d_name + length - 5, ".conf") == 0)) {
+                    load.paths.push_back(pattern + "/" + entry->d_name);
+                }
+
+            }
+
+            closedir(dir);
+
+            std::sort(load.paths.begin(), load.paths.end());
+
+        } else {
+
+            glob_t matches;
+
+            if (glob(pattern.c_str(), 0, nullptr, &matches) == 0) {
+                for (size_t i = 0; i < matches.gl_pathc; i++) {
+                    load.paths.push_back(matches.gl_pathv[i]);
+                }
+            }
+
+            globfree(&matches);
+
+        }
+
+        if (load.paths.empty()) {
+            return nullptr;
+        }
+
+        load.files.resize(load.paths.size(), nullptr);
+        load.timings.resize(load.paths.size());
+
+        /* the calling thread parses too */
+        vector<pthread_t> workers;
+        const size_t count = std::min((size_t) std::max(threads, 1), load.paths.size());
+
+        for (size_t i = 1; i < count; i++) {
+            pthread_t worker;
+            if (pthread_create(&worker, NULL, loadIniFiles, &load) == 0) {
+                workers.push_back(worker);
+            }
+        }
+
+        loadIniFiles(&load);
+
+        for (pthread_t worker : workers) {
+            pthread_join(worker, NULL);
+        }
+
+        /* merge in path order, later files override earlier ones */
+        for (Ini *file : load.files) {
+
+            for (IniSection *section : *file->sections) {
+
+                IniSection *existing = getSection(section->name);
+
+                if (existing == nullptr) {
+
+                    section->offset = -1;
+                    section->dirty = true;
+                    section->removed.clear();
+
+                    for (IniKeypair *keypair : *section->keypairs) {
+                        keypair->lineOffset = -1;
+                        keypair->valueOffset = -1;
+                        keypair->dirty = true;
+                    }
+
+                    this->sections->push_back(section);
+                    continue;
+
+                }
+
+                /*
+                 * A key set by the later file replaces every keypair with
+                 * that key, and keeps all of its own keypairs with the key
+                 */
+                std::unordered_set<string> replaced;
+
+                for (IniKeypair *keypair : *section->keypairs) {
+                    if (replaced.insert(keypair->key).second) {
+                        existing->remove(keypair->key);
+                    }
+                    existing->append(keypair->key, keypair->value);
+                }
+
+                delete section;
+
+            }
+
+            file->sections->clear();
+            delete file;
+
+        }
+
+        if (timings != nullptr) {
+            timings->swap(load.timings);
+        }
+
+        return this->sections;
+
+    }
+
+    Utilities::Ini::IniSnapshot *Utilities::Ini::Ini::freeze()
+    {
+        IniSnapshot *snapshot = new IniSnapshot;
+
+        buildSnapshot(snapshot->image);
+        snapshot->data = snapshot->image.data();
+        snapshot->size = snapshot->image.size();
+        snapshot->serial = ++snapshotSerials;
+
+        return snapshot;
+    }
+
+    Utilities::Ini::IniSnapshot::~IniSnapshot()
+    {
+        release();
+    }
+
+    void Utilities::Ini::IniSnapshot::release()
+    {
+        if (mapped) {
+            munmap((void *) data, size);
+        }
+
+        image.clear();
+        data = nullptr;
+        size = 0;
+        mapped = false;
+        serial = 0;
+    }
+
+    const char *Utilities::Ini::IniSnapshot::stringAt(uint32_t offset) const
+    {
+        const IniSnapshotHeader *header = (const IniSnapshotHeader *) data;
+
+        /* the string table ends with a null, any offset inside it is a valid string */
+        if (offset >= header->stringsSize) {
+            return nullptr;
+        }
+
+        return data + header->stringsOffset + offset;
+    }
+
+    bool Utilities::Ini::IniSnapshot::validate() const
+    {
+        if (size < sizeof(IniSnapshotHeader)) {
+            return false;
+        }
+
+        const IniSnapshotHeader *header = (const IniSnapshotHeader *) data;
+
+        const uint64_t tables = sizeof(IniSnapshotHeader)
+                                + (uint64_t) header->sectionCount * sizeof(IniSnapshotSection)
+                                + (uint64_t) header->keypairCount * sizeof(IniSnapshotKeypair)
+                                + ((uint64_t) header->sectionBuckets + header->keypairBuckets) * sizeof(uint32_t);
+
+        return memcmp(header->magic, INI_SNAPSHOT_MAGIC, sizeof(header->magic)) == 0
+               && header->version == INI_SNAPSHOT_VERSION
+               && header->byteOrder == INI_SNAPSHOT_BYTE_ORDER
+               && header->totalSize == size
+               && header->stringsOffset == tables
+               && header->stringsSize > 0
+               && header->stringsOffset + header->stringsSize == size
+               && data[size - 1] == 0
+               && header->sectionBuckets != 0 && (header->sectionBuckets & (header->sectionBuckets - 1)) == 0
+               && header->keypairBuckets != 0 && (header->keypairBuckets & (header->keypairBuckets - 1)) == 0
+               && header->sectionBuckets > header->sectionCount
+               && header->keypairBuckets > header->keypairCount;
+    }
+
+    bool Utilities::Ini::IniSnapshot::open(const std::string &path, const std::string &sourcePath, bool verifyHash)
+    {
+
+        release();
+
+        int fd = ::open(path.c_str(), O_RDONLY);
+
+        if (fd < 0) {
+            return false;
+        }
+
+        struct stat buf;
+
+        if (fstat(fd, &buf) < 0 || (size_t) buf.st_size < sizeof(IniSnapshotHeader)) {
+            close(fd);
+            return false;
+        }
+
+        void *map = mmap(nullptr, (size_t) buf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "config: error mapping snapshot: %s\n", strerror(errno));
+            return false;
+        }
+
+        data = (const char *) map;
+        size = (size_t) buf.st_size;
+        mapped = true;
+
+        bool valid = validate();
+
+        if (valid && !sourcePath.empty()) {
+
+            const IniSnapshotHeader *header = (const IniSnapshotHeader *) data;
+            struct stat source;
+
+            valid = stat(sourcePath.c_str(), &source) == 0
+                    && header->sourceSize == source.st_size
+                    && header->sourceMtimeSec == source.st_mtim.tv_sec
+                    && header->sourceMtimeNsec == source.st_mtim.tv_nsec;
+
+            if (valid && verifyHash) {
+                valid = false;
+                int sourceFd = ::open(sourcePath.c_str(), O_RDONLY);
+                if (sourceFd >= 0) {
+                    string contents((size_t) source.st_size, '\0');
+                    valid = read(sourceFd, &contents[0], contents.size()) == (ssize_t) contents.size()
+                            && fnv1aBytes(contents.data(), contents.size()) == header->sourceHash;
+                    close(sourceFd);
+                }
+            }
+
+        }
+
+        if (!valid) {
+            release();
+        } else {
+            serial = ++snapshotSerials;
+        }
+
+        return valid;
+
+    }
+
+    size_t Utilities::Ini::IniSnapshot::getSectionCount() const
+    {
+        return data == nullptr ? 0 : ((const IniSnapshotHeader *) data)->sectionCount;
+    }
+
+    static const IniSnapshotSection *snapshotSection(const char *data, size_t section)
+    {
+        const IniSnapshotHeader *header = (const IniSnapshotHeader *) data;
+
+        if (data == nullptr || section >= header->sectionCount) {
+            return nullptr;
+        }
+
+        return (const IniSnapshotSection *) (data + sizeof(IniSnapshotHeader)) + section;
+    }
+
+    static const IniSnapshotKeypair *snapshotKeypair(const char *data, size_t section, size_t keypair)
+    {
+        const IniSnapshotHeader *header = (const IniSnapshotHeader *) data;
+        const IniSnapshotSection *entry = snapshotSection(data, section);
+
+        if (entry == nullptr || keypair >= entry->keypairCount
+            || (uint64_t) entry->firstKeypair + keypair >= header->keypairCount) {
+            return nullptr;
+        }
+
+        const IniSnapshotKeypair *keypairs = (const IniSnapshotKeypair *)
+                (data + sizeof(IniSnapshotHeader) + header->sectionCount * sizeof(IniSnapshotSection));
+
+        return keypairs + entry->firstKeypair + keypair;
+    }
+
+    const char *Utilities::Ini::IniSnapshot::getSectionName(size_t section) const
+    {
+        const IniSnapshotSection *entry = snapshotSection(data, section);
+        return entry == nullptr ? nullptr : stringAt(entry->name);
+    }
+
+    size_t Utilities::Ini::IniSnapshot::getKeypairCount(size_t section) const
+    {
+        const IniSnapshotSection *entry = snapshotSection(data, section);
+        return entry == nullptr ? 0 : entry->keypairCount;
+    }
+
+    const char *Utilities::Ini::IniSnapshot::getKey(size_t section, size_t keypair) const
+    {
+        const IniSnapshotKeypair *entry = snapshotKeypair(data, section, keypair);
+        return entry == nullptr ? nullptr : stringAt(entry->key);
+    }
+
+    const char *Utilities::Ini::IniSnapshot::getValue(size_t section, size_t keypair) const
+    {
+        const IniSnapshotKeypair *entry = snapshotKeypair(data, section, keypair);
+        return entry == nullptr ? nullptr : stringAt(entry->value);
+    }
+
+    const char *Utilities::Ini::IniSnapshot::getString(const char *section, const char *key) const
+    {
+        if (data == nullptr) {
+            return nullptr;
+        }
+
+        return lookup(fnv1a(section), section, fnv1a(key), key);
+    }
+
+    const char *Utilities::Ini::IniSnapshot::lookup(uint64_t sectionHash, const char *section,
+                                                    uint64_t keyHash, const char *key) const
+    {
+
+        const IniSnapshotHeader *header = (const IniSnapshotHeader *) data;
+
+        const IniSnapshotSection *sections = (const IniSnapshotSection *) (data + sizeof(IniSnapshotHeader));
+        const IniSnapshotKeypair *keypairs = (const IniSnapshotKeypair *) (sections + header->sectionCount);
+        const uint32_t *sectionBuckets = (const uint32_t *) (keypairs + header->keypairCount);
+        const uint32_t *keypairBuckets = sectionBuckets + header->sectionBuckets;
+
+        uint32_t bucket = (uint32_t) sectionHash & (header->sectionBuckets - 1);
+        uint32_t index = 0;
+
+        for (uint32_t probe = 0; probe < header->sectionBuckets; probe++) {
+
+            const uint32_t entry = sectionBuckets[bucket];
+
+            if (entry == 0 || entry > header->sectionCount) {
+                return nullptr;
+            }
+
+            const char *name = stringAt(sections[entry - 1].name);
+
+            if (name != nullptr && strcmp(name, section) == 0) {
+                index = entry;
+                break;
+            }
+
+            bucket = (bucket + 1) & (header->sectionBuckets - 1);
+
+        }
+
+        if (index == 0) {
+            return nullptr;
+        }
+
+        bucket = (uint32_t) snapshotKeyHash(index - 1, keyHash) & (header->keypairBuckets - 1);
+
+        for (uint32_t probe = 0; probe < header->keypairBuckets; probe++) {
+
+            const uint32_t entry = keypairBuckets[bucket];
+
+            if (entry == 0 || entry > header->keypairCount) {
+                return nullptr;
+            }
+
+            const IniSnapshotKeypair &pair = keypairs[entry - 1];
+            const char *name = stringAt(pair.key);
+
+            if (pair.section == index - 1 && name != nullptr && strcmp(name, key) == 0) {
+                return stringAt(pair.value);
+            }
+
+            bucket = (bucket + 1) & (header->keypairBuckets - 1);
+
+        }
+
+        return nullptr;
+    }
+
+
+    /********************** Utilities::IniWatcher *******************/
+
+    /**
+     * A published snapshot and the number of the reload that published it
+     */
+    struct Utilities::Ini::IniVersion {
+        const IniSnapshot *snapshot;
+        uint64_t generation;
+
+        IniVersion(const IniSnapshot *snapshot, uint64_t generation) : snapshot(snapshot), generation(generation) {}
+        ~IniVersion() { delete snapshot; }
+    };
+
+    Utilities::Ini::IniWatcher::IniWatcher(string path)
+        : path(path), published(nullptr), handlers(new vector<IniChangeHandler*>), epoch(0)
+    {
+        readers[0].store(0);
+        readers[1].store(0);
+    }
+
+    Utilities::Ini::IniWatcher::~IniWatcher()
+    {
+        if (listening) {
+            /* wake the listener up, it exits on any data on the pipe */
+            if (write(stopPipe[1], "", 1) < 0) {
+                pthread_cancel(listener);
+            }
+            pthread_join(listener, NULL);
+        }
+
+        if (inotifyFd >= 0) close(inotifyFd);
+        if (stopPipe[0] >= 0) close(stopPipe[0]);
+        if (stopPipe[1] >= 0) close(stopPipe[1]);
+
+        delete published.load();
+        delete handlers;
+    }
+
+    void Utilities::Ini::IniWatcher::addChangeHandler(IniChangeHandler *handler)
+    {
+        handlers->push_back(handler);
+    }
+
+    /*
+     * A reader registers in the counter of the current epoch and checks the
+     * epoch did not move meanwhile, only then it loads the published version.
+     * retire() moves the epoch after the swap and waits for the counter of
+     * the old epoch to drain: every reader that could still see the old
+     * version is counted there, every later one sees the new version.
+     */
+    Utilities::Ini::IniWatcher::Reader::Reader(const IniWatcher *watcher) : watcher(watcher)
+    {
+        while (true) {
+
+            const unsigned current = watcher->epoch.load();
+            slot = current & 1;
+
+            watcher->readers[slot].fetch_add(1);
+
+            if (watcher->epoch.load() == current) {
+                break;
+            }
+
+            watcher->readers[slot].fetch_sub(1);
+
+        }
+
+        const IniVersion *version = watcher->published.load();
+
+        if (version != nullptr) {
+            snapshot = version->snapshot;
+            generation = version->generation;
+        }
+    }
+
+    Utilities::Ini::IniWatcher::Reader::Reader(Reader &&other)
+        : watcher(other.watcher), slot(other.slot), snapshot(other.snapshot), generation(other.generation)
+    {
+        other.watcher = nullptr;
+    }
+
+    Utilities::Ini::IniWatcher::Reader::~Reader()
+    {
+        if (watcher != nullptr) {
+            watcher->readers[slot].fetch_sub(1, std::memory_order_release);
+        }
+    }
+
+    Utilities::Ini::IniWatcher::Reader Utilities::Ini::IniWatcher::current() const
+    {
+        return Reader(this);
+    }
+
+    void Utilities::Ini::IniWatcher::retire(const IniVersion *version)
+    {
+        const unsigned previous = epoch.fetch_add(1);
+
+        while (readers[previous & 1].load(std::memory_order_acquire) != 0) {
+            usleep(100);
+        }
+
+        delete version;
+    }
+
+    /**
+     * Fold every section into a hash of its keypairs, sections
+     * with the same name are folded together
+     */
+    static std::unordered_map<string, uint64_t> sectionDigests(const Utilities::Ini::IniSnapshot *snapshot)
+    {
+        std::unordered_map<string, uint64_t> digests;
+
+        if (snapshot == nullptr) {
+            return digests;
+        }
+
+        for (size_t i = 0; i < snapshot->getSectionCount(); i++) {
+
+            auto it = digests.insert(std::make_pair(string(snapshot->getSectionName(i)), FNV_OFFSET)).first;
+            uint64_t hash = it->second;
+
+            for (size_t j = 0; j < snapshot->getKeypairCount(i); j++) {
+                hash = fnv1aBytes("=", 1, fnv1a(snapshot->getKey(i, j), hash));
+                hash = fnv1aBytes("\n", 1, fnv1a(snapshot->getValue(i, j), hash));
+            }
+
+            it->second = fnv1aBytes("[", 1, hash);
+
+        }
+
+        return digests;
+    }
+
+    bool Utilities::Ini::IniWatcher::reload()
+    {
+        Ini ini;
+
+        if (ini.readIni(path) == nullptr) {
+            return false;
+        }
+
+        const IniSnapshot *next = ini.freeze();
+        const IniVersion *replaced = published.exchange(new IniVersion(next, ++generation));
+
+        /* only this thread deletes versions, so the replaced one is alive until retired */
+        const IniSnapshot *previous = replaced != nullptr ? replaced->snapshot : nullptr;
+
+        std::unordered_map<string, uint64_t> before = sectionDigests(previous);
+        std::unordered_map<string, uint64_t> after = sectionDigests(next);
+
+        vector<IniSectionChange> changes;
+
+        /* report the changes in file order, every section name once */
+        for (size_t i = 0; i < next->getSectionCount(); i++) {
+
+            string name = next->getSectionName(i);
+            auto now = after.find(name);
+
+            if (now == after.end()) continue;
+
+            auto then = before.find(name);
+
+            if (then == before.end()) {
+                changes.push_back({ name, IniSectionChange::ADDED });
+            } else {
+                if (then->second != now->second) {
+                    changes.push_back({ name, IniSectionChange::CHANGED });
+                }
+                before.erase(then);
+            }
+
+            after.erase(now);
+
+        }
+
+        for (size_t i = 0; previous != nullptr && i < previous->getSectionCount(); i++) {
+            string name = previous->getSectionName(i);
+            if (before.erase(name) != 0) {
+                changes.push_back({ name, IniSectionChange::REMOVED });
+            }
+        }
+
+        if (replaced != nullptr) {
+            retire(replaced);
+        }
+
+        if (!changes.empty()) {
+            for (IniChangeHandler *handler : *handlers) {
+                handler->handleChange(changes);
+            }
+        }
+
+        return true;
+    }
+
+    bool Utilities::Ini::IniWatcher::start()
+    {
+        if (listening) {
+            return true;
+        }
+
+        /*
+         * Watch the directory instead of the file, editors and
+         * config management replace the file with a rename. The
+         * watch is set up before the first load so no change is lost.
+         */
+        string directory = ".";
+        size_t slash = path.rfind('/');
+
+        if (slash != string::npos) {
+            directory = slash == 0 ? "/" : path.substr(0, slash);
+        }
+
+        inotifyFd = inotify_init1(IN_CLOEXEC);
+
+        if (inotifyFd < 0 || inotify_add_watch(inotifyFd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+            fprintf(stderr, "config: inotify failed on %s: %s\n", directory.c_str(), strerror(errno));
+            return false;
+        }
+
+        if (!reload()) {
+            return false;
+        }
+
+        if (pipe2(stopPipe, O_CLOEXEC) < 0) {
+            fprintf(stderr, "config: pipe failed: %s\n", strerror(errno));
+            return false;
+        }
+
+        if (pthread_create(&listener, NULL, handle_inotify, this) != 0) {
+            fprintf(stderr, "config: failed to start the watcher\n");
+            return false;
+        }
+
+        listening = true;
+
+        return true;
+    }
+
+    void *Utilities::Ini::IniWatcher::handle_inotify(void *_this)
+    {
+
+        IniWatcher *watcher = (IniWatcher*) _this;
+
+        size_t slash = watcher->path.rfind('/');
+        string name = slash == string::npos ? watcher->path : watcher->path.substr(slash + 1);
+
+        char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+        struct pollfd fds[2];
+
+        fds[0].fd = watcher->inotifyFd;
+        fds[0].events = POLLIN;
+        fds[1].fd = watcher->stopPipe[0];
+        fds[1].events = POLLIN;
+
+        while (true) {
+
+            if (poll(fds, 2, -1) < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+
+            if (fds[1].revents != 0) {
+                break;
+            }
+
+            ssize_t length = read(watcher->inotifyFd, buf, sizeof(buf));
+
+            if (length <= 0) {
+                continue;
+            }
+
+            /* reload once for a whole batch of events */
+            bool changed = false;
+
+            for (char *ptr = buf; ptr < buf + length; ) {
+
+                const struct inotify_event *event = (const struct inotify_event *) ptr;
+
+                if (event->len > 0 && name == event->name) {
+                    changed = true;
+                }
+
+                ptr += sizeof(struct inotify_event) + event->len;
+
+            }
+
+            if (changed) {
+                watcher->reload();
+            }
+
+        }
+
+        return NULL;
+
+    }
+
+    /******************** DeviceRegistry **********************/
+
+    Hardware::SysfsDevice::~SysfsDevice()
+    {
+        if (brightnessFd.load() >= 0) {
+            close(brightnessFd.load());
+        }
+    }
+
+    /*
+     * The registry holds every LED and backlight of the system, most of them
+     * are never touched, so the brightness is only opened when it is used
+     */
+    int Hardware::SysfsDevice::openBrightness() const
+    {
+        int fd = brightnessFd.load(std::memory_order_acquire);
+
+        if (fd >= 0) {
+            return fd;
+        }
+
+        /* the brightness is only writable by root, fall back to read-only */
+        string path = syspath + "/brightness";
+        fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+
+        if (fd < 0) {
+            fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        }
+
+        if (fd < 0) {
+            fprintf(stderr, "%s: %s: invalid open: %s\n", subsystem.c_str(), name.c_str(), strerror(errno));
+            return -1;
+        }
+
+        /* another thread may have opened it meanwhile */
+        int expected = -1;
+
+        if (!brightnessFd.compare_exchange_strong(expected, fd, std::memory_order_acq_rel)) {
+            close(fd);
+            return expected;
+        }
+
+        return fd;
+    }
+
+    const string &Hardware::SysfsDevice::getSubsystem() const
+    {
+        return subsystem;
+    }
+
+    const string &Hardware::SysfsDevice::getName() const
+    {
+        return name;
+    }
+
+    const string &Hardware::SysfsDevice::getSyspath() const
+    {
+        return syspath;
+    }
+
+    const string &Hardware::SysfsDevice::getType() const
+    {
+        return type;
+    }
+
+    int Hardware::SysfsDevice::getMaxBrightness() const
+    {
+        return maxBrightness;
+    }
+
+    int Hardware::SysfsDevice::getBrightness() const
+    {
+        char buf[16];
+        struct timespec started;
+        clock_gettime(CLOCK_MONOTONIC, &started);
+
+        const int fd = openBrightness();
+
+        if (fd < 0) {
+            return -1;
+        }
+
+        /* sysfs regenerates the value on every read from offset 0 */
+        ssize_t len = pread(fd, buf, sizeof(buf) - 1, 0);
+
+        countSysfsRead(started, len > 0);
+
+        if (len <= 0) {
+            return -1;
+        }
+
+        buf[len] = 0;
+
+        return atoi(buf);
+    }
+
+    bool Hardware::SysfsDevice::setBrightness(int value) const
+    {
+        if (maxBrightness > 0) {
+            value = std::min(value, maxBrightness);
+        }
+
+        char buf[16];
+        int len = snprintf(buf, sizeof(buf), "%d", std::max(0, value));
+
+        const int fd = openBrightness();
+
+        if (fd < 0) {
+            return false;
+        }
+
+        if (pwrite(fd, buf, (size_t) len, 0) != len) {
+            fprintf(stderr, "%s: %s: error writing brightness: %s\n", subsystem.c_str(), name.c_str(), strerror(errno));
+            return false;
+        }
+
+        return true;
+    }
+
+    pthread_mutex_t Hardware::DeviceRegistry::lock = PTHREAD_MUTEX_INITIALIZER;
+    bool Hardware::DeviceRegistry::enumerated = false;
+    vector<std::shared_ptr<Hardware::SysfsDevice>> Hardware::DeviceRegistry::devices;
+
+    std::shared_ptr<Hardware::SysfsDevice> Hardware::DeviceRegistry::probeDevice(struct udev_device *device)
+    {
+        const char *subsystem = udev_device_get_subsystem(device);
+        const char *name = udev_device_get_sysname(device);
+        const char *syspath = udev_device_get_syspath(device);
+
+        if (subsystem == NULL || name == NULL || syspath == NULL) {
+            return nullptr;
+        }
+
+        std::shared_ptr<SysfsDevice> entry(new SysfsDevice);
+
+        entry->subsystem = subsystem;
+        entry->name = name;
+        entry->syspath = syspath;
+
+        const char *type = udev_device_get_sysattr_value(device, "type");
+        const char *max = udev_device_get_sysattr_value(device, "max_brightness");
+
+        if (type != NULL && strcmp(subsystem, "backlight") == 0) {
+            entry->type = type;
+        }
+
+        entry->maxBrightness = max != NULL ? atoi(max) : 0;
+
+        return entry;
+    }
+
+    void Hardware::DeviceRegistry::enumerate()
+    {
+        struct udev *udev = udev_new();
+
+        if (udev == NULL) {
+            fprintf(stderr, "devices: udev_new failed\n");
+            return;
+        }
+
+        struct udev_enumerate *enumerate = udev_enumerate_new(udev);
+
+        udev_enumerate_add_match_subsystem(enumerate, "backlight");
+        udev_enumerate_add_match_subsystem(enumerate, "leds");
+        udev_enumerate_scan_devices(enumerate);
+
+        devices.clear();
+
+        struct udev_list_entry *entry;
+
+        udev_list_entry_foreach(entry, udev_enumerate_get_list_entry(enumerate)) {
+
+            struct udev_device *device = udev_device_new_from_syspath(udev, udev_list_entry_get_name(entry));
+
+            if (device == NULL) {
+                continue;
+            }
+
+            std::shared_ptr<SysfsDevice> probed = probeDevice(device);
+
+            if (probed != nullptr) {
+                devices.push_back(probed);
+            }
+
+            udev_device_unref(device);
+
+        }
+
+        udev_enumerate_unref(enumerate);
+        udev_unref(udev);
+
+        enumerated = true;
+    }
+
+    vector<std::shared_ptr<Hardware::SysfsDevice>> Hardware::DeviceRegistry::getDevices(const char *subsystem)
+    {
+        vector<std::shared_ptr<SysfsDevice>> found;
+
+        pthread_mutex_lock(&lock);
+
+        if (!enumerated) {
+            enumerate();
+        }
+
+        for (const std::shared_ptr<SysfsDevice> &device : devices) {
+            if (device->subsystem == subsystem) {
+                found.push_back(device);
+            }
+        }
+
+        pthread_mutex_unlock(&lock);
+
+        return found;
+    }
+
+    std::shared_ptr<Hardware::SysfsDevice> Hardware::DeviceRegistry::getDevice(const char *subsystem, const char *name)
+    {
+        std::shared_ptr<SysfsDevice> found;
+
+        pthread_mutex_lock(&lock);
+
+        if (!enumerated) {
+            enumerate();
+        }
+
+        for (const std::shared_ptr<SysfsDevice> &device : devices) {
+            if (device->subsystem == subsystem && device->name == name) {
+                found = device;
+                break;
+            }
+        }
+
+        pthread_mutex_unlock(&lock);
+
+        return found;
+    }
+
+    void Hardware::DeviceRegistry::refresh()
+    {
+        pthread_mutex_lock(&lock);
+        enumerate();
+        pthread_mutex_unlock(&lock);
+    }
+
+    void Hardware::DeviceRegistry::update(struct udev_device *device)
+    {
+        const char *subsystem = udev_device_get_subsystem(device);
+        const char *action = udev_device_get_action(device);
+        const char *syspath = udev_device_get_syspath(device);
+
+        if (subsystem == NULL || action == NULL || syspath == NULL) {
+            return;
+        }
+
+        if (strcmp(subsystem, "backlight") != 0 && strcmp(subsystem, "leds") != 0) {
+            return;
+        }
+
+        const bool added = strcmp(action, "add") == 0;
+
+        if (!added && strcmp(action, "remove") != 0) {
+            return;
+        }
+
+        /* read the attributes of a new device before taking the lock, sysfs reads can block */
+        std::shared_ptr<SysfsDevice> probed = added ? probeDevice(device) : nullptr;
+
+        pthread_mutex_lock(&lock);
+
+        /* not enumerated yet, the first lookup will see the device */
+        if (enumerated) {
+
+            auto last = std::remove_if(devices.begin(), devices.end(), [syspath](const std::shared_ptr<SysfsDevice> &entry) {
+                return entry->syspath == syspath;
+            });
+
+            devices.erase(last, devices.end());
+
+            if (probed != nullptr) {
+                devices.push_back(probed);
+            }
+
+        }
+
+        pthread_mutex_unlock(&lock);
+    }
+
+    /******************** ThinkLight **********************/
+
+    bool Hardware::ThinkLight::isOn()
+    {
+        const int state = thinkLightState.load();
+
+        if (state >= 0) {
+            return state == 1;
+        }
+
+        bool on;
+        return readThinkLight(&on) && on;
+    }
+
+    bool Hardware::ThinkLight::probe()
+    {
+        return DeviceRegistry::getDevice("leds", THINKLIGHT_LED) != nullptr;
+    }
+
+    bool Hardware::ThinkLight::setOn(bool on)
+    {
+        Led light(THINKLIGHT_LED);
+
+        if (!light.set(on)) {
+            return false;
+        }
+
+        /* writes do not come back as uevents, keep the tracked state in sync */
+        int state = thinkLightState.load();
+        while (state >= 0 && !thinkLightState.compare_exchange_weak(state, on ? 1 : 0));
+
+        return true;
+    }
+
+    /******************** Led **********************/
+
+    static void addMilliseconds(struct timespec *time, std::chrono::milliseconds duration)
     {
-        if (sections == nullptr) return;
+        const long long ms = (long long) duration.count();
 
-        for (IniSection* section : *sections) {
-            delete section;
+        time->tv_sec += (time_t) (ms / 1000);
+        time->tv_nsec += (long) (ms % 1000) * 1000000L;
+
+        if (time->tv_nsec >= 1000000000L) {
+            time->tv_sec++;
+            time->tv_nsec -= 1000000000L;
         }
+    }
 
-        delete sections;
+    static bool isBefore(const struct timespec &a, const struct timespec &b)
+    {
+        return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
     }
 
-    vector<Utilities::Ini::IniSection*>* Utilities::Ini::Ini::readIni(std::string path)
+    struct LedPlayback {
+        Hardware::Led *led;
+        vector<Hardware::LedStep> pattern;
+        size_t step;
+        int repeat;
+        struct timespec deadline;
+    };
+
+    /**
+     * The timer thread playing the patterns of all the LEDs. It sleeps until
+     * the earliest step is due and then applies every step that is due at once.
+     */
+    struct Hardware::LedEngine {
+
+        static pthread_mutex_t lock;
+        static pthread_cond_t wake;
+        static bool running;
+        static vector<LedPlayback> playbacks;
+
+        static void *run(void*);
+        static bool advance(LedPlayback &playback, const struct timespec &now);
+        static bool start();
+
+    };
+
+    pthread_mutex_t Hardware::LedEngine::lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_cond_t Hardware::LedEngine::wake;
+    bool Hardware::LedEngine::running = false;
+    vector<LedPlayback> Hardware::LedEngine::playbacks;
+
+    bool Hardware::LedEngine::start()
     {
-        int fd = open(path.c_str(), O_RDONLY);
+        if (running) {
+            return true;
+        }
+
+        /* deadlines are on the monotonic clock, wall clock changes must not stall the patterns */
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&wake, &attr);
+        pthread_condattr_destroy(&attr);
+
+        pthread_t thread;
+
+        const int error = pthread_create(&thread, NULL, run, NULL);
+
+        if (error != 0) {
+            fprintf(stderr, "led: failed to start the pattern thread: %s\n", strerror(error));
+            pthread_cond_destroy(&wake);
+            return false;
+        }
+
+        pthread_detach(thread);
+        running = true;
+
+        return true;
+    }
+
+    /**
+     * Apply the next step of a playback that is due
+     * @return false if the playback is finished
+     */
+    bool Hardware::LedEngine::advance(LedPlayback &playback, const struct timespec &now)
+    {
+        if (playback.step == playback.pattern.size()) {
+
+            if (playback.repeat > 0 && --playback.repeat == 0) {
+                playback.led->write(false);
+                return false;
+            }
+
+            playback.step = 0;
+        }
+
+        const LedStep &step = playback.pattern[playback.step++];
+
+        playback.led->write(step.on);
+
+        /* keep the rhythm, unless the thread fell behind by more than a step */
+        addMilliseconds(&playback.deadline, step.duration);
+
+        if (isBefore(playback.deadline, now)) {
+            playback.deadline = now;
+            addMilliseconds(&playback.deadline, step.duration);
+        }
+
+        return true;
+    }
+
+    void *Hardware::LedEngine::run(void*)
+    {
+        pthread_mutex_lock(&lock);
+
+        for (;;) {
+
+            if (playbacks.empty()) {
+                pthread_cond_wait(&wake, &lock);
+                continue;
+            }
+
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+
+            struct timespec earliest = playbacks[0].deadline;
+
+            for (const LedPlayback &playback : playbacks) {
+                if (isBefore(playback.deadline, earliest)) {
+                    earliest = playback.deadline;
+                }
+            }
+
+            if (isBefore(now, earliest)) {
+                pthread_cond_timedwait(&wake, &lock, &earliest);
+                continue;
+            }
+
+            for (auto it = playbacks.begin(); it != playbacks.end(); ) {
+
+                if (isBefore(now, it->deadline) || advance(*it, now)) {
+                    ++it;
+                } else {
+                    it = playbacks.erase(it);
+                }
+
+            }
+
+        }
+
+        return NULL;
+    }
+
+    Hardware::Led::Led(string name) : name(name)
+    {
+
+    }
+
+    Hardware::Led::~Led()
+    {
+        /* only the playbacks of this instance, another one may still be playing on the device */
+        pthread_mutex_lock(&LedEngine::lock);
+
+        auto last = std::remove_if(LedEngine::playbacks.begin(), LedEngine::playbacks.end(), [this](const LedPlayback &playback) {
+            return playback.led == this;
+        });
+
+        LedEngine::playbacks.erase(last, LedEngine::playbacks.end());
+
+        pthread_mutex_unlock(&LedEngine::lock);
+
+        if (triggered) {
+            setAttribute("trigger", "none");
+        }
+    }
+
+    bool Hardware::Led::probe()
+    {
+        if (device != nullptr) {
+            return true;
+        }
+
+        device = DeviceRegistry::getDevice("leds", name.c_str());
+
+        if (device == nullptr) {
+            fprintf(stderr, "led: %s: no such device\n", name.c_str());
+            return false;
+        }
+
+        return true;
+    }
+
+    bool Hardware::Led::write(bool on)
+    {
+        return device->setBrightness(on ? device->getMaxBrightness() : 0);
+    }
+
+    bool Hardware::Led::setAttribute(const char *attribute, const char *value)
+    {
+        string path = device->getSyspath() + "/" + attribute;
+
+        int fd = open(path.c_str(), O_WRONLY);
 
         if (fd < 0) {
-            fprintf(stderr, "config: error opening: %s: %s", path.c_str(), strerror(errno));
-            return nullptr;
+            return false;
         }
 
-        struct stat buf;
+        const size_t len = strlen(value);
+        const bool written = ::write(fd, value, len) == (ssize_t) len;
 
-        if (fstat(fd, &buf) < 0) {
-            fprintf(stderr, "config: fstat failed: %s\n", strerror(errno));
-            close(fd);
-            return nullptr;
+        close(fd);
+
+        return written;
+    }
+
+    /**
+     * Drop the pattern of the LED, whether it is played by the timer
+     * thread or by the kernel, and whichever instance started it
+     * @return true if a pattern was playing
+     */
+    bool Hardware::Led::cancel()
+    {
+        bool playing = false;
+
+        pthread_mutex_lock(&LedEngine::lock);
+
+        auto last = std::remove_if(LedEngine::playbacks.begin(), LedEngine::playbacks.end(), [this](const LedPlayback &playback) {
+            return playback.led->name == name;
+        });
+
+        playing = last != LedEngine::playbacks.end();
+        LedEngine::playbacks.erase(last, LedEngine::playbacks.end());
+
+        pthread_mutex_unlock(&LedEngine::lock);
+
+        if (triggered) {
+            setAttribute("trigger", "none");
+            triggered = false;
+            playing = true;
+        }
+
+        return playing;
+    }
+
+    bool Hardware::Led::set(bool on)
+    {
+        if (!probe()) {
+            return false;
         }
 
+        cancel();
 
-        char file[buf.st_size];
+        /* a trigger set by another instance or by the system would override the brightness */
+        setAttribute("trigger", "none");
 
-        if (read(fd, file,  buf.st_size) != buf.st_size) {
-            fprintf(stderr, "config: read failed: %s\n", strerror(errno));
-            close(fd);
-            return nullptr;
+        return write(on);
+    }
+
+    bool Hardware::Led::blink(std::chrono::milliseconds on, std::chrono::milliseconds off)
+    {
+        if (!probe()) {
+            return false;
+        }
+
+        cancel();
+
+        char delay[32];
+
+        /* the delay_on and delay_off attributes only show up once the trigger is set */
+        if (setAttribute("trigger", "timer")) {
+
+            triggered = true;
+
+            snprintf(delay, sizeof(delay), "%lld", (long long) on.count());
+            bool delays = setAttribute("delay_on", delay);
+
+            snprintf(delay, sizeof(delay), "%lld", (long long) off.count());
+            delays = delays && setAttribute("delay_off", delay);
+
+            if (delays) {
+                return true;
+            }
+
+            cancel();
+        }
+
+        vector<LedStep> pattern;
+        pattern.push_back({ true, on });
+        pattern.push_back({ false, off });
+
+        return play(pattern, -1);
+    }
+
+    bool Hardware::Led::play(const vector<LedStep> &pattern, int repeat)
+    {
+        if (!probe()) {
+            return false;
+        }
+
+        cancel();
+
+        std::chrono::milliseconds length(0);
+
+        for (const LedStep &step : pattern) {
+            length += step.duration;
+        }
+
+        if (repeat == 0 || pattern.empty() || (repeat < 0 && length.count() <= 0)) {
+            fprintf(stderr, "led: %s: refusing an empty pattern\n", name.c_str());
+            return false;
+        }
+
+        LedPlayback playback;
+
+        playback.led = this;
+        playback.pattern = pattern;
+        playback.step = 0;
+        playback.repeat = repeat;
+        clock_gettime(CLOCK_MONOTONIC, &playback.deadline);
+
+        pthread_mutex_lock(&LedEngine::lock);
+
+        if (!LedEngine::start()) {
+            pthread_mutex_unlock(&LedEngine::lock);
+            return false;
+        }
+
+        LedEngine::playbacks.push_back(playback);
+        pthread_cond_signal(&LedEngine::wake);
+
+        pthread_mutex_unlock(&LedEngine::lock);
+
+        return true;
+    }
+
+    void Hardware::Led::stop()
+    {
+        cancel();
+
+        if (device != nullptr) {
+            write(false);
+        }
+    }
+
+    /**
+     * The backlights to drive: the raw ones (intel_backlight, nv_backlight)
+     * like before, the firmware and platform ones only if there is nothing else
+     */
+    static vector<std::shared_ptr<Hardware::SysfsDevice>> getBacklights()
+    {
+        vector<std::shared_ptr<Hardware::SysfsDevice>> devices = Hardware::DeviceRegistry::getDevices("backlight");
+        vector<std::shared_ptr<Hardware::SysfsDevice>> raw;
+
+        for (const std::shared_ptr<Hardware::SysfsDevice> &device : devices) {
+            if (device->getType() == "raw") {
+                raw.push_back(device);
+            }
+        }
+
+        return raw.empty() ? devices : raw;
+    }
+
+    void Hardware::Backlight::setBacklightLevel(float factor) {
+
+        for (const std::shared_ptr<SysfsDevice> &device : getBacklights()) {
+            float max = (float) device->getMaxBrightness();
+            device->setBrightness((int) (max * factor));
+        }
+
+    }
+
+    float Hardware::Backlight::getBacklightLevel() {
+
+        vector<std::shared_ptr<SysfsDevice>> devices = getBacklights();
+
+        if (devices.empty()) {
+            fprintf(stderr, "backlight: no backlight device\n");
+            return -1;
+        }
+
+        float max = (float) devices[0]->getMaxBrightness();
+        float current = (float) devices[0]->getBrightness();
+
+        if (max <= 0 || current < 0) {
+            fprintf(stderr, "backlight: error reading backlight\n");
+            return -1;
+        }
+
+        return current / max;
+
+    }
+
+    /******************** Battery **********************/
+
+    struct BatteryField {
+        const char *key;
+        size_t offset;
+        bool isInt;
+    };
+
+#define BATTERY_FIELD(key, member, isInt) { key, offsetof(Hardware::BatteryState, member), isInt }
+
+    static const BatteryField BATTERY_FIELDS[] = {
+            BATTERY_FIELD("CAPACITY", capacity, true),
+            BATTERY_FIELD("ENERGY_NOW", energyNow, false),
+            BATTERY_FIELD("ENERGY_FULL", energyFull, false),
+            BATTERY_FIELD("ENERGY_FULL_DESIGN", energyFullDesign, false),
+            BATTERY_FIELD("CHARGE_NOW", chargeNow, false),
+            BATTERY_FIELD("CHARGE_FULL", chargeFull, false),
+            BATTERY_FIELD("POWER_NOW", powerNow, false),
+            BATTERY_FIELD("CURRENT_NOW", currentNow, false),
+            BATTERY_FIELD("VOLTAGE_NOW", voltageNow, false),
+    };
+
+    static int readThreshold(int fd)
+    {
+        char buf[16];
+
+        if (fd < 0) {
+            return -1;
+        }
+
+        ssize_t len = pread(fd, buf, sizeof(buf) - 1, 0);
+
+        if (len <= 0) {
+            return -1;
+        }
+
+        buf[len] = 0;
+
+        return atoi(buf);
+    }
+
+    static int openThreshold(const string &path)
+    {
+        int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+
+        if (fd < 0) {
+            fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        }
+
+        return fd;
+    }
+
+    static bool writeThreshold(const string &battery, int fd, const char *attribute, int value,
+                               vector<Hardware::ThresholdWrite> *planned)
+    {
+        if (planned != nullptr) {
+            planned->push_back(Hardware::ThresholdWrite{battery, attribute, value});
+            return true;
+        }
+
+        char buf[16];
+        int len = snprintf(buf, sizeof(buf), "%d", value);
+
+        if (pwrite(fd, buf, (size_t) len, 0) != len) {
+            fprintf(stderr, "battery: %s: failed to write %s: %s\n", battery.c_str(), attribute, strerror(errno));
+            return false;
+        }
+
+        return true;
+    }
+
+    Hardware::Battery::Battery(string name) : name(name)
+    {
+
+    }
+
+    Hardware::Battery::~Battery()
+    {
+        if (ueventFd >= 0) close(ueventFd);
+        if (startThresholdFd >= 0) close(startThresholdFd);
+        if (stopThresholdFd >= 0) close(stopThresholdFd);
+    }
+
+    const string &Hardware::Battery::getName() const
+    {
+        return name;
+    }
+
+    bool Hardware::Battery::probe()
+    {
+        if (ueventFd >= 0) {
+            return true;
+        }
+
+        const string path = powerSupplyRoot + "/" + name + "/";
+
+        ueventFd = open((path + "uevent").c_str(), O_RDONLY | O_CLOEXEC);
+
+        if (ueventFd < 0) {
+            fprintf(stderr, "battery: %s: invalid open: %s\n", name.c_str(), strerror(errno));
+            return false;
+        }
+
+        /*
+         * The thresholds are only there with thinkpad_acpi on newer kernels
+         * and only root can write them, fall back to read-only
+         */
+        startThresholdFd = openThreshold(path + "charge_control_start_threshold");
+        stopThresholdFd = openThreshold(path + "charge_control_end_threshold");
+
+        return true;
+    }
+
+    bool Hardware::Battery::read(BatteryState *state)
+    {
+        if (!probe()) {
+            return false;
+        }
+
+        char buf[2048];
+        struct timespec started;
+        clock_gettime(CLOCK_MONOTONIC, &started);
+
+        /* sysfs regenerates the whole uevent on every read from offset 0 */
+        ssize_t len = pread(ueventFd, buf, sizeof(buf) - 1, 0);
+
+        countSysfsRead(started, len > 0);
+
+        if (len <= 0) {
+            fprintf(stderr, "battery: %s: failed read: %s\n", name.c_str(), strerror(errno));
+            return false;
+        }
+
+        /* strtol stops at the terminator on a last line without a newline */
+        buf[len] = 0;
+
+        memset(state, 0, sizeof(BatteryState));
+
+        for (const BatteryField &field : BATTERY_FIELDS) {
+            if (field.isInt) {
+                *(int *) ((char *) state + field.offset) = -1;
+            } else {
+                *(long *) ((char *) state + field.offset) = -1;
+            }
         }
 
-        close(fd);
+        const char *end = buf + len;
+
+        for (const char *line = buf; line < end; ) {
+
+            const char *newline = scanAny(line, end, "\n");
+            const char *lineEnd = newline != nullptr ? newline : end;
+            const char *equals = scanAny(line, lineEnd, "=");
 
-        for(int i = 0; i < sizeof(file); i++) {
+            static const size_t PREFIX = sizeof("POWER_SUPPLY_") - 1;
 
-            continue_outer:
+            if (equals != nullptr && (size_t) (equals - line) > PREFIX && strncmp(line, "POWER_SUPPLY_", PREFIX) == 0) {
 
-            /* skip leading whitespaces */
-            while (file[i] == '\n') {
-                i++;
-                if (i >= sizeof(file))
-                    goto break_outer;
-            }
+                const char *key = line + PREFIX;
+                const size_t keyLength = (size_t) (equals - key);
+                const char *value = equals + 1;
+                const size_t valueLength = (size_t) (lineEnd - value);
 
-            if (file[i] != '[') {
-                printf("config: unexpected token: %c\n", file[i]);
-                break;
-            }
+                if (keyLength == 7 && strncmp(key, "PRESENT", 7) == 0) {
+                    state->present = valueLength > 0 && value[0] == '1';
+                } else if (keyLength == 6 && strncmp(key, "STATUS", 6) == 0) {
+                    const size_t copy = std::min(valueLength, sizeof(state->status) - 1);
+                    memcpy(state->status, value, copy);
+                    state->status[copy] = 0;
+                } else {
 
-            /* skip '[' */
-            i++;
-            if (i >= sizeof(file)) {
-                printf("config: unexpected EOF\n");
-                goto break_outer;
-            }
+                    for (const BatteryField &field : BATTERY_FIELDS) {
 
-            IniSection *section = new IniSection;
-            section->keypairs = new vector<IniKeypair*>;
+                        if (strlen(field.key) != keyLength || strncmp(field.key, key, keyLength) != 0) {
+                            continue;
+                        }
 
-            char *ptr = section->name;
+                        const long number = strtol(value, NULL, 10);
+
+                        if (field.isInt) {
+                            *(int *) ((char *) state + field.offset) = (int) number;
+                        } else {
+                            *(long *) ((char *) state + field.offset) = number;
+                        }
+
+                        break;
+                    }
 
-            while (file[i] != ']') {
-                *ptr = file[i];
-                ptr++;
-                i++;
-                if (i >= sizeof(file)) {
-                    printf("config: unclosed ]\n");
-                    goto break_outer;
                 }
-            }
 
-            /* skip ']' */
-            i++;
-            if (i >= sizeof(file)) {
-                printf("config: unexpected EOF\n");
-                goto break_outer;
             }
 
-            while (true) {
+            line = lineEnd + 1;
+        }
 
-                /* skip leading whitespaces */
-                while (file[i] == '\n') {
-                    i++;
-                    if (i >= sizeof(file)) {
-                        this->sections->push_back(section);
-                        goto break_outer;
-                    }
-                }
+        state->startThreshold = readThreshold(startThresholdFd);
+        state->stopThreshold = readThreshold(stopThresholdFd);
 
-                /* a new section is there */
-                if (file[i] == '[') {
-                    this->sections->push_back(section);
-                    if (i >= sizeof(file))
-                        goto break_outer;
-                    goto continue_outer;
-                }
+        return true;
+    }
 
-                IniKeypair* keypair = new IniKeypair;
-                ptr = keypair->key;
+    vector<string> Hardware::Battery::getBatteries()
+    {
+        vector<string> batteries;
 
-                while (file[i] != '=') {
-                    *ptr = file[i];
-                    ptr++;
-                    i++;
-                    if (i >= sizeof(file)) {
-                        printf("config: unexpected EOF, expected '='\n");
-                        goto break_outer;
-                    }
-                }
+        DIR *dir = opendir(powerSupplyRoot.c_str());
 
-                /* skip '=' */
-                i++;
-                if (i >= sizeof(file)) {
-                    printf("config: unexpected EOF, expected '='\n");
-                    goto break_outer;
-                }
+        if (dir == NULL) {
+            fprintf(stderr, "battery: failed to list %s: %s\n", powerSupplyRoot.c_str(), strerror(errno));
+            return batteries;
+        }
 
-                ptr = keypair->value;
+        struct dirent *entry;
+        char type[16];
 
-                while (file[i] != '\n') {
-                    *ptr = file[i];
-                    ptr++;
-                    i++;
-                    if (i >= sizeof(file)) {
-                        printf("config: unexpected EOF\n");
-                        goto break_outer;
-                    }
-                }
+        while ((entry = readdir(dir)) != NULL) {
 
-                section->keypairs->push_back(keypair);
+            if (entry->d_name[0] == '.') continue;
 
+            if (readSupplyAttribute(entry->d_name, "type", type, sizeof(type)) > 0 && strcmp(type, "Battery") == 0) {
+                batteries.push_back(entry->d_name);
             }
 
         }
 
-        break_outer:
-        return this->sections;
+        closedir(dir);
 
-    }
+        std::sort(batteries.begin(), batteries.end());
 
-#define ASSERT_WRITE(write) if (write < 0) { printf("write failed: %s\n", strerror(errno)); return false; }
+        return batteries;
+    }
 
-    bool Utilities::Ini::Ini::writeIni(std::string path)
+    bool Hardware::Battery::isACOnline()
     {
+        const int state = acState.load();
+
+        if (state >= 0) {
+            return state == 1;
+        }
 
-        int fd = open(path.c_str(), O_CREAT | O_RDWR, 0644);
+        return readACOnline();
+    }
 
-        if (fd < 0) {
-            printf("config: error writing config file: %s\n", strerror(errno));
+    bool Hardware::Battery::setThresholds(int start, int stop, vector<ThresholdWrite> *planned)
+    {
+        if (start < 0 || stop > 100 || start >= stop) {
+            fprintf(stderr, "battery: %s: invalid thresholds %d-%d\n", name.c_str(), start, stop);
             return false;
         }
 
-        if (truncate(path.c_str(), 0) < 0) {
-            printf("config: truncate failed of old file: %s\n",strerror(errno));
+        if (!probe()) {
             return false;
         }
 
-        for (IniSection *section : *sections) {
+        const int currentStart = readThreshold(startThresholdFd);
+        const int currentStop = readThreshold(stopThresholdFd);
+
+        if (currentStart < 0 || currentStop < 0) {
+            fprintf(stderr, "battery: %s: charge thresholds are not supported\n", name.c_str());
+            return false;
+        }
 
-            /* write the section name */
-            ASSERT_WRITE(write(fd, "[", 1));
-            ASSERT_WRITE(write(fd, section->name, strlen(section->name)));
-            ASSERT_WRITE(write(fd, "]\n", 2));
+        /*
+         * The kernel rejects a start threshold at or above the current end
+         * threshold, move the end threshold first when going up past it
+         */
+        const bool stopFirst = start >= currentStop;
 
-            for (IniKeypair* keypair : *section->keypairs) {
+        for (int i = 0; i < 2; i++) {
 
-                ASSERT_WRITE(write(fd, keypair->key, strlen(keypair->key)));
-                ASSERT_WRITE(write(fd, "=", 1));
-                ASSERT_WRITE(write(fd, keypair->value, strlen(keypair->value)));
-                ASSERT_WRITE(write(fd, "\n", 1));
+            const bool writeStop = (i == 0) == stopFirst;
+            const int value = writeStop ? stop : start;
 
+            if (value == (writeStop ? currentStop : currentStart)) {
+                continue;
             }
 
-            ASSERT_WRITE(write(fd, "\n", 1));
+            if (!writeThreshold(name, writeStop ? stopThresholdFd : startThresholdFd,
+                                writeStop ? "charge_control_end_threshold" : "charge_control_start_threshold",
+                                value, planned)) {
+                return false;
+            }
 
         }
 
-        close(fd);
-
         return true;
-
     }
 
-    vector<Utilities::Ini::IniSection *> Utilities::Ini::Ini::getSections(const char *sectionName)
+    bool Hardware::Battery::setAllThresholds(int start, int stop, vector<ThresholdWrite> *planned)
     {
+        if (start < 0 || stop > 100 || start >= stop) {
+            fprintf(stderr, "battery: invalid thresholds %d-%d\n", start, stop);
+            return false;
+        }
 
-        vector<IniSection*> ret;
+        vector<string> names = getBatteries();
+        vector<std::unique_ptr<Battery>> batteries;
+        vector<std::pair<int, int>> previous;
 
-        if (sections == nullptr)
-            return ret;
+        /* check every battery before touching any of them */
+        for (const string &name : names) {
 
+            std::unique_ptr<Battery> battery(new Battery(name));
 
-        for (IniSection *section : *this->sections) {
-            if (strcmp(section->name, sectionName) == 0) {
-                ret.push_back(section);
+            if (!battery->probe()) {
+                return false;
+            }
+
+            const int currentStart = readThreshold(battery->startThresholdFd);
+            const int currentStop = readThreshold(battery->stopThresholdFd);
+
+            if (currentStart < 0 || currentStop < 0) {
+                fprintf(stderr, "battery: %s: charge thresholds are not supported\n", name.c_str());
+                return false;
             }
+
+            previous.push_back(std::make_pair(currentStart, currentStop));
+            batteries.push_back(std::move(battery));
+
         }
 
-        return ret;
+        if (batteries.empty()) {
+            fprintf(stderr, "battery: no batteries\n");
+            return false;
+        }
 
-    }
+        for (size_t i = 0; i < batteries.size(); i++) {
 
-    Utilities::Ini::IniSection *Utilities::Ini::Ini::getSection(const char *section)
-    {
-        for (IniSection* local : *sections) {
-            if (strcmp(local->name, section) == 0) {
-                return local;
+            if (batteries[i]->setThresholds(start, stop, planned)) {
+                continue;
             }
+
+            /* best effort, put back what was already changed */
+            for (size_t j = 0; j <= i; j++) {
+                batteries[j]->setThresholds(previous[j].first, previous[j].second, planned);
+            }
+
+            return false;
         }
 
-        return nullptr;
+        return true;
     }
 
-    void Utilities::Ini::Ini::addSection(IniSection *section)
+    void Hardware::Battery::setSysfsRoot(const string &root)
     {
-        this->sections->push_back(section);
+        powerSupplyRoot = root;
     }
 
-    Utilities::Ini::IniKeypair::IniKeypair(const char *key, const char *value)
-    {
-        memset(this->key, 0, sizeof(this->key));
-        memset(this->value, 0, sizeof(this->value));
+    /******************** Thermal **********************/
 
-        strcpy(this->key, key);
-        strcpy(this->value, value);
-    }
+    struct ThermalSlot {
+        std::atomic<uint64_t> sequence;
+        Hardware::ThermalSample sample;
+    };
 
-    Utilities::Ini::IniKeypair::IniKeypair()
-    {
-        memset(this->key, 0, sizeof(this->key));
-        memset(this->value, 0, sizeof(this->value));
-    }
+    /**
+     * Single writer ring of samples. A slot holds UINT64_MAX while it is
+     * being written and the sequence number of its sample afterwards.
+     */
+    struct Hardware::ThermalRing {
+        size_t mask;
+        std::atomic<uint64_t> head;
+        ThermalSlot *slots;
+    };
 
-    Utilities::Ini::IniSection::~IniSection()
+    Hardware::Thermal::Thermal(size_t capacity) : ring(new ThermalRing), interval(1000)
     {
-        for (IniKeypair *keypair : *keypairs) {
-            delete keypair;
+        size_t size = 1;
+
+        while (size < capacity) {
+            size <<= 1;
         }
 
-        delete keypairs;
-    }
+        ring->mask = size - 1;
+        ring->head.store(0);
+        ring->slots = new ThermalSlot[size];
 
-    Utilities::Ini::IniSection::IniSection()
-    {
-        memset(this->name, 0, sizeof(this->name));
-    }
+        for (size_t i = 0; i < size; i++) {
+            ring->slots[i].sequence.store(UINT64_MAX);
+        }
 
-    Utilities::Ini::IniSection::IniSection(const char *name)
-    {
-        memset(this->name, 0, sizeof(this->name));
-        strcpy(this->name, name);
-        this->keypairs = new vector<IniKeypair*>;
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&wake, &attr);
+        pthread_condattr_destroy(&attr);
     }
 
-    const char *Utilities::Ini::IniSection::getString(const char *key) const
+    Hardware::Thermal::~Thermal()
     {
-        for (IniKeypair* keypair : *keypairs) {
-            if (strcmp(keypair->key, key) == 0) {
-                return keypair->value;
-            }
+        stop();
+
+        for (int fd : temperatureFds) {
+            close(fd);
         }
 
-        return nullptr;
-    }
+        if (fanFd >= 0) {
+            close(fanFd);
+        }
 
-    const void Utilities::Ini::IniSection::setString(const char *key, const char *value)
-    {
-        IniKeypair *keypair = new IniKeypair(key, value);
-        this->keypairs->push_back(keypair);
+        pthread_cond_destroy(&wake);
+
+        delete[] ring->slots;
+        delete ring;
     }
 
-    const int Utilities::Ini::IniSection::getInt(const char *key) const
+    bool Hardware::Thermal::probe()
     {
-        const char *string = getString(key);
+        if (!temperatureFds.empty()) {
+            return true;
+        }
 
-        if (string == nullptr) {
-            return INT32_MIN;
+        DIR *dir = opendir(SYSFS_HWMON);
+
+        if (dir == NULL) {
+            fprintf(stderr, "thermal: failed to list %s: %s\n", SYSFS_HWMON, strerror(errno));
+            return false;
         }
 
-        return atoi(string);
-    }
+        vector<string> hwmons;
+        struct dirent *entry;
 
-    const void Utilities::Ini::IniSection::setInt(const char *key, const int value)
-    {
-        ostringstream stream;
-        stream << value;
-        setString(key, stream.str().c_str());
-    }
+        while ((entry = readdir(dir)) != NULL) {
+            if (entry->d_name[0] != '.') {
+                hwmons.push_back(SYSFS_HWMON + string(entry->d_name) + "/");
+            }
+        }
 
-    const vector<int> Utilities::Ini::IniSection::getIntArray(const char *key) const
-    {
-        string lenStr = string(key);
-        lenStr.append("_len");
+        closedir(dir);
 
-        const int len = getInt(lenStr.c_str());
+        /* keep the sensor indexes stable between runs */
+        std::sort(hwmons.begin(), hwmons.end());
 
-        vector<int> ints;
+        for (const string &hwmon : hwmons) {
 
-        for (int i = 0; i < len; i++) {
+            DIR *sensors = opendir(hwmon.c_str());
 
-            ostringstream stream;
+            if (sensors == NULL) {
+                continue;
+            }
 
-            stream << key;
-            stream << "_";
-            stream << i;
+            vector<string> inputs;
 
-            string test = stream.str();
+            while ((entry = readdir(sensors)) != NULL) {
 
-            const int num = getInt(test.c_str());
+                const char *name = entry->d_name;
+                const size_t length = strlen(name);
 
-            ints.push_back(num);
+                if (strncmp(name, "temp", 4) == 0 && length > 6 && strcmp(name + length - 6, "_input") == 0) {
+                    inputs.push_back(hwmon + name);
+                }
 
-        }
+            }
 
-        return ints;
+            closedir(sensors);
+            std::sort(inputs.begin(), inputs.end());
 
-    }
+            for (const string &input : inputs) {
 
-    const void Utilities::Ini::IniSection::setIntArray(const char *key, vector<int> *values)
-    {
+                if (temperatureFds.size() == THERMAL_MAX_SENSORS) {
+                    break;
+                }
 
-        ostringstream stream;
-        stream << key;
-        stream << "_len";
+                int fd = open(input.c_str(), O_RDONLY | O_CLOEXEC);
 
-        setInt(stream.str().c_str(), (int) values->size());
+                if (fd >= 0) {
+                    temperatureFds.push_back(fd);
+                }
 
-        for (int i = 0; i < values->size(); i++) {
-            stream = ostringstream();
-            stream << key;
-            stream << "_";
-            stream << i;
-            setInt(stream.str().c_str(), values->at(i));
-        }
+            }
 
-    }
+            /* the thinkpad_acpi hwmon also has the fan, cheaper than /proc/acpi/ibm/fan */
+            if (fanFd < 0) {
 
-    const void Utilities::Ini::IniSection::setStringArray(const char *key, const vector<const char *> *strings)
-    {
+                char name[32];
+                int fd = open((hwmon + "name").c_str(), O_RDONLY | O_CLOEXEC);
+                ssize_t length = fd >= 0 ? read(fd, name, sizeof(name) - 1) : -1;
+
+                if (fd >= 0) {
+                    close(fd);
+                }
 
-        ostringstream stream;
-        stream << key;
-        stream << "_len";
+                if (length > 0 && strncmp(name, "thinkpad", 8) == 0) {
+                    fanFd = open((hwmon + "fan1_input").c_str(), O_RDONLY | O_CLOEXEC);
+                }
+
+            }
 
-        setInt(stream.str().c_str(), (int) strings->size());
+        }
 
-        for (int i = 0; i < strings->size(); i++) {
-            stream = ostringstream();
-            stream << key;
-            stream << "_";
-            stream << i;
-            setString(stream.str().c_str(), strings->at(i));
+        if (temperatureFds.empty()) {
+            fprintf(stderr, "thermal: no temperature sensors\n");
+            return false;
         }
 
+        return true;
     }
 
-    const vector<const char *> Utilities::Ini::IniSection::getStringArray(const char *key)
+    static int readSensor(int fd)
     {
+        char buf[16];
+        struct timespec started;
+        clock_gettime(CLOCK_MONOTONIC, &started);
 
-        vector<const char*> strings;
+        ssize_t len = pread(fd, buf, sizeof(buf) - 1, 0);
 
-        ostringstream stream;
-        stream << key;
-        stream << "_len";
+        countSysfsRead(started, len > 0);
 
-        const int len = getInt(stream.str().c_str());
+        if (len <= 0) {
+            return -1;
+        }
 
-        for (int i = 0; i < len; i++) {
+        buf[len] = 0;
+
+        return atoi(buf);
+    }
 
-            stream = ostringstream();
-            stream << key;
-            stream << "_";
-            stream << i;
+    void Hardware::Thermal::sample(ThermalSample *sample)
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
 
-            const char *string = getString(stream.str().c_str());
-            strings.push_back(string);
+        sample->timestamp = (int64_t) now.tv_sec * 1000000000LL + now.tv_nsec;
+        sample->sensorCount = (int) temperatureFds.size();
 
+        for (size_t i = 0; i < temperatureFds.size(); i++) {
+            sample->temperatures[i] = readSensor(temperatureFds[i]);
         }
 
-        return strings;
-
+        sample->fanSpeed = fanFd >= 0 ? readSensor(fanFd) : -1;
     }
 
-
-    /******************** ThinkLight **********************/
-
-    bool Hardware::ThinkLight::isOn()
+    void *Hardware::Thermal::handle_sampling(void *_this)
     {
-        int fd = open(SYSFS_THINKLIGHT, O_RDONLY);
-        if (fd < 0) {
-            printf("thinklight: invalid open: %s\n", strerror(errno));
-            return false;
-        }
+        Thermal *thermal = (Thermal*) _this;
+        ThermalRing *ring = thermal->ring;
 
-        char buf[1];
+        struct timespec next;
+        clock_gettime(CLOCK_MONOTONIC, &next);
 
-        if (read(fd, buf, 1) != 1) {
-            printf("thinklight: failed read: %s\n", strerror(errno));
-            close(fd);
-            return false;
-        }
+        pthread_mutex_lock(&thermal->lock);
 
-        close(fd);
+        while (thermal->sampling) {
 
-        return *buf != '0';
+            pthread_mutex_unlock(&thermal->lock);
 
-    }
+            const uint64_t sequence = ring->head.load(std::memory_order_relaxed);
+            ThermalSlot &slot = ring->slots[sequence & ring->mask];
 
-    bool Hardware::ThinkLight::probe()
-    {
-        int fd = open(SYSFS_THINKLIGHT, O_RDONLY);
-        if (fd < 0) {
-            close(fd);
-            return false;
-        }
-        return true;
-    }
+            /* readers that see the marker or a newer sequence know the sample is gone */
+            slot.sequence.store(UINT64_MAX, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
 
-    void Hardware::Backlight::setBacklightLevel(float factor) {
+            thermal->sample(&slot.sample);
 
-        bool intel = access(SYSFS_BACKLIGHT_INTEL, F_OK) == 0;
-        bool nvidia = access(SYSFS_BACKLIGHT_NVIDIA, F_OK) == 0;
+            slot.sequence.store(sequence, std::memory_order_release);
+            ring->head.store(sequence + 1, std::memory_order_release);
 
-        if (intel) {
-            float max = (float) getMaxBrightness(Backlight::System::INTEL);
-            float setf = max * factor;
-            setBrightness(Backlight::System::INTEL, (int) setf);
-        }
+            int hottest = -1;
 
-        if (nvidia) {
-            float max = (float) getMaxBrightness(Backlight::System::NVIDIA);
-            float setf = max * factor;
-            setBrightness(Backlight::System::NVIDIA, (int) setf);
-        }
+            for (int i = 0; i < slot.sample.sensorCount; i++) {
+                hottest = std::max(hottest, slot.sample.temperatures[i]);
+            }
 
-    }
+            /* the threshold and the handlers may change while sampling, decide under the lock */
+            PowerManagement::ACPIEvent event = PowerManagement::ACPIEvent::UNKNOWN;
+            vector<PowerManagement::ACPIEventHandler*> handlers;
 
-    float Hardware::Backlight::getBacklightLevel() {
+            pthread_mutex_lock(&thermal->lock);
 
-         // First try the Intel backlight system
+            if (thermal->highThreshold >= 0) {
 
-        bool intel = access(SYSFS_BACKLIGHT_INTEL, F_OK) == 0;
-        bool nvidia = access(SYSFS_BACKLIGHT_NVIDIA, F_OK) == 0;
+                if (!thermal->hot && hottest >= thermal->highThreshold) {
+                    thermal->hot = true;
+                    event = PowerManagement::ACPIEvent::THERMAL_HIGH;
+                } else if (thermal->hot && hottest >= 0 && hottest < thermal->highThreshold - thermal->hysteresis) {
+                    thermal->hot = false;
+                    event = PowerManagement::ACPIEvent::THERMAL_NORMAL;
+                }
 
-        if (intel) {
-            float max = (float) getMaxBrightness(Backlight::System::INTEL);
-            float current = (float) getCurrentBrightness(Backlight::System::INTEL);
-            return current / max;
-        }
+            }
 
-        if (nvidia) {
-            float max = (float) getMaxBrightness(Backlight::System::NVIDIA);
-            float current = (float) getCurrentBrightness(Backlight::System::NVIDIA);
-            return current / max;
-        }
+            if (event != PowerManagement::ACPIEvent::UNKNOWN) {
+                handlers = thermal->handlers;
+            }
 
-    }
+            pthread_mutex_unlock(&thermal->lock);
 
-    void Hardware::Backlight::setBrightness(System system, int value) {
+            if (event != PowerManagement::ACPIEvent::UNKNOWN) {
+                dispatchEvent(handlers, event);
+            }
 
-        int fd = -1;
+            pthread_mutex_lock(&thermal->lock);
 
-        switch (system) {
-            case Backlight::System ::NVIDIA:
-                fd = open(SYSFS_BACKLIGHT_NVIDIA"/brightness", O_WRONLY);
-                break;
-            case Backlight::System ::INTEL:
-                fd = open(SYSFS_BACKLIGHT_INTEL"/brightness", O_WRONLY);
-                break;
-        }
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
 
-        if (fd < 0) {
-            fprintf(stderr, "brightnes: error opening file for writing: %s\n", strerror(errno));
-            return;
-        }
+            /* keep the rate, unless a sample took longer than the interval */
+            addMilliseconds(&next, thermal->interval);
 
-        /**
-         * The logarithm of a number with base 10 returns the
-         * rough number of digits, we add +1 for the number of
-         * digits, +1 for the null terminator safety
-         *
-         * we also need to check if the value is 0; log(0) is not defined
-         */
-        size_t strlen = value == 0 ? 2 : (size_t) log10f(value) + 2;
+            if (isBefore(next, now)) {
+                next = now;
+                addMilliseconds(&next, thermal->interval);
+            }
 
-        char buf[strlen];
-        memset(buf, 0, strlen);
-        snprintf(buf, strlen, "%d", value);
+            while (thermal->sampling && pthread_cond_timedwait(&thermal->wake, &thermal->lock, &next) != ETIMEDOUT);
 
-        if (write(fd, buf, strlen) < 0) {
-            fprintf(stderr, "brightnes: error writing to file: %s\n", strerror(errno));
         }
 
-        close(fd);
+        pthread_mutex_unlock(&thermal->lock);
 
+        return NULL;
     }
 
-    int Hardware::Backlight::getMaxBrightness(Hardware::Backlight::System system) {
-
-        int maxBrightness = -1;
+    void Hardware::Thermal::addEventHandler(PowerManagement::ACPIEventHandler *handler)
+    {
+        pthread_mutex_lock(&lock);
+        this->handlers.push_back(handler);
+        pthread_mutex_unlock(&lock);
+    }
 
-        switch (system) {
-            case Backlight::System::INTEL: {
-                const char *data = fileRead(SYSFS_BACKLIGHT_INTEL"/max_brightness");
-                maxBrightness = atoi(data);
-                free((void *) data);
-                break;
-            }
-            case Backlight::System::NVIDIA: {
-                const char *data = fileRead(SYSFS_BACKLIGHT_INTEL"/max_brightness");
-                maxBrightness = atoi(data);
-                free((void *) data);
-                break;
-            }
-        }
+    void Hardware::Thermal::setThreshold(int high, int hysteresis)
+    {
+        pthread_mutex_lock(&lock);
+        this->highThreshold = high;
+        this->hysteresis = hysteresis;
+        this->hot = false;
+        pthread_mutex_unlock(&lock);
+    }
 
-        if (maxBrightness < 0) {
-            fprintf(stderr, "backlight: error reading backlight\n");
+    bool Hardware::Thermal::start(std::chrono::milliseconds interval)
+    {
+        if (interval.count() <= 0 || !probe()) {
+            return false;
         }
 
-        return maxBrightness;
+        pthread_mutex_lock(&lock);
 
-    }
+        if (sampling) {
+            pthread_mutex_unlock(&lock);
+            return false;
+        }
 
-    int Hardware::Backlight::getCurrentBrightness(Hardware::Backlight::System system) {
+        this->interval = interval;
+        sampling = true;
 
-        int brightness = -1;
+        const int error = pthread_create(&sampler, NULL, handle_sampling, this);
 
-        switch (system) {
-            case Backlight::System::INTEL: {
-                const char *data = fileRead(SYSFS_BACKLIGHT_INTEL"/brightness");
-                brightness = atoi(data);
-                free((void *) data);
-                break;
-            }
-            case Backlight::System::NVIDIA: {
-                const char *data = fileRead(SYSFS_BACKLIGHT_INTEL"/brightness");
-                brightness = atoi(data);
-                free((void *) data);
-                break;
-            }
+        if (error != 0) {
+            fprintf(stderr, "thermal: failed to start the sampling thread: %s\n", strerror(error));
+            sampling = false;
         }
 
-        if (brightness < 0) {
-            fprintf(stderr, "backlight: error reading backlight\n");
-        }
+        const bool started = sampling;
 
-        return brightness;
+        pthread_mutex_unlock(&lock);
 
+        return started;
     }
 
-    const char *Hardware::Backlight::fileRead(const char *path) {
-
-        int fd = open(path, O_RDONLY);
+    void Hardware::Thermal::stop()
+    {
+        pthread_mutex_lock(&lock);
 
-        if (fd < 0) {
-            fprintf(stderr, "backlight: error opening max_brightness file: %s\n", strerror(errno));
-            return NULL;
+        if (!sampling) {
+            pthread_mutex_unlock(&lock);
+            return;
         }
 
-        struct stat filestat;
+        sampling = false;
+        pthread_cond_signal(&wake);
 
-        if (fstat(fd, &filestat) < 0) {
-            fprintf(stderr, "backlight: error reading max_brightness filestats: %s\n", strerror(errno));
-            close(fd);
-            return NULL;
-        }
+        pthread_mutex_unlock(&lock);
+
+        pthread_join(sampler, NULL);
+    }
 
-        char *buf = (char*) calloc(sizeof(char), (size_t) filestat.st_size);
+    uint64_t Hardware::Thermal::getSequence() const
+    {
+        return ring->head.load(std::memory_order_acquire);
+    }
 
-        if (read(fd, buf, (size_t) filestat.st_size) < 0) {
-            fprintf(stderr, "backlight: error reading max_brightness: %s\n", strerror(errno));
+    const Hardware::ThermalSample *Hardware::Thermal::peek(uint64_t sequence) const
+    {
+        if (sequence >= ring->head.load(std::memory_order_acquire)) {
+            return nullptr;
         }
 
-        close(fd);
+        const ThermalSlot &slot = ring->slots[sequence & ring->mask];
 
-        return buf;
+        if (slot.sequence.load(std::memory_order_acquire) != sequence) {
+            return nullptr;
+        }
 
+        return &slot.sample;
     }
 
+    bool Hardware::Thermal::isValid(uint64_t sequence) const
+    {
+        std::atomic_thread_fence(std::memory_order_acquire);
 
-}
+        return ring->slots[sequence & ring->mask].sequence.load(std::memory_order_relaxed) == sequence;
+    }
 
+    size_t Hardware::Thermal::getSensorCount() const
+    {
+        return temperatureFds.size();
+    }
 
+}
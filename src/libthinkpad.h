@@ -27,12 +27,17 @@
 #ifndef LIBTHINKDOCK_LIBRARY_H
 #define LIBTHINKDOCK_LIBRARY_H
 
-#define LIBTHINKPAD_MAJOR 2
-#define LIBTHINKPAD_MINOR 4
+#define LIBTHINKPAD_MAJOR 3
+#define LIBTHINKPAD_MINOR 0
 
 #include <string>
 #include <vector>
 #include <cstdio>
+#include <cstdint>
+#include <chrono>
+#include <memory>
+#include <atomic>
+#include <pthread.h>
 
 #define IBM_DOCK "/sys/devices/platform/dock.2"
 #define IBM_DOCK_DOCKED     "/sys/devices/platform/dock.2/docked"
@@ -65,14 +70,30 @@
 
 #define ACPID_SOCK "/var/run/acpid.socket"
 
+#define DEV_INPUT "/dev/input/"
+#define EVDEV_THINKPAD_BUTTONS "ThinkPad Extra Buttons"
+#define EVDEV_AT_KEYBOARD "AT Translated Set 2 keyboard"
+#define EVDEV_LID_SWITCH "Lid Switch"
+#define EVDEV_POWER_BUTTON "Power Button"
+#define EVDEV_BATCH 64
+
+#define THINKPAD_UDEV_TAG "libthinkpad"
+
 #define SYSFS_THINKLIGHT "/sys/class/leds/tpacpi::thinklight/brightness"
+#define SYSFS_THINKLIGHT_HW_CHANGED "/sys/class/leds/tpacpi::thinklight/brightness_hw_changed"
+#define THINKLIGHT_LED "tpacpi::thinklight"
 #define SYSFS_MACHINECHECK "/sys/devices/system/machinecheck/machinecheck"
 
+#define SYSFS_POWER_SUPPLY "/sys/class/power_supply/"
+#define SYSFS_HWMON "/sys/class/hwmon/"
+
+#define THERMAL_MAX_SENSORS 16
+
 #define SYSFS_BACKLIGHT_NVIDIA "/sys/class/backlight/nv_backlight"
 #define SYSFS_BACKLIGHT_INTEL "/sys/class/backlight/intel_backlight"
 
 #define BUFSIZE 128
-#define INBUFSZ 1
+#define INBUFSZ 4096
 
 using std::string;
 using std::vector;
@@ -80,11 +101,17 @@ using std::vector;
 typedef int SUSPEND_REASON;
 typedef int STATUS;
 
+struct udev_device;
+
 /**
  * @brief The main libthinkpad interface. This contains all the libthinkpad features.
  */
 namespace ThinkPad {
 
+    namespace PowerManagement {
+        class ACPIEventHandler;
+    }
+
     /**
      * @brief This namespace handles ThinkPad hardware, such as docks, lights and batteries.
      */
@@ -93,11 +120,29 @@ namespace ThinkPad {
         /**
          * @brief The Dock class is used to probe for the dock
          * validity and probe for basic information about the dock.
+         *
+         * The dock stations (/sys/devices/platform/dock.N) are enumerated
+         * once, on the first use.
          */
         class Dock {
+        private:
+
+            string syspath;
 
         public:
 
+            /**
+             * @brief use the first dock station of the machine, an IBM
+             * UltraDock/UltraBase if there is one
+             */
+            Dock();
+
+            /**
+             * @brief use a specific dock station
+             * @param syspath the sysfs path of the dock, as returned by getDocks()
+             */
+            Dock(const string &syspath);
+
             /**
              * @brief Check if the ThinkPad is physically docked
              * into the UltraDock or the UltraBase
@@ -106,14 +151,142 @@ namespace ThinkPad {
             bool isDocked();
 
             /**
-             * @brief Probes the dock if it is an IBM dock and if the
+             * @brief Probes the dock if it is a dock station and if the
              * dock is sane and ready for detection/state changes
              * @return true if the dock is sane and valid
              */
             bool probe();
 
+            /**
+             * @return the sysfs path of the dock, empty if the machine has no dock
+             */
+            const string &getSyspath() const;
+
+            /**
+             * @brief get all the dock stations of the machine
+             * @return the sysfs paths of the docks, the IBM ones first
+             */
+            static vector<string> getDocks();
+
+        };
+
+
+        /**
+         * @brief A LED or backlight device in sysfs, with its brightness file
+         * kept open. Handles stay usable after the device is gone from the
+         * DeviceRegistry, the reads and writes then simply fail.
+         */
+        class SysfsDevice {
+        private:
+
+            friend class DeviceRegistry;
+
+            string subsystem;
+            string name;
+            string syspath;
+            string type;
+
+            /* opened on the first read or write of the brightness */
+            mutable std::atomic<int> brightnessFd;
+            int maxBrightness = 0;
+
+            int openBrightness() const;
+
+            SysfsDevice() : brightnessFd(-1) {}
+
+        public:
+
+            SysfsDevice(const SysfsDevice&) = delete;
+            SysfsDevice &operator=(const SysfsDevice&) = delete;
+
+            ~SysfsDevice();
+
+            /**
+             * @return the subsystem of the device, "backlight" or "leds"
+             */
+            const string &getSubsystem() const;
+
+            /**
+             * @return the name of the device, e.g. "intel_backlight" or "tpacpi::thinklight"
+             */
+            const string &getName() const;
+
+            /**
+             * @return the sysfs path of the device
+             */
+            const string &getSyspath() const;
+
+            /**
+             * @return the type of a backlight ("raw", "platform" or "firmware"), empty for LEDs
+             */
+            const string &getType() const;
+
+            /**
+             * @return the maximum brightness of the device
+             */
+            int getMaxBrightness() const;
+
+            /**
+             * @return the current brightness of the device, or -1 on error
+             */
+            int getBrightness() const;
+
+            /**
+             * @brief set the brightness of the device
+             * @param value the brightness, 0 - getMaxBrightness()
+             * @return true if the brightness was written
+             */
+            bool setBrightness(int value) const;
+
         };
 
+        /**
+         * @brief The DeviceRegistry enumerates the LED and backlight devices
+         * through udev once, on the first use, and hands out handles to them.
+         *
+         * While an ACPI listener is running, the registry follows the udev add and
+         * remove events, otherwise call refresh() to pick up hotplugged devices.
+         * All the methods are thread safe.
+         */
+        class DeviceRegistry {
+        private:
+
+            static pthread_mutex_t lock;
+            static bool enumerated;
+            static vector<std::shared_ptr<SysfsDevice>> devices;
+
+            static std::shared_ptr<SysfsDevice> probeDevice(struct udev_device *device);
+            static void enumerate();
+
+        public:
+
+            /**
+             * @brief get all the devices of a subsystem
+             * @param subsystem "backlight" or "leds"
+             * @return the devices, in enumeration order
+             */
+            static vector<std::shared_ptr<SysfsDevice>> getDevices(const char *subsystem);
+
+            /**
+             * @brief get a device by its name
+             * @param subsystem "backlight" or "leds"
+             * @param name the name of the device
+             * @return the device or nullptr
+             */
+            static std::shared_ptr<SysfsDevice> getDevice(const char *subsystem, const char *name);
+
+            /**
+             * @brief enumerate the devices again
+             */
+            static void refresh();
+
+            /**
+             * @brief apply an udev event to the registry, called by the ACPI udev listener
+             * @param device the device of the event
+             */
+            static void update(struct udev_device *device);
+
+        };
 
         /**
          * @brief The ThinkLight class is ued to probe for the ThinkLight state
@@ -122,7 +295,12 @@ namespace ThinkPad {
         class ThinkLight {
         public:
             /**
-             * @brief check if the ThinkLight is currently on
+             * @brief check if the ThinkLight is currently on.
+             *
+             * While an ACPI listener is running, the state is tracked from
+             * the udev and sysfs notifications and this does not touch sysfs.
+             * Changes are delivered as THINKLIGHT_ON and THINKLIGHT_OFF events.
+             *
              * @return true if the ThinkLight is on
              */
             bool isOn();
@@ -133,39 +311,383 @@ namespace ThinkPad {
              */
             bool probe();
 
+            /**
+             * @brief switch the ThinkLight on or off
+             * @param on true to switch the light on
+             * @return true if the light was set
+             */
+            bool setOn(bool on);
+
         };
-        
+
+        struct LedEngine;
+
         /**
-         * @brief The backlight class is used to control the backlight
-         * level on the integrated laptop screen
+         * @brief a single step of a LED pattern
          */
-        class Backlight {
+        struct LedStep {
+            bool on;
+            std::chrono::milliseconds duration;
+        };
+
+        /**
+         * @brief The Led class controls a LED in /sys/class/leds, such as the
+         * ThinkLight or the other tpacpi:: LEDs, and plays blink patterns on it.
+         *
+         * The patterns of all the LEDs are played from a single timer thread.
+         * An endless blink is handed to the kernel timer trigger when the LED
+         * supports it, so no thread has to wake up for it at all.
+         */
+        class Led {
         private:
 
-            enum System {
-                NVIDIA, INTEL
-            };
+            friend struct LedEngine;
+
+            string name;
+            std::shared_ptr<SysfsDevice> device;
+            bool triggered = false;
+
+            bool write(bool on);
+            bool setAttribute(const char *attribute, const char *value);
+            bool cancel();
+
+        public:
+
+            /**
+             * @brief construct a LED controller
+             * @param name the name of the LED in /sys/class/leds, e.g. "tpacpi::thinklight"
+             */
+            Led(string name);
+
+            Led(const Led&) = delete;
+            Led &operator=(const Led&) = delete;
+
+            /**
+             * @brief stops the pattern started through this instance, the LED is left as it is
+             */
+            ~Led();
+
+            /**
+             * @brief look the LED up in the DeviceRegistry
+             * @return true if the LED exists
+             */
+            bool probe();
+
+            /**
+             * @brief stop any pattern and switch the LED on or off
+             * @param on true to switch the LED on
+             * @return true if the LED was set
+             */
+            bool set(bool on);
+
+            /**
+             * @brief blink the LED until stop() is called
+             * @param on how long the LED stays on
+             * @param off how long the LED stays off
+             * @return true if the blinking was started
+             */
+            bool blink(std::chrono::milliseconds on, std::chrono::milliseconds off);
+
+            /**
+             * @brief play a pattern on the LED, replacing the current one. The LED
+             * is switched off when the pattern is finished.
+             * @param pattern the steps of the pattern
+             * @param repeat how many times to play the pattern, -1 to play it until stop()
+             * @return true if the pattern was started
+             */
+            bool play(const vector<LedStep> &pattern, int repeat = 1);
 
-            int getMaxBrightness(System system);
-            int getCurrentBrightness(System system);
-            void setBrightness(System system, int value);
-            const char *fileRead(const char *path);
+            /**
+             * @brief stop the pattern of the LED and switch it off
+             */
+            void stop();
 
+        };
+        
+        /**
+         * @brief The backlight class is used to control the backlight
+         * level on the integrated laptop screen
+         */
+        class Backlight {
         public:
 
             /**
-             * @brief Set the backlight to the specified factor of illumination
+             * @brief Set the backlight to the specified factor of illumination.
+             * All the raw backlight devices (intel_backlight, nv_backlight, ...)
+             * are set, or the firmware and platform ones if there are no raw devices.
              * @param factor the factor to set (0.0 - 1.0)
              */
             void setBacklightLevel(float factor);
 
             /**
              * @brief Get the current value of the illumination factor
-             * @return the current brightness factor
+             * of the first backlight device that setBacklightLevel() sets
+             * @return the current brightness factor, or -1 if there is no backlight
              */
             float getBacklightLevel();
         };
 
+        /**
+         * @brief A sample of the state of a battery. The values are in the
+         * units of the power_supply class, µWh, µAh, µW, µA and µV, and are
+         * -1 if the battery does not report them.
+         */
+        struct BatteryState {
+            bool present;
+            char status[16];
+            int capacity;
+            long energyNow;
+            long energyFull;
+            long energyFullDesign;
+            long chargeNow;
+            long chargeFull;
+            long powerNow;
+            long currentNow;
+            long voltageNow;
+            int startThreshold;
+            int stopThreshold;
+        };
+
+        /**
+         * @brief A charge threshold write planned by a dry run of
+         * Battery::setThresholds() or Battery::setAllThresholds()
+         */
+        struct ThresholdWrite {
+            string battery;
+            string attribute;
+            int value;
+        };
+
+        /**
+         * @brief The Battery class reads the state of a battery from
+         * /sys/class/power_supply.
+         *
+         * The files are opened once by probe(), a sample is a single read of
+         * the uevent file plus one read per charge threshold. While an ACPI
+         * listener is running, changes are delivered as BATTERY_CHANGED,
+         * AC_CONNECTED and AC_DISCONNECTED events, so there is no need to poll.
+         */
+        class Battery {
+        private:
+
+            string name;
+            int ueventFd = -1;
+            int startThresholdFd = -1;
+            int stopThresholdFd = -1;
+
+        public:
+
+            /**
+             * @brief construct a battery reader
+             * @param name the name of the battery in /sys/class/power_supply
+             */
+            Battery(string name = "BAT0");
+
+            Battery(const Battery&) = delete;
+            Battery &operator=(const Battery&) = delete;
+
+            ~Battery();
+
+            /**
+             * @brief probe the battery and open its files
+             * @return true if the battery exists
+             */
+            bool probe();
+
+            /**
+             * @brief sample the state of the battery
+             * @param state where to store the state
+             * @return true if the state was read
+             */
+            bool read(BatteryState *state);
+
+            /**
+             * @return the name of the battery
+             */
+            const string &getName() const;
+
+            /**
+             * @brief get the batteries of the machine
+             * @return the names of the batteries
+             */
+            static vector<string> getBatteries();
+
+            /**
+             * @brief check if the machine runs on AC power. While an ACPI listener
+             * is running, the state is tracked from the udev events.
+             * @return true if any mains power supply is online
+             */
+            static bool isACOnline();
+
+            /**
+             * @brief set the charge thresholds of the battery. The thresholds are
+             * written in the order that keeps start below end at every step.
+             * @param start the charge level to start charging at, in percent
+             * @param stop the charge level to stop charging at, in percent
+             * @param planned if not null, nothing is written and the writes that
+             * would be made are appended to it in order
+             * @return true if the thresholds were set, or would be set in a dry run
+             */
+            bool setThresholds(int start, int stop, vector<ThresholdWrite> *planned = nullptr);
+
+            /**
+             * @brief set the charge thresholds of all the batteries at once. The
+             * values are checked against every battery first, and the batteries
+             * already changed are restored if a write fails.
+             * @param start the charge level to start charging at, in percent
+             * @param stop the charge level to stop charging at, in percent
+             * @param planned if not null, nothing is written and the writes that
+             * would be made are appended to it in order
+             * @return true if the thresholds of all the batteries were set
+             */
+            static bool setAllThresholds(int start, int stop, vector<ThresholdWrite> *planned = nullptr);
+
+            /**
+             * @brief read the power supplies from another directory than
+             * /sys/class/power_supply, e.g. a fake sysfs tree for testing.
+             * Set it before creating any Battery.
+             * @param root the directory with the power supplies
+             */
+            static void setSysfsRoot(const string &root);
+        };
+
+        /**
+         * @brief A sample of the temperatures and the fan speed
+         */
+        struct ThermalSample {
+
+            /**
+             * @brief the CLOCK_MONOTONIC time of the sample, in nanoseconds
+             */
+            int64_t timestamp;
+
+            /**
+             * @brief the temperatures in millidegrees Celsius, -1 if a sensor failed
+             */
+            int temperatures[THERMAL_MAX_SENSORS];
+            int sensorCount;
+
+            /**
+             * @brief the fan speed in RPM, -1 if there is no fan sensor
+             */
+            int fanSpeed;
+        };
+
+        struct ThermalRing;
+
+        /**
+         * @brief The Thermal class samples the hwmon temperature sensors and the
+         * ThinkPad fan speed on a timer thread.
+         *
+         * The samples are kept in a fixed-size ring buffer. The sampling thread is
+         * the only writer, readers on any thread look at the samples in place and
+         * check afterwards that the sample was not overwritten in the meantime:
+         *
+         * @code
+         * const ThermalSample *sample = thermal.peek(sequence);
+         * int temperature = sample != nullptr ? sample->temperatures[0] : -1;
+         * if (!thermal.isValid(sequence)) { ... overwritten, read a newer one ... }
+         * @endcode
+         *
+         * When the hottest sensor crosses the threshold, THERMAL_HIGH is dispatched
+         * to the handlers, and THERMAL_NORMAL once it cooled down by the hysteresis.
+         */
+        class Thermal {
+        private:
+
+            static void *handle_sampling(void*);
+
+            vector<int> temperatureFds;
+            int fanFd = -1;
+
+            ThermalRing *ring;
+
+            vector<PowerManagement::ACPIEventHandler*> handlers;
+            int highThreshold = -1;
+            int hysteresis = 0;
+            bool hot = false;
+
+            std::chrono::milliseconds interval;
+            pthread_t sampler;
+            pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+            pthread_cond_t wake;
+            bool sampling = false;
+
+            void sample(ThermalSample *sample);
+
+        public:
+
+            /**
+             * @brief construct a sampler
+             * @param capacity how many samples to keep, rounded up to a power of two
+             */
+            Thermal(size_t capacity = 256);
+
+            Thermal(const Thermal&) = delete;
+            Thermal &operator=(const Thermal&) = delete;
+
+            ~Thermal();
+
+            /**
+             * @brief find the sensors and open them
+             * @return true if at least one temperature sensor was found
+             */
+            bool probe();
+
+            /**
+             * @brief add a handler for the THERMAL_HIGH and THERMAL_NORMAL events,
+             * it is safe to call while sampling
+             * @param handler the handler to add
+             */
+            void addEventHandler(PowerManagement::ACPIEventHandler *handler);
+
+            /**
+             * @brief set the temperature threshold, it is safe to call while
+             * sampling and starts over from the normal state
+             * @param high the threshold in millidegrees Celsius, -1 to disable
+             * @param hysteresis how far below the threshold the hottest sensor
+             * has to drop before THERMAL_NORMAL, in millidegrees Celsius
+             */
+            void setThreshold(int high, int hysteresis = 2000);
+
+            /**
+             * @brief start sampling
+             * @param interval the time between two samples
+             * @return true if the sampling thread was started
+             */
+            bool start(std::chrono::milliseconds interval);
+
+            /**
+             * @brief stop sampling, the samples are kept
+             */
+            void stop();
+
+            /**
+             * @return the sequence number the next sample will get, the
+             * latest sample is the one before it
+             */
+            uint64_t getSequence() const;
+
+            /**
+             * @brief look at a sample in the ring without copying it
+             * @param sequence the sequence number of the sample
+             * @return the sample, or nullptr if it was not taken yet or was overwritten
+             */
+            const ThermalSample *peek(uint64_t sequence) const;
+
+            /**
+             * @brief check that a sample was not overwritten while it was read
+             * @param sequence the sequence number of the sample
+             * @return true if the sample read through peek() was consistent
+             */
+            bool isValid(uint64_t sequence) const;
+
+            /**
+             * @return the number of temperature sensors
+             */
+            size_t getSensorCount() const;
+        };
+
     }
 
 
@@ -287,27 +809,74 @@ namespace ThinkPad {
             /*
              * The brightness increase button on the ThinkPad has been pressed
              */
-            BUTTON_BRIGHTNESS_UP
-        };
+            BUTTON_BRIGHTNESS_UP,
 
-        /**
-         * @brief this defines the reason why a system suspend was requested
-         */
-        enum SuspendReason {
-            LID,
-            BUTTON
-        };
+            /**
+             * The ThinkLight has been switched on
+             */
+            THINKLIGHT_ON,
+
+            /**
+             * The ThinkLight has been switched off
+             */
+            THINKLIGHT_OFF,
+
+            /**
+             * The state of a battery has changed, read it with Hardware::Battery
+             */
+            BATTERY_CHANGED,
+
+            /**
+             * The AC adapter has been connected
+             */
+            AC_CONNECTED,
+
+            /**
+             * The AC adapter has been disconnected
+             */
+            AC_DISCONNECTED,
+
+            /**
+             * The hottest sensor of a Hardware::Thermal crossed its threshold
+             */
+            THERMAL_HIGH,
+
+            /**
+             * The hottest sensor of a Hardware::Thermal cooled down below its threshold
+             */
+            THERMAL_NORMAL
+        };
+
+        /**
+         * @brief this defines the reason why a system suspend was requested
+         */
+        enum SuspendReason {
+            LID,
+            BUTTON
+        };
+
+        /**
+         * @brief Private internal API metada, do not use
+         */
+        struct ACPIEventCompletion;
 
-        /**
-         * @brief Private internal API metada, do not use
-         */
         struct _ACPIEventMetadata {
             ACPIEvent event;
             ACPIEventHandler *handler;
+            ACPIEventCompletion *completion;
         };
 
         typedef struct _ACPIEventMetadata ACPIEventMetadata;
 
+        /**
+         * @brief how long a handler took to handle the POWER_S3S4_ENTER event
+         */
+        struct HandlerTiming {
+            ACPIEventHandler *handler;
+            long microseconds;
+            bool finished;
+        };
+
         /**
          * The power state manager is used to request power
          * state changes to the system. You can request the system
@@ -336,6 +905,133 @@ namespace ThinkPad {
             */
             static bool requestSuspend(SuspendReason reason);
 
+            /**
+             * @brief take a logind delay inhibitor lock for sleep. While the lock
+             * is held, logind waits with the suspend until the lock is released
+             * or InhibitDelayMaxSec (5 seconds by default) has passed.
+             *
+             * The ACPI listener takes the lock when it starts and after every
+             * resume, and releases it once the handlers are done with POWER_S3S4_ENTER.
+             *
+             * @return true if the lock is held
+             */
+            static bool takeSleepInhibitor();
+
+            /**
+             * @brief release the delay inhibitor lock and let the system suspend
+             */
+            static void releaseSleepInhibitor();
+
+            /**
+             * @brief set how long the handlers of POWER_S3S4_ENTER get before the
+             * delay lock is released anyway. Keep it below InhibitDelayMaxSec.
+             * @param delay the deadline, 4 seconds by default
+             */
+            static void setSleepDelay(std::chrono::milliseconds delay);
+
+            /**
+             * @return the deadline for the POWER_S3S4_ENTER handlers
+             */
+            static std::chrono::milliseconds getSleepDelay();
+
+        };
+
+        /**
+         * @brief A descriptor an EventSource waits on
+         */
+        struct EventSourceFd {
+
+            /**
+             * @brief the descriptor
+             */
+            int fd;
+
+            /**
+             * @brief wait for priority data, like the notifications of sysfs
+             * attributes, instead of for input
+             */
+            bool priority;
+
+            /**
+             * @brief set by the event loop before drain() if the descriptor is ready
+             */
+            bool ready;
+        };
+
+        /**
+         * @brief An EventSource feeds events into the event loop of the ACPI class.
+         *
+         * All the sources of an ACPI object are served by a single thread. The
+         * thread waits until a descriptor of a source is ready or its timeout
+         * passed, and then lets the source drain it. drain() reads whatever is
+         * available, classifies it and emits the events, it must not block.
+         */
+        class EventSource {
+        protected:
+
+            /**
+             * @brief hand an event to the handlers of the ACPI object
+             */
+            void emit(ACPI *acpi, ACPIEvent event);
+
+            /**
+             * @brief hand an event to the handlers and time them, without waiting
+             * for them. drain() must not block, it calls finishTracked() until
+             * the handlers returned or the sleep delay passed.
+             * @param notifyFd written to once all the handlers returned, -1 for none
+             * @return the completion of the handlers, nullptr if there are none
+             */
+            ACPIEventCompletion *emitTracked(ACPI *acpi, ACPIEvent event, int notifyFd);
+
+            /**
+             * @brief record how long the handlers of emitTracked() took, once all
+             * of them returned or the sleep delay passed
+             * @param completion the completion from emitTracked(), released if this returns true
+             * @param force record them now, whether the handlers are done or not
+             * @return true if the handlers are done
+             */
+            bool finishTracked(ACPI *acpi, ACPIEventCompletion *completion, bool force);
+
+            /**
+             * @return the milliseconds until the sleep delay of a completion passed
+             */
+            static int getTrackedTimeout(ACPIEventCompletion *completion);
+
+        public:
+
+            virtual ~EventSource() {}
+
+            /**
+             * @brief acquire the resources of the source
+             * @param acpi the ACPI object the source belongs to
+             * @return false if the source is not available
+             */
+            virtual bool open(ACPI *acpi) = 0;
+
+            /**
+             * @brief add the descriptors to wait on, asked again after every drain()
+             * @param fds the list to add to
+             */
+            virtual void getFds(vector<EventSourceFd> *fds) = 0;
+
+            /**
+             * @return the milliseconds until drain() is due even without a ready
+             * descriptor, -1 to wait for the descriptors only
+             */
+            virtual int getTimeout() { return -1; }
+
+            /**
+             * @brief read what is available and emit the events
+             * @param acpi the ACPI object the source belongs to
+             * @param fds the descriptors from getFds(), with ready set
+             * @return false once the source is finished, close() is called then
+             */
+            virtual bool drain(ACPI *acpi, const vector<EventSourceFd> &fds) = 0;
+
+            /**
+             * @brief release everything open() acquired
+             */
+            virtual void close() = 0;
         };
 
         /**
@@ -348,15 +1044,42 @@ namespace ThinkPad {
         class ACPI {
         private:
 
-            static void *handle_acpid(void*);
-            static void *handle_udev(void*);
+            friend class EventSource;
+
+            static void *handle_events(void*);
+
+            /**
+             * Hand an event to every registered handler, each on its own thread
+             */
+            void dispatch(ACPIEvent event);
+
+            /**
+             * Hand an event to every registered handler without waiting for them,
+             * the completion records how long each one takes
+             */
+            ACPIEventCompletion *dispatchTracked(ACPIEvent event, int notifyFd);
+
+            /**
+             * Keep the timings of a tracked dispatch once all of its handlers
+             * returned or the sleep delay passed, and release the completion
+             */
+            bool finishTracked(ACPIEventCompletion *completion, bool force);
 
-            static pthread_t acpid_listener;
-            static pthread_t udev_listener;
+            pthread_t listener;
+            bool started = false;
+            int wakeFds[2] = {-1, -1};
 
             vector<ACPIEventHandler*> *ACPIhandlers;
+            vector<EventSource*> sources;
+            bool builtinSources = false;
+
+            string udevTag;
+            bool suppressUnknown = false;
+
+            bool useEvdev = false;
 
-            bool udev_running = true;
+            pthread_mutex_t timingsLock = PTHREAD_MUTEX_INITIALIZER;
+            vector<HandlerTiming> suspendTimings;
 
         public:
 
@@ -377,7 +1100,63 @@ namespace ThinkPad {
             void wait();
 
             /**
-             * @brief starts the listening on ACPI events
+             * @brief only receive the udev events of the devices with the tag.
+             *
+             * The events are then filtered in the kernel and unrelated platform
+             * devices do not wake the listener up at all. The devices are tagged
+             * THINKPAD_UDEV_TAG by the 70-libthinkpad.rules udev rule installed
+             * with the library into UDEV_RULES_DIR. Do not set the tag if the rule
+             * is not installed where udevd reads it, no udev event is received then.
+             * Call this before start().
+             *
+             * @param tag the udev tag, usually THINKPAD_UDEV_TAG
+             */
+            void setUdevTag(const char *tag);
+
+            /**
+             * @brief do not dispatch UNKNOWN events to the handlers, neither for
+             * unrecognized acpid events nor for udev events of unrelated devices
+             * @param suppress true to drop the UNKNOWN events
+             */
+            void setSuppressUnknown(bool suppress);
+
+            /**
+             * @brief read the hotkeys, the lid switch and the power button from
+             * their evdev devices instead of the acpid socket. Needs read access
+             * to /dev/input, falls back to acpid if no device could be opened.
+             * Only the first device of each name is read, and the kernel is asked
+             * to deliver only the mapped keys, so typing does not wake the listener.
+             * Call this before start().
+             * @param enable true to use evdev
+             */
+            void setUseEvdev(bool enable);
+
+            /**
+             * @brief read input events from an already open descriptor, in addition
+             * to the devices found by setUseEvdev(). The descriptor is closed by the
+             * listener. Call this before start().
+             * @param fd a descriptor that yields struct input_event records
+             */
+            void addInputDevice(int fd);
+
+            /**
+             * @brief add a source to the event loop, next to the acpid (or evdev)
+             * and udev sources. The ACPI object takes the ownership of the source.
+             * Call this before start().
+             * @param source the source to add
+             */
+            void addEventSource(EventSource *source);
+
+            /**
+             * @brief get how long every handler took for the last POWER_S3S4_ENTER
+             * event that was delivered while holding the sleep delay lock
+             * @return the timings, in the order of the handlers
+             */
+            vector<HandlerTiming> getSuspendTimings();
+
+            /**
+             * @brief starts the listening on ACPI events. It can be called again
+             * after wait() returned, the sources are opened again.
              */
             void start();
         };
@@ -433,6 +1212,33 @@ namespace ThinkPad {
                 char key[128];
                 char value[128];
 
+                /**
+                 * @brief the byte offset of the line of the keypair in the file
+                 * it was read from, or -1 if the keypair is not on the disk yet
+                 */
+                long lineOffset = -1;
+
+                /**
+                 * @brief the length of the line of the keypair, including the newline
+                 */
+                long lineLength = 0;
+
+                /**
+                 * @brief the byte offset of the value in the file the keypair
+                 * was read from, or -1 if the keypair is not on the disk yet
+                 */
+                long valueOffset = -1;
+
+                /**
+                 * @brief the length of the value in the file on the disk
+                 */
+                long valueLength = 0;
+
+                /**
+                 * @brief true if the keypair was changed since the last read/write
+                 */
+                bool dirty = false;
+
                 /**
                  * @brief construct a new keypair
                  * @param key the key to set
@@ -441,11 +1247,47 @@ namespace ThinkPad {
                 IniKeypair(const char *key, const char *value);
                 IniKeypair();
 
+                /**
+                 * @brief construct a keypair from unterminated strings, the
+                 * lengths have to be below the sizes of key and value
+                 * @param key the key to set
+                 * @param keyLength the length of the key
+                 * @param value the value to set
+                 * @param valueLength the length of the value
+                 */
+                IniKeypair(const char *key, size_t keyLength, const char *value, size_t valueLength);
+
             };
 
 
+            struct IniIndex;
+            class IniSnapshot;
+            class IniKey;
+            struct IniVersion;
+
+            /**
+             * @brief how long loading a single file of a config directory took
+             */
+            struct IniLoadTiming {
+                string path;
+                long microseconds;
+                bool loaded;
+            };
+
             class IniSection
             {
+                /* key -> first keypair with that key, rebuilt when the keypair list changes behind our back */
+                mutable IniIndex *index = nullptr;
+                mutable size_t indexed = 0;
+
+                /* bumped whenever keypairs are added or removed, checked by IniKey */
+                mutable uint64_t generation = 0;
+
+                friend class IniKey;
+
+                IniIndex *getIndex() const;
+                void removeLegacyArray(const char *key);
+
             public:
 
                 ~IniSection();
@@ -465,6 +1307,29 @@ namespace ThinkPad {
                 char name[128];
                 vector<IniKeypair*> *keypairs = nullptr;
 
+                /**
+                 * @brief the byte offset of the section header in the file
+                 * the section was read from, or -1 if the section is not on the disk yet
+                 */
+                long offset = -1;
+
+                /**
+                 * @brief the byte offset right after the last line of the
+                 * section on the disk, new keypairs are inserted here
+                 */
+                long end = -1;
+
+                /**
+                 * @brief true if the section was changed since the last read/write
+                 */
+                bool dirty = false;
+
+                /**
+                 * @brief the lines of the removed keypairs in the file on the disk
+                 * (offset, length), to be dropped by the next Ini::saveChanges()
+                 */
+                vector<std::pair<long, long>> removed;
+
                 /**
                  * @brief get a string from the section
                  * @param key the key of the string
@@ -473,12 +1338,28 @@ namespace ThinkPad {
                 const char *getString(const char *key) const;
 
                 /**
-                 * @brief set a string in the section with the key
+                 * @brief set a string in the section with the key. If the key
+                 * already exists, the value of the first keypair with the key is replaced.
                  * @param key the key to set
                  * @param value the value to set
                  */
                 const void setString(const char *key, const char *value);
 
+                /**
+                 * @brief append a keypair to the section, even if the key already exists.
+                 * getString() still returns the value of the first keypair with the key.
+                 * @param key the key to append
+                 * @param value the value to append
+                 */
+                const void append(const char *key, const char *value);
+
+                /**
+                 * @brief remove all the keypairs with the key from the section
+                 * @param key the key to remove
+                 * @return true if any keypair was removed
+                 */
+                bool remove(const char *key);
+
                 /**
                  * @brief get an int from the section
                  *
@@ -497,55 +1378,161 @@ namespace ThinkPad {
                 const void setInt(const char *key, const int value);
 
                 /**
-                 * @brief Get an array (vector) of ints from the section
+                 * @brief get a typed value from the section without any heap allocation.
+                 *
+                 * Specialized for int, int64_t, double, bool ("true"/"false",
+                 * "yes"/"no", "on"/"off", "1"/"0") and the std::chrono::milliseconds
+                 * and std::chrono::seconds durations ("250ms", "2s", "5m", "1h",
+                 * a plain number is in the unit of the duration). A duration that
+                 * is not a whole number of the unit ("1500ms" as seconds) or overflows
+                 * the duration is rejected.
+                 *
+                 * @param key the key of the value
+                 * @param value where to store the value, untouched on failure
+                 * @return true if the key exists and the whole value parsed as T
+                 */
+                template<typename T>
+                bool get(const char *key, T *value) const;
+
+                /**
+                 * @brief set a typed value in the section, formatted into a stack
+                 * buffer. Replacing an existing value does not allocate.
+                 * @param key the key to set
+                 * @param value the value to set
+                 */
+                template<typename T>
+                void set(const char *key, T value);
+
+                /**
+                 * @brief Get an array (vector) of ints from the section.
+                 *
+                 * Both the packed layout (key=1,2,3) and the legacy
+                 * layout (key_len=3, key_0=1, ...) are read.
+                 *
                  * @param key the key of the array
                  * @return the vector with the values or an empty vector if no keys are present
                  */
                 const vector<int> getIntArray(const char *key) const;
 
                 /**
-                 * @brief Set an array (vector) of ints into the section
+                 * @brief Set an array (vector) of ints into the section.
+                 *
+                 * The array is stored packed as key=1,2,3, or in the legacy
+                 * layout if it does not fit into a single value.
+                 *
                  * @param key the key of the array to set
                  * @param values the vector with the values
                  */
                 const void setIntArray(const char *key, vector<int> *values);
 
                 /**
-                 * @brief Get an array (vector) of strings from the section
-                 * @param key the key of the array
-                 * @return the vector with the values
+                 * @brief Set an array (vector) of strings into the section.
+                 *
+                 * The array is stored packed as key=a,b,c with ',' and '\\'
+                 * escaped by a '\\', or in the legacy layout if it does not fit
+                 * into a single value. An empty value is an empty array, so an
+                 * array holding only an empty string uses the legacy layout too.
+                 *
+                 * @param key the key of the array to set
+                 * @param strings the vector with the values
                  */
                 const void setStringArray(const char *key, const vector<const char*> *strings);
 
                 /**
-                 * @brief Get an array (vector) of strings from the section
+                 * @brief Get an array (vector) of strings from the section.
+                 *
+                 * The strings of a packed array are owned by the section and
+                 * are valid until the array is changed or the section is destroyed.
+                 *
                  * @param key the key of the array
                  * @return the vector with the values or an empty vector if no keys are present
                  */
                 const vector<const char*> getStringArray(const char *key);
             };
 
+            template<> bool IniSection::get<int>(const char *key, int *value) const;
+            template<> bool IniSection::get<int64_t>(const char *key, int64_t *value) const;
+            template<> bool IniSection::get<double>(const char *key, double *value) const;
+            template<> bool IniSection::get<bool>(const char *key, bool *value) const;
+            template<> bool IniSection::get<std::chrono::milliseconds>(const char *key, std::chrono::milliseconds *value) const;
+            template<> bool IniSection::get<std::chrono::seconds>(const char *key, std::chrono::seconds *value) const;
+
+            template<> void IniSection::set<int>(const char *key, int value);
+            template<> void IniSection::set<int64_t>(const char *key, int64_t value);
+            template<> void IniSection::set<double>(const char *key, double value);
+            template<> void IniSection::set<bool>(const char *key, bool value);
+            template<> void IniSection::set<std::chrono::milliseconds>(const char *key, std::chrono::milliseconds value);
+            template<> void IniSection::set<std::chrono::seconds>(const char *key, std::chrono::seconds value);
+
 
             /**
              * @brief This class represents a .ini/.conf/.desktop file parser
              * based on the Windows INI standard.
              *
-             * WARNING: COMMENTS ARE NOT SUPPORTED!
+             * The Ini and its sections are the mutable side of a document and are
+             * not thread safe, even lookups may update the section indexes. Build
+             * and change the document on one thread and share it with other threads
+             * as an IniSnapshot made by freeze().
+             *
+             * Lines starting with ';' or '#' are comments, as is anything after a ';'
+             * or '#' preceded by whitespace in an unquoted value. Whitespace around
+             * names, keys and values is trimmed and CRLF line endings are accepted.
+             * Values can be quoted with '"' to keep whitespace and comment characters,
+             * inside quotes \" and \\ are the only escapes. Keys, values and
+             * section names are limited to 127 bytes.
              */
             class Ini
             {
+                friend class IniKey;
+
                 vector<IniSection*> *sections = new vector<IniSection*>;
 
+                /* the contents of the file on the disk as of the last read/write */
+                string source;
+                string sourcePath;
+                long sourceSize = -1;
+                long sourceMtimeSec = -1;
+                long sourceMtimeNsec = -1;
+
+                void serializeSection(string &out, IniSection *section);
+                bool statSource(int fd);
+                void buildSnapshot(string &image);
+                bool parseIni(const char *data, size_t size, const char *name);
+                void thaw(const IniSnapshot &snapshot);
+
             public:
+                Ini();
+
+                /**
+                 * @brief construct a mutable copy of a snapshot, to change
+                 * a document that is shared as an IniSnapshot
+                 * @param snapshot the snapshot to copy
+                 */
+                Ini(const IniSnapshot &snapshot);
+
+                Ini(const Ini&) = delete;
+                Ini &operator=(const Ini&) = delete;
+
                 ~Ini();
 
                 /**
-                 * @brief parse parse a config file from the disk into the class
+                 * @brief parse parse a config file from the disk into the class.
+                 * Malformed lines are reported with their line and column and skipped.
                  * @param path the path to the file to parse
                  * @return the point to the section list
                  */
                 vector<IniSection*>* readIni(string path);
 
+                /**
+                 * @brief parse a config file that is already in memory, the same
+                 * way readIni() does. The data does not need to be NUL terminated.
+                 * @param data the contents of the file
+                 * @param size the size of the contents
+                 * @param name the name used in the diagnostics
+                 * @return the point to the section list
+                 */
+                vector<IniSection*>* readIniBuffer(const char *data, size_t size, string name = "<buffer>");
+
                 /**
                  * @brief writeConfig write a list of sections to the disk
                  * @param sections the list of sections to write
@@ -553,6 +1540,75 @@ namespace ThinkPad {
                  */
                 bool writeIni(string path);
 
+                /**
+                 * @brief save only the changes made since the last readIni/writeIni.
+                 *
+                 * Changed values are patched in place where the size allows it, new
+                 * keypairs and sections are inserted and only the part of the file after
+                 * the first size change is rewritten. If the file was not read from the
+                 * given path or was changed on the disk in the meantime, the whole file
+                 * is rewritten with writeIni().
+                 *
+                 * Only changes made through the IniSection setters are tracked.
+                 *
+                 * @param path the path to write
+                 * @return true if the save succeeded
+                 */
+                bool saveChanges(string path);
+
+                /**
+                 * @brief write the parsed file into a binary snapshot that can
+                 * be opened later with IniSnapshot or readIniCached() without parsing.
+                 *
+                 * The snapshot remembers the size, modification time and hash of the file
+                 * the sections were read from, so it is discarded once the file changes.
+                 *
+                 * @param path the path of the snapshot to write
+                 * @return true if the snapshot was written
+                 */
+                bool writeSnapshot(string path);
+
+                /**
+                 * @brief read a config file, using the snapshot at snapshotPath if it
+                 * is still valid for the file. Otherwise the file is parsed with readIni()
+                 * and a fresh snapshot is written.
+                 *
+                 * Sections loaded from a snapshot are saved with a full writeIni()
+                 * on the first saveChanges().
+                 *
+                 * @param path the path to the file to parse
+                 * @param snapshotPath the path of the snapshot
+                 * @return the point to the section list
+                 */
+                vector<IniSection*>* readIniCached(string path, string snapshotPath);
+
+                /**
+                 * @brief read a conf.d style directory of config files in parallel.
+                 *
+                 * If pattern is a directory, all the *.ini and *.conf files in it are
+                 * read, otherwise pattern is expanded as a glob. The files are parsed on
+                 * up to the given number of threads and merged in the lexical order of
+                 * their paths: sections with the same name are merged into the first one,
+                 * and a key set by a later file replaces every keypair with the same key
+                 * from the earlier files.
+                 *
+                 * The merged sections are not backed by any file, so the first saveChanges()
+                 * writes them whole.
+                 *
+                 * @param pattern the directory or the glob of the files to read
+                 * @param timings if not null, filled with the parse time of every file
+                 * @param threads the number of threads to parse the files on
+                 * @return the point to the section list or nullptr if no file matched
+                 */
+                vector<IniSection*>* readIniDirectory(string pattern, vector<IniLoadTiming> *timings = nullptr, int threads = 4);
+
+                /**
+                 * @brief make an immutable in-memory snapshot of the sections,
+                 * to be shared with other threads
+                 * @return the snapshot, owned by the caller
+                 */
+                IniSnapshot *freeze();
+
 
                 /**
                  * Get a list of sections from the file with the same name
@@ -573,10 +1629,360 @@ namespace ThinkPad {
                  * @param section the section to add
                  */
                 void addSection(IniSection* section);
+
+                /**
+                 * @brief make a handle for a key in a section that can be read
+                 * repeatedly without looking the section and the key up again
+                 * @param section the name of the section
+                 * @param key the key in the section
+                 * @return the handle, bound to this document
+                 */
+                IniKey compileKey(const char *section, const char *key);
+            };
+
+            /**
+             * @brief A precompiled lookup of a key in a section of an Ini document
+             * or of an IniSnapshot.
+             *
+             * The handle remembers the keypair it resolved to and only looks it up
+             * again after sections or keypairs were added or removed, so reading it
+             * is a couple of compares and a load. A handle caches its lookup without
+             * any locking, use it on the thread that owns the document and do not use
+             * it after the document is destroyed.
+             *
+             * Against snapshots the handle keeps the hashes of the section and the key
+             * and the value it found in the last snapshot it was read from, and only
+             * probes again when it is read from a different snapshot, e.g. after an
+             * IniWatcher reload. Give every reading thread its own copy of the handle.
+             */
+            class IniKey
+            {
+                friend class Ini;
+
+                Ini *document = nullptr;
+                char section[128];
+                char key[128];
+                uint64_t sectionHash = 0;
+                uint64_t keyHash = 0;
+
+                mutable IniSection *resolved = nullptr;
+                mutable const IniKeypair *keypair = nullptr;
+                mutable size_t sectionCount = SIZE_MAX;
+                mutable uint64_t generation = UINT64_MAX;
+
+                /* the snapshot the value was last looked up in */
+                mutable uint64_t snapshotSerial = 0;
+                mutable const char *snapshotValue = nullptr;
+
+                void resolve() const;
+
+            public:
+
+                IniKey();
+
+                /**
+                 * @brief make a handle that is not bound to a document, to be read
+                 * from snapshots with getString(const IniSnapshot*)
+                 * @param section the name of the section
+                 * @param key the key in the section
+                 */
+                IniKey(const char *section, const char *key);
+
+                /**
+                 * @brief get the value of the key
+                 * @return the value or nullptr if the section or the key does not exist
+                 */
+                const char *getString() const;
+
+                /**
+                 * @brief get the value of the key from a snapshot, e.g. the one
+                 * held by an IniWatcher::Reader
+                 * @param snapshot the snapshot to read, may be nullptr
+                 * @return the value, owned by the snapshot, or nullptr if the
+                 * section or the key does not exist
+                 */
+                const char *getString(const IniSnapshot *snapshot) const;
+
+                /**
+                 * @brief get the section the key resolved to
+                 * @return the section or nullptr if it does not exist
+                 */
+                IniSection *getSection() const;
+            };
+
+            /**
+             * @brief A read-only, memory mapped binary image of a parsed .ini file.
+             *
+             * The image holds a string table, the sections, the keypairs and a hash
+             * index over them, so opening it and looking up a value does not depend on
+             * the size of the file. Snapshots are written with Ini::writeSnapshot()
+             * or made in memory with Ini::freeze().
+             *
+             * A snapshot never changes once it is open, all the lookups only read
+             * the image and do not touch any shared state, so a snapshot can be read
+             * from any number of threads without locking.
+             */
+            class IniSnapshot
+            {
+                friend class Ini;
+                friend class IniKey;
+
+                const char *data = nullptr;
+                size_t size = 0;
+                bool mapped = false;
+                string image;
+
+                /* unique for every image opened or built in the process, 0 when empty */
+                uint64_t serial = 0;
+
+                bool validate() const;
+                void release();
+                const char *stringAt(uint32_t offset) const;
+                const char *lookup(uint64_t sectionHash, const char *section, uint64_t keyHash, const char *key) const;
+
+            public:
+
+                IniSnapshot() = default;
+                IniSnapshot(const IniSnapshot&) = delete;
+                IniSnapshot &operator=(const IniSnapshot&) = delete;
+
+                ~IniSnapshot();
+
+                /**
+                 * @brief open a snapshot and check it against the file it was made from
+                 * @param path the path of the snapshot
+                 * @param sourcePath the path of the .ini file, or empty to skip the check
+                 * @param verifyHash also hash the .ini file instead of trusting its size and modification time
+                 * @return true if the snapshot is valid and up to date
+                 */
+                bool open(const std::string &path, const std::string &sourcePath, bool verifyHash = false);
+
+                /**
+                 * @brief get a string from the first section with the name
+                 * @param section the name of the section
+                 * @param key the key of the string
+                 * @return the string or nullptr
+                 */
+                const char *getString(const char *section, const char *key) const;
+
+                /**
+                 * @return the number of sections in the snapshot
+                 */
+                size_t getSectionCount() const;
+
+                /**
+                 * @param section the index of the section
+                 * @return the name of the section
+                 */
+                const char *getSectionName(size_t section) const;
+
+                /**
+                 * @param section the index of the section
+                 * @return the number of keypairs in the section
+                 */
+                size_t getKeypairCount(size_t section) const;
+
+                /**
+                 * @param section the index of the section
+                 * @param keypair the index of the keypair in the section
+                 * @return the key of the keypair
+                 */
+                const char *getKey(size_t section, size_t keypair) const;
+
+                /**
+                 * @param section the index of the section
+                 * @param keypair the index of the keypair in the section
+                 * @return the value of the keypair
+                 */
+                const char *getValue(size_t section, size_t keypair) const;
+            };
+
+            /**
+             * @brief describes how a section changed between two versions of a file
+             */
+            struct IniSectionChange {
+
+                enum Type {
+                    ADDED,
+                    REMOVED,
+                    CHANGED
+                };
+
+                string section;
+                Type type;
+            };
+
+            /**
+             * @brief This is the abstract handler for config file changes.
+             *
+             * Override handleChange() to get notified when the file watched by
+             * an IniWatcher was reloaded. The method is called from the watcher thread.
+             */
+            class IniChangeHandler {
+            public:
+                /**
+                 * This method is called after a new version of the file was published
+                 *
+                 * @param changes the sections that were added, removed or changed
+                 */
+                virtual void handleChange(const vector<IniSectionChange> &changes) = 0;
+            };
+
+            /**
+             * @brief Watches a config file with inotify and reloads it when it changes.
+             *
+             * Every reload publishes a new immutable IniSnapshot through a single atomic
+             * pointer. Readers on any thread take the current snapshot with current()
+             * and keep using it for as long as they hold the returned Reader, they never
+             * see a partially parsed file and never take a lock.
+             *
+             * A replaced snapshot is deleted by the watcher thread once every Reader
+             * taken before the swap is gone, the reload waits for them. Hold a Reader for
+             * a batch of lookups, not for the lifetime of the program.
+             */
+            class IniWatcher {
+            private:
+
+                static void *handle_inotify(void*);
+
+                string path;
+                std::atomic<const IniVersion*> published;
+                uint64_t generation = 0;
+                vector<IniChangeHandler*> *handlers;
+
+                /* readers of the current and the previous epoch, see Reader */
+                mutable std::atomic<unsigned> epoch;
+                mutable std::atomic<unsigned> readers[2];
+
+                void retire(const IniVersion *version);
+
+                pthread_t listener;
+                bool listening = false;
+                int inotifyFd = -1;
+                int stopPipe[2] = { -1, -1 };
+
+                bool reload();
+
+            public:
+
+                /**
+                 * @brief construct a watcher for a config file
+                 * @param path the path of the file to watch
+                 */
+                IniWatcher(string path);
+                ~IniWatcher();
+
+                /**
+                 * @brief add a handler for file changes, call this before start()
+                 * @param handler the handler to add
+                 */
+                void addChangeHandler(IniChangeHandler *handler);
+
+                /**
+                 * @brief load the file and start watching it for changes
+                 * @return true if the file was loaded and the watch is set up
+                 */
+                bool start();
+
+                /**
+                 * @brief keeps the snapshot it was taken with alive.
+                 *
+                 * Taking a Reader is two atomic increments and a load, it
+                 * must not outlive the watcher.
+                 */
+                class Reader {
+                    friend class IniWatcher;
+
+                    const IniWatcher *watcher;
+                    unsigned slot = 0;
+                    const IniSnapshot *snapshot = nullptr;
+                    uint64_t generation = 0;
+
+                    Reader(const IniWatcher *watcher);
+
+                public:
+                    Reader(Reader &&other);
+                    Reader(const Reader&) = delete;
+                    Reader &operator=(const Reader&) = delete;
+                    ~Reader();
+
+                    /**
+                     * @return the snapshot, nullptr if the file was never loaded
+                     */
+                    const IniSnapshot *get() const { return snapshot; }
+                    const IniSnapshot *operator->() const { return snapshot; }
+
+                    /**
+                     * @return the number of the reload that published the snapshot,
+                     * 0 if the file was never loaded
+                     */
+                    uint64_t getGeneration() const { return generation; }
+                };
+
+                /**
+                 * @brief get the current version of the file. Take it once for
+                 * a batch of lookups, the snapshot is valid while the Reader is held.
+                 * @return the reader holding the current snapshot
+                 */
+                Reader current() const;
             };
 
         }
 
+        /**
+         * @brief The runtime metrics of the library: the dispatched and dropped
+         * events, the dispatch latency, the acpid reconnects and the sysfs reads.
+         *
+         * Every thread counts into its own block of counters, the blocks are
+         * only summed up when the metrics are rendered.
+         */
+        class Metrics {
+        public:
+
+            /**
+             * @brief render the metrics in the OpenMetrics text format
+             * @param buf the buffer to render to, always NUL terminated if size is not 0
+             * @param size the size of the buffer
+             * @return the length of the whole text, render again with a bigger
+             * buffer if it is not less than size
+             */
+            static size_t render(char *buf, size_t size);
+
+            /**
+             * @brief render the metrics in the OpenMetrics text format
+             * @return the text
+             */
+            static string render();
+        };
+
+        /**
+         * @brief Serves the metrics on a Unix socket from the event loop of an
+         * ACPI object, add it with ACPI::addEventSource().
+         *
+         * Every client that connects gets the OpenMetrics text and the connection
+         * is closed, there is no HTTP. `socat - UNIX-CONNECT:path` reads it.
+         */
+        class MetricsExporter : public PowerManagement::EventSource {
+        private:
+
+            string path;
+            int listenFd = -1;
+
+        public:
+
+            /**
+             * @param path the path of the socket, a stale socket there is replaced,
+             * any other kind of file makes open() fail and is left alone
+             */
+            MetricsExporter(const string &path);
+            ~MetricsExporter();
+
+            bool open(PowerManagement::ACPI *acpi) override;
+            void getFds(vector<PowerManagement::EventSourceFd> *fds) override;
+            bool drain(PowerManagement::ACPI *acpi, const vector<PowerManagement::EventSourceFd> &fds) override;
+            void close() override;
+        };
+
         /**
          * @brief Class used for programs to access the
          * library version
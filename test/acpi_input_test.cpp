@@ -0,0 +1,124 @@
+/*
+ * Tests of the evdev input path: recorded input_event records are fed
+ * through a pipe given to addInputDevice(), and only the presses and
+ * the switch changes come out as events
+ */
+
+#include "libthinkpad.h"
+#include "check.h"
+
+#include <atomic>
+#include <fcntl.h>
+#include <linux/input.h>
+#include <unistd.h>
+
+using ThinkPad::PowerManagement::ACPI;
+using ThinkPad::PowerManagement::ACPIEvent;
+using ThinkPad::PowerManagement::ACPIEventHandler;
+
+class CountingHandler : public ACPIEventHandler {
+public:
+    std::atomic<int> counts[ACPIEvent::THERMAL_NORMAL + 1];
+    std::atomic<int> total;
+
+    CountingHandler() : total(0)
+    {
+        for (std::atomic<int> &count : counts) count = 0;
+    }
+
+    void handleEvent(ACPIEvent event) override {
+        if (event >= 0 && event <= ACPIEvent::THERMAL_NORMAL) counts[event]++;
+        total++;
+    }
+};
+
+static struct input_event record(uint16_t type, uint16_t code, int32_t value)
+{
+    struct input_event input;
+    memset(&input, 0, sizeof(input));
+    input.type = type;
+    input.code = code;
+    input.value = value;
+    return input;
+}
+
+static bool waitFor(const std::atomic<int> &value, int expected)
+{
+    for (int i = 0; i < 500; i++) {
+        if (value.load() >= expected) return true;
+        usleep(10 * 1000);
+    }
+    return false;
+}
+
+int main()
+{
+    int input[2];
+
+    if (pipe2(input, O_CLOEXEC) < 0) {
+        perror("pipe2");
+        return 1;
+    }
+
+    const struct input_event recorded[] = {
+            /* a mute press with its scan code, release and report */
+            record(EV_MSC, MSC_SCAN, 0xa0),
+            record(EV_KEY, KEY_MUTE, 1),
+            record(EV_SYN, SYN_REPORT, 0),
+            record(EV_KEY, KEY_MUTE, 0),
+            record(EV_SYN, SYN_REPORT, 0),
+            /* a held volume key, the autorepeat is not an event */
+            record(EV_KEY, KEY_VOLUMEUP, 1),
+            record(EV_KEY, KEY_VOLUMEUP, 2),
+            record(EV_KEY, KEY_VOLUMEUP, 2),
+            record(EV_KEY, KEY_VOLUMEUP, 0),
+            /* a key without a mapping */
+            record(EV_KEY, KEY_A, 1),
+            record(EV_KEY, KEY_A, 0),
+            /* the lid */
+            record(EV_SW, SW_LID, 1),
+            record(EV_SYN, SYN_REPORT, 0),
+            record(EV_SW, SW_LID, 0),
+            record(EV_SYN, SYN_REPORT, 0),
+            /* both of the ThinkVantage codes */
+            record(EV_KEY, KEY_VENDOR, 1),
+            record(EV_KEY, KEY_PROG1, 1),
+            record(EV_KEY, KEY_POWER, 1),
+    };
+
+    CountingHandler handler;
+
+    {
+        ACPI acpi;
+
+        acpi.setSuppressUnknown(true);
+        acpi.addEventHandler(&handler);
+        acpi.addInputDevice(input[0]);
+        acpi.start();
+
+        /* split the records in the middle, the reader has to put them back together */
+        const char *bytes = (const char*) recorded;
+        const size_t split = sizeof(struct input_event) + sizeof(struct input_event) / 2;
+
+        CHECK(write(input[1], bytes, split) == (ssize_t) split);
+        usleep(50 * 1000);
+        CHECK(write(input[1], bytes + split, sizeof(recorded) - split) == (ssize_t) (sizeof(recorded) - split));
+
+        CHECK(waitFor(handler.total, 7));
+
+        /* nothing else arrives late */
+        usleep(200 * 1000);
+
+        CHECK(handler.counts[ACPIEvent::BUTTON_MUTE].load() == 1);
+        CHECK(handler.counts[ACPIEvent::BUTTON_VOLUME_UP].load() == 1);
+        CHECK(handler.counts[ACPIEvent::LID_CLOSED].load() == 1);
+        CHECK(handler.counts[ACPIEvent::LID_OPENED].load() == 1);
+        CHECK(handler.counts[ACPIEvent::BUTTON_THINKVANTAGE].load() == 2);
+        CHECK(handler.counts[ACPIEvent::BUTTON_POWER].load() == 1);
+        CHECK(handler.total.load() == 7);
+
+        close(input[1]);
+    }
+
+    return checkResult();
+}
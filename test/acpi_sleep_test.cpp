@@ -0,0 +1,264 @@
+/*
+ * Suspend and resume through logind: a private system bus is started,
+ * a fake logind on it hands out the delay inhibitor and sends
+ * PrepareForSleep, and the ACPI handlers have to see exactly one
+ * POWER_S3S4_ENTER and one POWER_S3S4_EXIT. A slow suspend handler
+ * must not hold up the other events.
+ *
+ * Skipped (exit code 77) if there is no dbus-daemon.
+ */
+
+#include "libthinkpad.h"
+#include "check.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <csignal>
+#include <fcntl.h>
+#include <linux/input.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <systemd/sd-bus.h>
+
+using ThinkPad::PowerManagement::ACPI;
+using ThinkPad::PowerManagement::ACPIEvent;
+using ThinkPad::PowerManagement::ACPIEventHandler;
+
+#define SKIP 77
+
+class SleepHandler : public ACPIEventHandler {
+public:
+    std::atomic<int> entered;
+    std::atomic<int> exited;
+    std::atomic<int> muted;
+    std::atomic<bool> suspending;
+
+    SleepHandler() : entered(0), exited(0), muted(0), suspending(false) {}
+
+    void handleEvent(ACPIEvent event) override {
+        if (event == ACPIEvent::POWER_S3S4_ENTER) {
+            entered++;
+            suspending = true;
+            usleep(500 * 1000);
+            suspending = false;
+        }
+        if (event == ACPIEvent::POWER_S3S4_EXIT) exited++;
+        /* only counted while the suspend handler is still running */
+        if (event == ACPIEvent::BUTTON_MUTE && suspending.load()) muted++;
+    }
+};
+
+/* the fake logind, all of its bus traffic happens on its own thread */
+static std::atomic<int> inhibits(0);
+static std::atomic<int> pendingSignal(-1);
+static std::atomic<bool> stopLogind(false);
+static std::atomic<bool> logindReady(false);
+
+static int handleInhibit(sd_bus_message *message, void *userdata, sd_bus_error *error)
+{
+    if (sd_bus_message_is_method_call(message, "org.freedesktop.login1.Manager", "Inhibit") <= 0) {
+        return 0;
+    }
+
+    int lock[2];
+
+    if (pipe(lock) < 0) {
+        return -errno;
+    }
+
+    /* the reply carries a copy of the descriptor */
+    sd_bus_reply_method_return(message, "h", lock[0]);
+
+    close(lock[0]);
+    close(lock[1]);
+
+    inhibits++;
+
+    return 1;
+}
+
+static void *runLogind(void *)
+{
+    sd_bus *bus = nullptr;
+
+    if (sd_bus_open_system(&bus) < 0
+        || sd_bus_request_name(bus, "org.freedesktop.login1", 0) < 0
+        || sd_bus_add_filter(bus, NULL, handleInhibit, NULL) < 0) {
+        fprintf(stderr, "logind: failed to set up the fake logind\n");
+        sd_bus_unref(bus);
+        return NULL;
+    }
+
+    logindReady = true;
+
+    while (!stopLogind.load()) {
+
+        const int start = pendingSignal.exchange(-1);
+
+        if (start >= 0) {
+            sd_bus_emit_signal(bus, "/org/freedesktop/login1", "org.freedesktop.login1.Manager",
+                               "PrepareForSleep", "b", start);
+        }
+
+        while (sd_bus_process(bus, NULL) > 0);
+
+        sd_bus_wait(bus, 10 * 1000);
+
+    }
+
+    sd_bus_flush_close_unref(bus);
+
+    return NULL;
+}
+
+static bool waitFor(const std::atomic<int> &value, int expected)
+{
+    for (int i = 0; i < 500 && value.load() < expected; i++) {
+        usleep(10 * 1000);
+    }
+    return value.load() >= expected;
+}
+
+static pid_t startBus(const string &directory, const string &socket)
+{
+    const string config = directory + "/system.conf";
+
+    FILE *file = fopen(config.c_str(), "w");
+    fprintf(file,
+            "<busconfig>\n"
+            "  <type>system</type>\n"
+            "  <listen>unix:path=%s</listen>\n"
+            "  <auth>EXTERNAL</auth>\n"
+            "  <policy context=\"default\">\n"
+            "    <allow user=\"*\"/>\n"
+            "    <allow own=\"*\"/>\n"
+            "    <allow send_destination=\"*\"/>\n"
+            "    <allow receive_sender=\"*\"/>\n"
+            "  </policy>\n"
+            "</busconfig>\n", socket.c_str());
+    fclose(file);
+
+    const pid_t daemon = fork();
+
+    if (daemon == 0) {
+        const string argument = "--config-file=" + config;
+        execlp("dbus-daemon", "dbus-daemon", argument.c_str(), "--nofork", "--nosyslog", (char *) NULL);
+        _exit(SKIP);
+    }
+
+    struct stat buf;
+
+    for (int i = 0; i < 500; i++) {
+
+        if (stat(socket.c_str(), &buf) == 0) {
+            return daemon;
+        }
+
+        int status;
+        if (waitpid(daemon, &status, WNOHANG) == daemon) {
+            return -1;
+        }
+
+        usleep(10 * 1000);
+
+    }
+
+    kill(daemon, SIGTERM);
+    waitpid(daemon, NULL, 0);
+
+    return -1;
+}
+
+int main()
+{
+    char directory[] = "/tmp/libthinkpad-bus-XXXXXX";
+
+    if (mkdtemp(directory) == nullptr) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    const string socket = string(directory) + "/system_bus_socket";
+    const pid_t daemon = startBus(directory, socket);
+
+    if (daemon < 0) {
+        fprintf(stderr, "no dbus-daemon, skipping\n");
+        unlink((string(directory) + "/system.conf").c_str());
+        rmdir(directory);
+        return SKIP;
+    }
+
+    /* sd_bus_open_system() in the library and in the fake logind connect here */
+    setenv("DBUS_SYSTEM_BUS_ADDRESS", ("unix:path=" + socket).c_str(), 1);
+
+    pthread_t logind;
+    pthread_create(&logind, NULL, runLogind, NULL);
+
+    for (int i = 0; i < 500 && !logindReady.load(); i++) {
+        usleep(10 * 1000);
+    }
+
+    CHECK(logindReady.load());
+
+    int input[2];
+    CHECK(pipe2(input, O_CLOEXEC) == 0);
+
+    {
+        SleepHandler handler;
+        ACPI acpi;
+
+        acpi.addEventHandler(&handler);
+        acpi.addInputDevice(input[0]);
+        acpi.start();
+
+        /* the udev source takes the delay inhibitor once it is listening */
+        CHECK(waitFor(inhibits, 1));
+
+        pendingSignal = 1;
+        CHECK(waitFor(handler.entered, 1));
+
+        /* the loop goes on while the suspend handler runs */
+        struct input_event press;
+        memset(&press, 0, sizeof(press));
+        press.type = EV_KEY;
+        press.code = KEY_MUTE;
+        press.value = 1;
+
+        CHECK(write(input[1], &press, sizeof(press)) == (ssize_t) sizeof(press));
+        CHECK(waitFor(handler.muted, 1));
+
+        /* the timings are kept once the handler returned */
+        for (int i = 0; i < 500 && acpi.getSuspendTimings().empty(); i++) {
+            usleep(10 * 1000);
+        }
+
+        const vector<ThinkPad::PowerManagement::HandlerTiming> timings = acpi.getSuspendTimings();
+        CHECK(timings.size() == 1 && timings[0].finished && timings[0].microseconds >= 500 * 1000);
+
+        /* after resume the inhibitor is taken again for the next suspend */
+        pendingSignal = 0;
+        CHECK(waitFor(handler.exited, 1));
+        CHECK(waitFor(inhibits, 2));
+
+        /* nothing else arrives late */
+        usleep(200 * 1000);
+
+        CHECK(handler.entered.load() == 1);
+        CHECK(handler.exited.load() == 1);
+
+        close(input[1]);
+    }
+
+    stopLogind = true;
+    pthread_join(logind, NULL);
+
+    kill(daemon, SIGTERM);
+    waitpid(daemon, NULL, 0);
+
+    unlink(socket.c_str());
+    unlink((string(directory) + "/system.conf").c_str());
+    rmdir(directory);
+
+    return checkResult();
+}
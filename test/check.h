@@ -0,0 +1,43 @@
+/*
+ * The checks used by the unit tests. A failed check is reported and
+ * the test carries on, main() returns checkResult().
+ */
+
+#ifndef LIBTHINKPAD_CHECK_H
+#define LIBTHINKPAD_CHECK_H
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+static int checkFailures = 0;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            checkFailures++; \
+        } \
+    } while (0)
+
+#define CHECK_STR(actual, expected) \
+    do { \
+        const std::string checkActual = (actual); \
+        const std::string checkExpected = (expected); \
+        if (checkActual != checkExpected) { \
+            fprintf(stderr, "%s:%d: check failed: %s is \"%s\", expected \"%s\"\n", \
+                    __FILE__, __LINE__, #actual, checkActual.c_str(), checkExpected.c_str()); \
+            checkFailures++; \
+        } \
+    } while (0)
+
+static inline int checkResult()
+{
+    if (checkFailures > 0) {
+        fprintf(stderr, "%d checks failed\n", checkFailures);
+        return 1;
+    }
+    return 0;
+}
+
+#endif
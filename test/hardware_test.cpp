@@ -0,0 +1,165 @@
+/*
+ * Tests of the hardware classes against a fake sysfs tree
+ */
+
+#include "libthinkpad.h"
+#include "check.h"
+
+#include <cstdlib>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using ThinkPad::Hardware::Battery;
+using ThinkPad::Hardware::BatteryState;
+using ThinkPad::Hardware::ThresholdWrite;
+
+static string root;
+
+static void writeAttribute(const string &supply, const char *attribute, const char *value)
+{
+    string path = root + "/" + supply + "/" + attribute;
+    FILE *file = fopen(path.c_str(), "w");
+    fprintf(file, "%s\n", value);
+    fclose(file);
+}
+
+static string readAttribute(const string &supply, const char *attribute)
+{
+    string path = root + "/" + supply + "/" + attribute;
+    char buf[64] = {0};
+    FILE *file = fopen(path.c_str(), "r");
+    if (file == nullptr) return string();
+    if (fgets(buf, sizeof(buf), file) == nullptr) buf[0] = 0;
+    fclose(file);
+    buf[strcspn(buf, "\n")] = 0;
+    return buf;
+}
+
+static void addSupply(const string &supply, const char *type, const char *start, const char *stop)
+{
+    mkdir((root + "/" + supply).c_str(), 0755);
+    writeAttribute(supply, "type", type);
+    writeAttribute(supply, "uevent", "POWER_SUPPLY_PRESENT=1");
+
+    if (start != nullptr) {
+        writeAttribute(supply, "charge_control_start_threshold", start);
+        writeAttribute(supply, "charge_control_end_threshold", stop);
+    }
+}
+
+static void removeSupply(const string &supply)
+{
+    const char *attributes[] = {"type", "uevent", "charge_control_start_threshold", "charge_control_end_threshold"};
+    for (const char *attribute : attributes) {
+        unlink((root + "/" + supply + "/" + attribute).c_str());
+    }
+    rmdir((root + "/" + supply).c_str());
+}
+
+static void checkWrite(const vector<ThresholdWrite> &planned, size_t index,
+                       const char *battery, const char *attribute, int value)
+{
+    CHECK(index < planned.size());
+    if (index >= planned.size()) return;
+
+    CHECK_STR(planned[index].battery, battery);
+    CHECK_STR(planned[index].attribute, attribute);
+    CHECK(planned[index].value == value);
+}
+
+static void testPlannedThresholds()
+{
+    vector<ThresholdWrite> planned;
+
+    /* going down, the start threshold is lowered first */
+    Battery battery("BAT0");
+    CHECK(battery.setThresholds(20, 60, &planned));
+    CHECK(planned.size() == 2);
+    checkWrite(planned, 0, "BAT0", "charge_control_start_threshold", 20);
+    checkWrite(planned, 1, "BAT0", "charge_control_end_threshold", 60);
+
+    /* an unchanged threshold is not written */
+    planned.clear();
+    CHECK(battery.setThresholds(40, 90, &planned));
+    CHECK(planned.size() == 1);
+    checkWrite(planned, 0, "BAT0", "charge_control_end_threshold", 90);
+
+    /* invalid thresholds plan nothing */
+    planned.clear();
+    CHECK(!battery.setThresholds(60, 50, &planned));
+    CHECK(planned.empty());
+
+    /* going up past the end threshold, the end threshold is raised first */
+    planned.clear();
+    CHECK(Battery::setAllThresholds(85, 95, &planned));
+    CHECK(planned.size() == 4);
+    checkWrite(planned, 0, "BAT0", "charge_control_end_threshold", 95);
+    checkWrite(planned, 1, "BAT0", "charge_control_start_threshold", 85);
+    checkWrite(planned, 2, "BAT1", "charge_control_end_threshold", 95);
+    checkWrite(planned, 3, "BAT1", "charge_control_start_threshold", 85);
+
+    /* a dry run leaves the files alone */
+    CHECK_STR(readAttribute("BAT0", "charge_control_start_threshold"), "40");
+    CHECK_STR(readAttribute("BAT0", "charge_control_end_threshold"), "80");
+    CHECK_STR(readAttribute("BAT1", "charge_control_start_threshold"), "75");
+    CHECK_STR(readAttribute("BAT1", "charge_control_end_threshold"), "80");
+}
+
+static void testThresholdsWritten()
+{
+    CHECK(Battery::setAllThresholds(50, 70));
+    CHECK_STR(readAttribute("BAT0", "charge_control_start_threshold"), "50");
+    CHECK_STR(readAttribute("BAT0", "charge_control_end_threshold"), "70");
+    CHECK_STR(readAttribute("BAT1", "charge_control_start_threshold"), "50");
+    CHECK_STR(readAttribute("BAT1", "charge_control_end_threshold"), "70");
+}
+
+static void testUeventWithoutNewline()
+{
+    /* a uevent that fills the read buffer, the value at the end runs into the cut */
+    string uevent = "POWER_SUPPLY_PRESENT=1\n";
+    while (uevent.size() < 2100) uevent += "POWER_SUPPLY_MODEL_NAME=padding\n";
+    const string last = "\nPOWER_SUPPLY_CAPACITY=42";
+    uevent.resize(2047 - last.size());
+    uevent += last;
+
+    FILE *file = fopen((root + "/BAT0/uevent").c_str(), "w");
+    fputs(uevent.c_str(), file);
+    fclose(file);
+
+    Battery battery("BAT0");
+    BatteryState state;
+
+    CHECK(battery.read(&state));
+    CHECK(state.present);
+    CHECK(state.capacity == 42);
+
+    writeAttribute("BAT0", "uevent", "POWER_SUPPLY_PRESENT=1");
+}
+
+int main()
+{
+    char directory[] = "/tmp/libthinkpad-sysfs-XXXXXX";
+    if (mkdtemp(directory) == nullptr) {
+        perror("mkdtemp");
+        return 1;
+    }
+    root = directory;
+
+    addSupply("AC", "Mains", nullptr, nullptr);
+    addSupply("BAT0", "Battery", "40", "80");
+    addSupply("BAT1", "Battery", "75", "80");
+
+    Battery::setSysfsRoot(root);
+
+    testPlannedThresholds();
+    testThresholdsWritten();
+    testUeventWithoutNewline();
+
+    removeSupply("AC");
+    removeSupply("BAT0");
+    removeSupply("BAT1");
+    rmdir(directory);
+
+    return checkResult();
+}
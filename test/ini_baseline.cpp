@@ -0,0 +1,137 @@
+#include "ini_baseline.h"
+
+#include <cstdio>
+#include <cstring>
+
+using ThinkPad::Utilities::Ini::IniSection;
+using ThinkPad::Utilities::Ini::IniKeypair;
+
+#define BASELINE_STORE(buffer, ptr, c) \
+    if ((size_t) ((ptr) - (buffer)) >= sizeof(buffer) - 1) { printf("baseline: buffer overflow\n"); goto break_outer; } \
+    *(ptr)++ = (c);
+
+vector<IniSection*> *baselineParse(const char *file, size_t size)
+{
+    vector<IniSection*> *sections = new vector<IniSection*>;
+
+    /* the old parser leaked the unfinished section and keypair on errors */
+    IniSection *section = nullptr;
+    IniKeypair *keypair = nullptr;
+    char *ptr;
+
+    for (size_t i = 0; i < size; i++) {
+
+        continue_outer:
+
+        /* skip leading whitespaces */
+        while (file[i] == '\n') {
+            i++;
+            if (i >= size)
+                goto break_outer;
+        }
+
+        if (file[i] != '[') {
+            printf("config: unexpected token: %c\n", file[i]);
+            break;
+        }
+
+        /* skip '[' */
+        i++;
+        if (i >= size) {
+            printf("config: unexpected EOF\n");
+            goto break_outer;
+        }
+
+        section = new IniSection;
+        section->keypairs = new vector<IniKeypair*>;
+
+        ptr = section->name;
+
+        while (file[i] != ']') {
+            BASELINE_STORE(section->name, ptr, file[i]);
+            i++;
+            if (i >= size) {
+                printf("config: unclosed ]\n");
+                goto break_outer;
+            }
+        }
+
+        /* skip ']' */
+        i++;
+        if (i >= size) {
+            printf("config: unexpected EOF\n");
+            goto break_outer;
+        }
+
+        while (true) {
+
+            /* skip leading whitespaces */
+            while (file[i] == '\n') {
+                i++;
+                if (i >= size) {
+                    sections->push_back(section);
+                    section = nullptr;
+                    goto break_outer;
+                }
+            }
+
+            /* a new section is there */
+            if (file[i] == '[') {
+                sections->push_back(section);
+                section = nullptr;
+                goto continue_outer;
+            }
+
+            keypair = new IniKeypair;
+            ptr = keypair->key;
+
+            while (file[i] != '=') {
+                BASELINE_STORE(keypair->key, ptr, file[i]);
+                i++;
+                if (i >= size) {
+                    printf("config: unexpected EOF, expected '='\n");
+                    goto break_outer;
+                }
+            }
+
+            /* skip '=' */
+            i++;
+            if (i >= size) {
+                printf("config: unexpected EOF, expected '='\n");
+                goto break_outer;
+            }
+
+            ptr = keypair->value;
+
+            while (file[i] != '\n') {
+                BASELINE_STORE(keypair->value, ptr, file[i]);
+                i++;
+                if (i >= size) {
+                    printf("config: unexpected EOF\n");
+                    goto break_outer;
+                }
+            }
+
+            section->keypairs->push_back(keypair);
+            keypair = nullptr;
+
+        }
+
+    }
+
+    break_outer:
+
+    delete keypair;
+    delete section;
+
+    return sections;
+}
+
+void baselineFree(vector<IniSection*> *sections)
+{
+    for (IniSection *section : *sections) {
+        delete section;
+    }
+
+    delete sections;
+}
@@ -0,0 +1,28 @@
+/*
+ * The config parser as it was before the tokenizer rewrite, kept to
+ * check the new parser against and to benchmark it.
+ */
+
+#ifndef LIBTHINKPAD_INI_BASELINE_H
+#define LIBTHINKPAD_INI_BASELINE_H
+
+#include "libthinkpad.h"
+
+/**
+ * Parse a config file with the old parser, into the same sections and
+ * keypairs the old Ini::readIni() built. The old parser wrote keys,
+ * values and names longer than 127 bytes past its buffers, here the
+ * parse stops at them instead.
+ * @param file the contents of the file
+ * @param size the size of the contents
+ * @return the sections that were complete when the parse stopped,
+ * free them with baselineFree()
+ */
+vector<ThinkPad::Utilities::Ini::IniSection*> *baselineParse(const char *file, size_t size);
+
+/**
+ * Free the sections returned by baselineParse()
+ */
+void baselineFree(vector<ThinkPad::Utilities::Ini::IniSection*> *sections);
+
+#endif
@@ -0,0 +1,162 @@
+#include "ini_corpus.h"
+
+using std::string;
+
+static const char NAME_CHARS[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789._-/:@";
+static const char VALUE_CHARS[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789._-/:@=,;#\\";
+
+uint64_t CorpusRandom::next()
+{
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 2685821657736338717ULL;
+}
+
+size_t CorpusRandom::below(size_t bound)
+{
+    return bound == 0 ? 0 : (size_t) (next() % bound);
+}
+
+static string randomString(CorpusRandom &random, const char *chars, size_t count, size_t minLength, size_t maxLength)
+{
+    string result;
+    size_t length = minLength + random.below(maxLength - minLength + 1);
+
+    for (size_t i = 0; i < length; i++) {
+        result.push_back(chars[random.below(count)]);
+    }
+
+    return result;
+}
+
+CorpusDocument generateDocument(CorpusRandom &random, size_t maxSections, size_t maxKeypairs)
+{
+    CorpusDocument document(random.below(maxSections + 1));
+
+    for (CorpusSection &section : document) {
+
+        section.name = randomString(random, NAME_CHARS, sizeof(NAME_CHARS) - 1, 1, 24);
+        section.keypairs.resize(random.below(maxKeypairs + 1));
+
+        for (CorpusKeypair &keypair : section.keypairs) {
+            keypair.key = randomString(random, NAME_CHARS, sizeof(NAME_CHARS) - 1, 1, 32);
+            keypair.value = randomString(random, VALUE_CHARS, sizeof(VALUE_CHARS) - 1, 0, 100);
+        }
+
+        /* repeated keys are kept in order by both parsers */
+        if (section.keypairs.size() > 1 && random.below(4) == 0) {
+            section.keypairs.back().key = section.keypairs.front().key;
+        }
+
+    }
+
+    /* and so are repeated sections */
+    if (document.size() > 1 && random.below(4) == 0) {
+        document.back().name = document.front().name;
+    }
+
+    return document;
+}
+
+string renderCanonical(const CorpusDocument &document, CorpusRandom &random)
+{
+    string out;
+
+    for (const CorpusSection &section : document) {
+
+        out.append("[").append(section.name).append("]\n");
+
+        for (const CorpusKeypair &keypair : section.keypairs) {
+            out.append(keypair.key).append("=").append(keypair.value).append("\n");
+            if (random.below(8) == 0) out.append("\n");
+        }
+
+        out.append("\n");
+
+    }
+
+    return out;
+}
+
+static string randomSpaces(CorpusRandom &random)
+{
+    static const char *SPACES[] = { "", "", " ", "\t", "  ", " \t " };
+    return SPACES[random.below(6)];
+}
+
+string renderDecorated(const CorpusDocument &document, CorpusRandom &random)
+{
+    const char *eol = random.below(2) == 0 ? "\r\n" : "\n";
+    string out;
+
+    if (random.below(2) == 0) {
+        out.append("; generated").append(eol);
+    }
+
+    for (const CorpusSection &section : document) {
+
+        out.append(randomSpaces(random)).append("[").append(randomSpaces(random)).append(section.name);
+        out.append(randomSpaces(random)).append("]");
+
+        if (random.below(4) == 0) {
+            out.append(" # section comment");
+        }
+
+        out.append(eol);
+
+        for (const CorpusKeypair &keypair : section.keypairs) {
+
+            if (random.below(6) == 0) {
+                out.append(random.below(2) == 0 ? "#" : ";").append(" comment = line").append(eol);
+            }
+
+            out.append(randomSpaces(random)).append(keypair.key).append(randomSpaces(random)).append("=");
+            out.append(randomSpaces(random));
+
+            /* an empty unquoted value would take the comment after it as the value */
+            if (random.below(3) == 0 || keypair.value.empty()) {
+                out.append("\"");
+                for (char c : keypair.value) {
+                    if (c == '"' || c == '\\') out.push_back('\\');
+                    out.push_back(c);
+                }
+                out.append("\"");
+            } else {
+                out.append(keypair.value);
+            }
+
+            if (random.below(4) == 0) {
+                out.append(" ;trailing comment");
+            } else {
+                out.append(randomSpaces(random));
+            }
+
+            out.append(eol);
+
+        }
+
+        out.append(eol);
+
+    }
+
+    return out;
+}
+
+string generateIni(size_t size, uint64_t seed)
+{
+    CorpusRandom random(seed);
+    string out;
+
+    while (out.size() < size) {
+
+        CorpusDocument document = generateDocument(random, 1, 20);
+
+        if (document.empty()) continue;
+
+        out.append(renderCanonical(document, random));
+
+    }
+
+    return out;
+}
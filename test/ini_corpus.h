@@ -0,0 +1,59 @@
+/*
+ * Generated config files for the differential test and the benchmarks
+ */
+
+#ifndef LIBTHINKPAD_INI_CORPUS_H
+#define LIBTHINKPAD_INI_CORPUS_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct CorpusKeypair {
+    std::string key;
+    std::string value;
+};
+
+struct CorpusSection {
+    std::string name;
+    std::vector<CorpusKeypair> keypairs;
+};
+
+typedef std::vector<CorpusSection> CorpusDocument;
+
+/**
+ * xorshift64*, the corpus has to be the same on every run
+ */
+class CorpusRandom {
+    uint64_t state;
+public:
+    CorpusRandom(uint64_t seed) : state(seed != 0 ? seed : 1) {}
+    uint64_t next();
+    size_t below(size_t bound);
+};
+
+/**
+ * @brief make a random document out of names, keys and values both
+ * parsers read the same way
+ */
+CorpusDocument generateDocument(CorpusRandom &random, size_t maxSections, size_t maxKeypairs);
+
+/**
+ * @brief render a document the way the old parser understands it:
+ * key=value lines, every line ends with '\n'
+ */
+std::string renderCanonical(const CorpusDocument &document, CorpusRandom &random);
+
+/**
+ * @brief render a document with everything only the new parser understands:
+ * comments, whitespace around names, keys and values, quoted values and CRLF
+ */
+std::string renderDecorated(const CorpusDocument &document, CorpusRandom &random);
+
+/**
+ * @brief a canonical file of about the given size, made of sections of
+ * about 20 keypairs
+ */
+std::string generateIni(size_t size, uint64_t seed);
+
+#endif
@@ -0,0 +1,118 @@
+/*
+ * Differential test of the config parser: generated files are read with
+ * the old parser and with Ini::readIniBuffer(), and the sections have to
+ * come out the same. The same documents are also rendered with comments,
+ * whitespace, quoting and CRLF, which the new parser has to read back
+ * the same as the old parser reads the plain rendering.
+ */
+
+#include "libthinkpad.h"
+#include "ini_baseline.h"
+#include "ini_corpus.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+
+using ThinkPad::Utilities::Ini::Ini;
+using ThinkPad::Utilities::Ini::IniSection;
+using ThinkPad::Utilities::Ini::IniKeypair;
+
+static bool compare(const vector<IniSection*> &expected, const vector<IniSection*> &actual, string *mismatch)
+{
+    char buf[256];
+
+    if (expected.size() != actual.size()) {
+        snprintf(buf, sizeof(buf), "%zu sections instead of %zu", actual.size(), expected.size());
+        *mismatch = buf;
+        return false;
+    }
+
+    for (size_t i = 0; i < expected.size(); i++) {
+
+        const IniSection &section = *expected[i];
+
+        if (strcmp(section.name, actual[i]->name) != 0) {
+            *mismatch = "section " + std::to_string(i) + ": name '" + actual[i]->name + "' instead of '" + section.name + "'";
+            return false;
+        }
+
+        const vector<IniKeypair*> &keypairs = *actual[i]->keypairs;
+
+        if (section.keypairs->size() != keypairs.size()) {
+            snprintf(buf, sizeof(buf), "section %s: %zu keypairs instead of %zu", section.name, keypairs.size(), section.keypairs->size());
+            *mismatch = buf;
+            return false;
+        }
+
+        for (size_t j = 0; j < keypairs.size(); j++) {
+            const IniKeypair *old = section.keypairs->at(j);
+            if (strcmp(old->key, keypairs[j]->key) != 0 || strcmp(old->value, keypairs[j]->value) != 0) {
+                *mismatch = string("section ") + section.name + ": keypair '" + keypairs[j]->key + "=" + keypairs[j]->value +
+                            "' instead of '" + old->key + "=" + old->value + "'";
+                return false;
+            }
+        }
+
+    }
+
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    const uint64_t seed = argc > 1 ? strtoull(argv[1], NULL, 0) : 0x5eed;
+    const int documents = argc > 2 ? atoi(argv[2]) : 2000;
+
+    CorpusRandom random(seed);
+    int failures = 0;
+
+    for (int i = 0; i < documents; i++) {
+
+        CorpusDocument document = generateDocument(random, 6, 12);
+
+        const string canonical = renderCanonical(document, random);
+        const string decorated = renderDecorated(document, random);
+
+        vector<IniSection*> *expected = baselineParse(canonical.data(), canonical.size());
+
+        const struct {
+            const char *dialect;
+            const string &text;
+        } inputs[] = {
+                { "plain", canonical },
+                { "decorated", decorated },
+        };
+
+        for (const auto &input : inputs) {
+
+            Ini ini;
+            string mismatch;
+
+            vector<IniSection*> *sections = ini.readIniBuffer(input.text.data(), input.text.size(), input.dialect);
+
+            if (!compare(*expected, *sections, &mismatch)) {
+                fprintf(stderr, "document %d (%s): %s\n--- input ---\n%s--- end ---\n", i, input.dialect, mismatch.c_str(),
+                        input.text.c_str());
+                failures++;
+            }
+
+        }
+
+        baselineFree(expected);
+
+        if (failures > 10) {
+            break;
+        }
+
+    }
+
+    if (failures > 0) {
+        fprintf(stderr, "%d mismatches, seed %#llx\n", failures, (unsigned long long) seed);
+        return 1;
+    }
+
+    printf("%d documents, no mismatches\n", documents);
+
+    return 0;
+}
@@ -0,0 +1,304 @@
+/*
+ * Unit tests of the config parser and of saving the changes back
+ */
+
+#include "libthinkpad.h"
+#include "check.h"
+
+#include <clocale>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+
+using ThinkPad::Utilities::Ini::Ini;
+using ThinkPad::Utilities::Ini::IniSection;
+using ThinkPad::Utilities::Ini::IniSnapshot;
+using ThinkPad::Utilities::Ini::IniKey;
+
+static string testPath;
+
+static void writeFile(const string &contents)
+{
+    FILE *file = fopen(testPath.c_str(), "w");
+    fwrite(contents.data(), 1, contents.size(), file);
+    fclose(file);
+}
+
+static string readFile()
+{
+    string contents;
+    char buffer[4096];
+    size_t size;
+
+    FILE *file = fopen(testPath.c_str(), "r");
+    while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        contents.append(buffer, size);
+    }
+    fclose(file);
+
+    return contents;
+}
+
+/* set a value, save it, and check the file and a fresh parse of it */
+static void setAndSave(Ini &ini, const char *section, const char *key, const char *value, const string &expected)
+{
+    ini.getSections(section)[0]->setString(key, value);
+    CHECK(ini.saveChanges(testPath));
+    CHECK_STR(readFile(), expected);
+
+    Ini reread;
+    reread.readIni(testPath);
+    CHECK(reread.getSections(section).size() == 1);
+    if (!reread.getSections(section).empty()) {
+        const char *read = reread.getSections(section)[0]->getString(key);
+        CHECK_STR(read != nullptr ? read : "(null)", value);
+    }
+}
+
+static void testEmptyValueEditedTwice()
+{
+    writeFile("[a]\nk=\nz=1\n");
+
+    Ini ini;
+    ini.readIni(testPath);
+
+    setAndSave(ini, "a", "k", "abc", "[a]\nk=abc\nz=1\n");
+    setAndSave(ini, "a", "k", "xyz", "[a]\nk=xyz\nz=1\n");
+    setAndSave(ini, "a", "z", "2", "[a]\nk=xyz\nz=2\n");
+}
+
+static void testEmptyValueAtTheEnd()
+{
+    writeFile("[a]\nk=");
+
+    Ini ini;
+    ini.readIni(testPath);
+
+    setAndSave(ini, "a", "k", "1", "[a]\nk=1");
+    setAndSave(ini, "a", "k", "", "[a]\nk=");
+    setAndSave(ini, "a", "k", "22", "[a]\nk=22");
+}
+
+static void testResizedValues()
+{
+    writeFile("[a]\nx=1\ny=2\n\n[b]\nz=3\n");
+
+    Ini ini;
+    ini.readIni(testPath);
+
+    setAndSave(ini, "a", "x", "long", "[a]\nx=long\ny=2\n\n[b]\nz=3\n");
+    setAndSave(ini, "b", "z", "", "[a]\nx=long\ny=2\n\n[b]\nz=\n");
+    setAndSave(ini, "a", "new", "n", "[a]\nx=long\ny=2\nnew=n\n\n[b]\nz=\n");
+    setAndSave(ini, "b", "z", "4", "[a]\nx=long\ny=2\nnew=n\n\n[b]\nz=4\n");
+    setAndSave(ini, "a", "y", "", "[a]\nx=long\ny=\nnew=n\n\n[b]\nz=4\n");
+    setAndSave(ini, "a", "y", "5", "[a]\nx=long\ny=5\nnew=n\n\n[b]\nz=4\n");
+}
+
+static void testStringArrays()
+{
+    IniSection section("a");
+
+    vector<const char*> empty;
+    section.setStringArray("k", &empty);
+    CHECK(section.getStringArray("k").empty());
+
+    vector<const char*> one = { "" };
+    section.setStringArray("k", &one);
+    vector<const char*> read = section.getStringArray("k");
+    CHECK(read.size() == 1);
+    if (read.size() == 1) CHECK_STR(read[0], "");
+
+    vector<const char*> two = { "", "" };
+    section.setStringArray("k", &two);
+    CHECK(section.getStringArray("k").size() == 2);
+    CHECK(section.getString("k_len") == nullptr);
+
+    vector<const char*> escaped = { "a,b", "c\\d" };
+    section.setStringArray("k", &escaped);
+    read = section.getStringArray("k");
+    CHECK(read.size() == 2);
+    if (read.size() == 2) {
+        CHECK_STR(read[0], "a,b");
+        CHECK_STR(read[1], "c\\d");
+    }
+
+    /* the decoded array follows the value */
+    section.setString("k", "x,y,z");
+    read = section.getStringArray("k");
+    CHECK(read.size() == 3);
+    if (read.size() == 3) CHECK_STR(read[2], "z");
+
+    strcpy((*section.keypairs)[0]->value, "q");
+    read = section.getStringArray("k");
+    CHECK(read.size() == 1);
+    if (read.size() == 1) CHECK_STR(read[0], "q");
+}
+
+static void testDurations()
+{
+    IniSection section("a");
+    std::chrono::milliseconds milliseconds(-1);
+    std::chrono::seconds seconds(-1);
+
+    section.setString("d", "1500ms");
+    CHECK(section.get("d", &milliseconds) && milliseconds.count() == 1500);
+    CHECK(!section.get("d", &seconds) && seconds.count() == -1);
+
+    section.setString("d", "2000ms");
+    CHECK(section.get("d", &seconds) && seconds.count() == 2);
+
+    section.setString("d", "3");
+    CHECK(section.get("d", &seconds) && seconds.count() == 3);
+    CHECK(section.get("d", &milliseconds) && milliseconds.count() == 3);
+
+    section.setString("d", "2h");
+    CHECK(section.get("d", &seconds) && seconds.count() == 7200);
+    CHECK(section.get("d", &milliseconds) && milliseconds.count() == 7200000);
+
+    /* fits as seconds, overflows as milliseconds */
+    section.setString("d", "9223372036854776s");
+    CHECK(section.get("d", &seconds) && seconds.count() == 9223372036854776LL);
+    CHECK(!section.get("d", &milliseconds));
+
+    section.setString("d", "-9223372036854775808h");
+    CHECK(!section.get("d", &seconds));
+
+    section.setString("d", "5 parsecs");
+    CHECK(!section.get("d", &seconds));
+}
+
+static void testDoublesUnderCommaLocale()
+{
+    static const char *locales[] = {"de_DE.UTF-8", "de_DE.utf8", "de_DE", "fr_FR.UTF-8", "fr_FR", "ru_RU.UTF-8", "nl_NL.UTF-8"};
+    const char *found = nullptr;
+
+    for (const char *locale : locales) {
+        if (setlocale(LC_NUMERIC, locale) != nullptr && strcmp(localeconv()->decimal_point, ",") == 0) {
+            found = locale;
+            break;
+        }
+    }
+
+    if (found == nullptr) {
+        setlocale(LC_NUMERIC, "C");
+        fprintf(stderr, "no comma decimal locale, skipping the locale checks\n");
+        return;
+    }
+
+    IniSection section("a");
+    double value = 0;
+
+    section.set<double>("d", 1.5);
+    CHECK_STR(section.getString("d"), "1.5");
+
+    section.setString("d", "2.25");
+    CHECK(section.get("d", &value) && value == 2.25);
+
+    /* the locale's own format is not a number in the file */
+    section.setString("d", "2,25");
+    CHECK(!section.get("d", &value));
+
+    setlocale(LC_NUMERIC, "C");
+}
+
+static void testDirectoryMerge(const char *directory)
+{
+    const string first = string(directory) + "/10-first.conf";
+    const string second = string(directory) + "/20-second.conf";
+
+    FILE *file = fopen(first.c_str(), "w");
+    fputs("[a]\nk=1\nk=2\nkeep=x\n", file);
+    fclose(file);
+
+    file = fopen(second.c_str(), "w");
+    fputs("[a]\nk=3\nnew=y\nnew=z\n", file);
+    fclose(file);
+
+    Ini ini;
+    CHECK(ini.readIniDirectory(directory) != nullptr);
+
+    IniSection *section = ini.getSections("a").empty() ? nullptr : ini.getSections("a")[0];
+    CHECK(section != nullptr);
+
+    if (section != nullptr) {
+        string merged;
+        for (auto keypair : *section->keypairs) {
+            merged += string(keypair->key) + "=" + keypair->value + ";";
+        }
+        CHECK_STR(merged, "keep=x;k=3;new=y;new=z;");
+        CHECK_STR(section->getString("k"), "3");
+    }
+
+    unlink(first.c_str());
+    unlink(second.c_str());
+}
+
+static void testKeysOnSnapshots()
+{
+    const string file = "[a]\nk=1\nk=2\n[b]\nk=3\n";
+
+    Ini ini;
+    ini.readIniBuffer(file.data(), file.size());
+
+    IniSnapshot *first = ini.freeze();
+
+    IniKey a = ini.compileKey("a", "k");
+    IniKey b("b", "k");
+
+    CHECK_STR(a.getString(), "1");
+    CHECK_STR(a.getString(first), "1");
+    CHECK_STR(b.getString(first), "3");
+    CHECK(b.getString() == nullptr);
+
+    ini.getSections("b")[0]->setString("k", "4");
+    IniSnapshot *second = ini.freeze();
+
+    CHECK_STR(b.getString(second), "4");
+    CHECK_STR(b.getString(first), "3");
+
+    /* a snapshot written to the disk and opened again is a different one */
+    const string path = testPath + ".snapshot";
+    CHECK(ini.writeSnapshot(path));
+
+    IniSnapshot opened;
+    CHECK(opened.open(path, ""));
+    CHECK_STR(b.getString(&opened), "4");
+
+    ini.getSections("b")[0]->setString("k", "5");
+    CHECK(ini.writeSnapshot(path));
+    CHECK(opened.open(path, ""));
+    CHECK_STR(b.getString(&opened), "5");
+
+    unlink(path.c_str());
+    delete first;
+    delete second;
+}
+
+int main()
+{
+    char path[] = "/tmp/libthinkpad-ini-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+    testPath = path;
+
+    testEmptyValueEditedTwice();
+    testEmptyValueAtTheEnd();
+    testResizedValues();
+    testStringArrays();
+    testDurations();
+    testDoublesUnderCommaLocale();
+    testKeysOnSnapshots();
+
+    char directory[] = "/tmp/libthinkpad-conf.d-XXXXXX";
+    CHECK(mkdtemp(directory) != nullptr);
+    testDirectoryMerge(directory);
+    rmdir(directory);
+
+    unlink(path);
+
+    return checkResult();
+}
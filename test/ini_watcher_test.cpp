@@ -0,0 +1,172 @@
+/*
+ * Tests of the live config reload: readers racing the reloads and
+ * a held reader keeping its snapshot alive
+ */
+
+#include "libthinkpad.h"
+#include "check.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <unistd.h>
+
+using ThinkPad::Utilities::Ini::IniWatcher;
+using ThinkPad::Utilities::Ini::IniSnapshot;
+using ThinkPad::Utilities::Ini::IniKey;
+
+static string testPath;
+
+static void writeConfig(int version)
+{
+    /* replace the file with a rename, like editors do */
+    string temporary = testPath + ".new";
+    FILE *file = fopen(temporary.c_str(), "w");
+    fprintf(file, "[a]\nversion=%d\ncheck=%d\n", version, version * 7);
+    fclose(file);
+    rename(temporary.c_str(), testPath.c_str());
+}
+
+static bool waitForGeneration(IniWatcher &watcher, uint64_t generation)
+{
+    for (int i = 0; i < 2000; i++) {
+        if (watcher.current().getGeneration() >= generation) return true;
+        usleep(1000);
+    }
+    return false;
+}
+
+static bool waitForVersion(IniWatcher &watcher, const char *version)
+{
+    for (int i = 0; i < 2000; i++) {
+        IniWatcher::Reader reader = watcher.current();
+        const char *current = reader.get() != nullptr ? reader->getString("a", "version") : nullptr;
+        if (current != nullptr && strcmp(current, version) == 0) return true;
+        usleep(1000);
+    }
+    return false;
+}
+
+static std::atomic<bool> stopReading(false);
+static std::atomic<int> torn(0);
+
+static void *readLoop(void *_watcher)
+{
+    IniWatcher *watcher = (IniWatcher*) _watcher;
+
+    while (!stopReading.load()) {
+
+        IniWatcher::Reader reader = watcher->current();
+        const char *version = reader->getString("a", "version");
+        const char *check = reader->getString("a", "check");
+
+        if (version == nullptr || check == nullptr || atoi(version) * 7 != atoi(check)) {
+            torn++;
+        }
+
+    }
+
+    return NULL;
+}
+
+static void testReadersDuringReloads(IniWatcher &watcher)
+{
+    pthread_t threads[4];
+
+    for (pthread_t &thread : threads) {
+        pthread_create(&thread, NULL, readLoop, &watcher);
+    }
+
+    for (int version = 2; version < 50; version++) {
+        writeConfig(version);
+        usleep(2000);
+    }
+
+    CHECK(waitForGeneration(watcher, 2));
+
+    /* the last reload has to land before the next test counts generations */
+    CHECK(waitForVersion(watcher, "49"));
+
+    stopReading = true;
+
+    for (pthread_t &thread : threads) {
+        pthread_join(thread, NULL);
+    }
+
+    CHECK(torn.load() == 0);
+}
+
+static void testHeldReader(IniWatcher &watcher)
+{
+    IniWatcher::Reader held = watcher.current();
+    const uint64_t generation = held.getGeneration();
+    const string version = held->getString("a", "version");
+
+    writeConfig(100);
+    usleep(50 * 1000);
+
+    /* the reload is waiting for this reader, the snapshot is still the old one */
+    CHECK(held.getGeneration() == generation);
+    CHECK_STR(held->getString("a", "version"), version);
+
+    {
+        IniWatcher::Reader moved(std::move(held));
+        CHECK_STR(moved->getString("a", "version"), version);
+    }
+
+    CHECK(waitForGeneration(watcher, generation + 1));
+    CHECK(waitForVersion(watcher, "100"));
+}
+
+static void testKeyAcrossReloads(IniWatcher &watcher)
+{
+    IniKey version("a", "version");
+    IniKey missing("a", "missing");
+
+    {
+        IniWatcher::Reader reader = watcher.current();
+        CHECK_STR(version.getString(reader.get()), "100");
+        CHECK(missing.getString(reader.get()) == nullptr);
+
+        /* the same snapshot answers from the cache */
+        CHECK(version.getString(reader.get()) == version.getString(reader.get()));
+    }
+
+    const uint64_t generation = watcher.current().getGeneration();
+
+    writeConfig(200);
+    CHECK(waitForGeneration(watcher, generation + 1));
+    CHECK(waitForVersion(watcher, "200"));
+
+    IniWatcher::Reader reader = watcher.current();
+    CHECK_STR(version.getString(reader.get()), "200");
+    CHECK(version.getString(nullptr) == nullptr);
+}
+
+int main()
+{
+    char directory[] = "/tmp/libthinkpad-watch-XXXXXX";
+    if (mkdtemp(directory) == nullptr) {
+        perror("mkdtemp");
+        return 1;
+    }
+    testPath = string(directory) + "/test.ini";
+
+    writeConfig(1);
+
+    {
+        IniWatcher watcher(testPath);
+
+        CHECK(watcher.current().get() == nullptr);
+        CHECK(watcher.start());
+        CHECK(watcher.current().getGeneration() == 1);
+
+        testReadersDuringReloads(watcher);
+        testHeldReader(watcher);
+        testKeyAcrossReloads(watcher);
+    }
+
+    unlink(testPath.c_str());
+    rmdir(directory);
+
+    return checkResult();
+}
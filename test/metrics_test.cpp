@@ -0,0 +1,170 @@
+/*
+ * Tests of the metrics exporter: what it does with the file at its
+ * path, and the text it serves from the event loop
+ */
+
+#include "libthinkpad.h"
+#include "check.h"
+
+#include <atomic>
+#include <fcntl.h>
+#include <linux/input.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using ThinkPad::PowerManagement::ACPI;
+using ThinkPad::PowerManagement::ACPIEvent;
+using ThinkPad::PowerManagement::ACPIEventHandler;
+using ThinkPad::Utilities::MetricsExporter;
+
+class CountingHandler : public ACPIEventHandler {
+public:
+    std::atomic<int> total;
+
+    CountingHandler() : total(0) {}
+
+    void handleEvent(ACPIEvent event) override {
+        total++;
+    }
+};
+
+static bool isSocket(const string &path)
+{
+    struct stat st;
+    return lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode);
+}
+
+static string fetch(const string &path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return string();
+    }
+
+    string text;
+    char buf[4096];
+    ssize_t len;
+
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+        text.append(buf, (size_t) len);
+    }
+
+    close(fd);
+    return text;
+}
+
+static void testOtherFileKept(const string &path)
+{
+    FILE *file = fopen(path.c_str(), "w");
+    fputs("keep me\n", file);
+    fclose(file);
+
+    {
+        MetricsExporter exporter(path);
+        CHECK(!exporter.open(nullptr));
+    }
+
+    char buf[16] = {0};
+    file = fopen(path.c_str(), "r");
+    CHECK(file != nullptr && fgets(buf, sizeof(buf), file) != nullptr);
+    if (file != nullptr) fclose(file);
+    CHECK_STR(buf, "keep me\n");
+
+    unlink(path.c_str());
+}
+
+static void testStaleSocketReplaced(const string &path)
+{
+    /* a socket nobody listens on any more */
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    int stale = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    CHECK(bind(stale, (struct sockaddr*) &addr, sizeof(addr)) == 0);
+    close(stale);
+
+    CHECK(isSocket(path));
+
+    {
+        MetricsExporter exporter(path);
+        CHECK(exporter.open(nullptr));
+        exporter.close();
+    }
+}
+
+static void testServedFromLoop(const string &path)
+{
+    int input[2];
+    CHECK(pipe2(input, O_CLOEXEC) == 0);
+
+    struct input_event presses[3];
+    memset(presses, 0, sizeof(presses));
+
+    for (struct input_event &press : presses) {
+        press.type = EV_KEY;
+        press.code = KEY_MUTE;
+        press.value = 1;
+    }
+
+    CountingHandler handler;
+    string text;
+
+    {
+        ACPI acpi;
+
+        acpi.addEventHandler(&handler);
+        acpi.addInputDevice(input[0]);
+        acpi.addEventSource(new MetricsExporter(path));
+        acpi.start();
+
+        CHECK(write(input[1], presses, sizeof(presses)) == (ssize_t) sizeof(presses));
+
+        for (int i = 0; i < 500 && handler.total.load() < 3; i++) {
+            usleep(10 * 1000);
+        }
+
+        CHECK(handler.total.load() == 3);
+
+        for (int i = 0; i < 500 && text.empty(); i++) {
+            text = fetch(path);
+            if (text.empty()) usleep(10 * 1000);
+        }
+
+        close(input[1]);
+    }
+
+    /* every dispatch is timed once, on the loop thread */
+    CHECK(text.find("thinkpad_events_total{event=\"BUTTON_MUTE\"} 3\n") != string::npos);
+    CHECK(text.find("thinkpad_dispatch_latency_seconds_count 3\n") != string::npos);
+}
+
+int main()
+{
+    char directory[] = "/tmp/libthinkpad-metrics-XXXXXX";
+    if (mkdtemp(directory) == nullptr) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    const string path = string(directory) + "/metrics.sock";
+
+    testOtherFileKept(path);
+    testStaleSocketReplaced(path);
+    testServedFromLoop(path);
+
+    unlink(path.c_str());
+    rmdir(directory);
+
+    return checkResult();
+}
@@ -0,0 +1,75 @@
+/*
+ * The vector scanning kernels against the scalar ones, on random
+ * buffers at every offset and length. The kernels are static, so the
+ * library source is built into the test.
+ */
+
+#include "../src/libthinkpad.cpp"
+#include "check.h"
+
+using namespace ThinkPad;
+
+static bool supported(const char *name)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (strcmp(name, "avx2") == 0) return __builtin_cpu_supports("avx2");
+    if (strcmp(name, "sse2") == 0) return __builtin_cpu_supports("sse2");
+#endif
+    return false;
+}
+
+static void testKernels(const char *name, ScanFunction scan, ScanValueFunction scanValue)
+{
+    if (!supported(name)) {
+        fprintf(stderr, "%s not supported by the CPU, skipping\n", name);
+        return;
+    }
+
+    /* few enough characters that every kind of hit turns up */
+    static const char chars[] = "ab \t;#\n=";
+    uint64_t state = 88172645463325252ULL;
+
+    for (int round = 0; round < 200; round++) {
+
+        char buffer[96];
+
+        for (char &c : buffer) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            c = chars[state % (sizeof(chars) - 1)];
+        }
+
+        for (size_t begin = 0; begin < sizeof(buffer); begin++) {
+            for (size_t end = begin; end <= sizeof(buffer); end++) {
+
+                const char *from = buffer + begin, *to = buffer + end;
+
+                if (scan(from, to, ";#\n", 3) != scanScalar(from, to, ";#\n", 3)
+                    || scanValue(from, to) != scanValueScalar(from, to)) {
+                    fprintf(stderr, "%s: mismatch at %zu-%zu of \"%.*s\"\n", name, begin, end, (int) sizeof(buffer), buffer);
+                    checkFailures++;
+                    return;
+                }
+
+            }
+        }
+
+    }
+}
+
+int main()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    testKernels("sse2", scanSSE2, scanValueSSE2);
+    testKernels("avx2", scanAVX2, scanValueAVX2);
+#endif
+
+    /* a comment right after the start does not count, the character before is not looked at */
+    const char value[] = "a ;b";
+    CHECK(scanValueScalar(value + 2, value + 4) == nullptr);
+    CHECK(scanValueScalar(value, value + 4) == value + 2);
+
+    return checkResult();
+}